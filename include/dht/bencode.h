@@ -23,6 +23,25 @@ extern "C" {
 
 #include <stdio.h>
 
+/*!
+ * 内存解码器接受的最大嵌套深度
+ */
+#define BDECODE_MAX_DEPTH 64
+
+/*!
+ * B解码的限制
+ *
+ * Bounds enforced by \ref bdecode_buf_limits on untrusted input. The buffer
+ * is validated against them before anything is allocated, so oversized or
+ * malformed data is rejected in time linear to its length.
+ */
+struct bdecode_limits {
+    unsigned int max_depth;     /*!< maximum nesting of lists and dictionaries
+                                     (capped to \ref BDECODE_MAX_DEPTH) */
+    size_t max_values;          /*!< maximum number of values, dictionary keys
+                                     included */
+};
+
 /*!
  * B编码的值
  *
@@ -51,7 +70,8 @@ struct bvalue {
          * 字符串值
          */
         struct {
-            unsigned char *bytes;   /*!< string pointer (zero-terminated) */
+            unsigned char *bytes;   /*!< string pointer (zero-terminated,
+                                         except in views) */
             size_t len;             /*!< length of the string */
         } s;
         /*!
@@ -60,14 +80,19 @@ struct bvalue {
         struct {
             struct bvalue **array;  /*!< array of elements */
             size_t len;             /*!< number of elements */
+            size_t cap;             /*!< allocated size of array */
         } l;
         /*!
          * 字典值
          */
         struct {
             char **key;             /*!< array of keys (in lexicographical order) */
+            size_t *key_len;        /*!< array of key lengths */
             struct bvalue **val;    /*!< array of values */
             size_t len;             /*!< number of key-value pairs */
+            size_t cap;             /*!< allocated size of the arrays */
+            int sorted;             /*!< keys are known to be in order
+                                         (decoded dictionaries may not be) */
         } d;
     };
 };
@@ -88,6 +113,28 @@ struct bvalue *bvalue_new_dict(void);
  * \returns Pointer to newly allocated value, or NULL on allocation failure.
  */
 struct bvalue *bvalue_new_list(void);
+/*!
+ * 分配指定容量的字典值
+ *
+ * Same as \ref bvalue_new_dict, but room for \a n keys is reserved up
+ * front so that the first \a n calls to \ref bvalue_dict_set do not need
+ * to grow the dictionary.
+ *
+ * \param n Number of keys to reserve room for.
+ * \returns Pointer to newly allocated value, or NULL on allocation failure.
+ */
+struct bvalue *bvalue_new_dict_sized(size_t n);
+/*!
+ * 分配指定容量的列表值
+ *
+ * Same as \ref bvalue_new_list, but room for \a n elements is reserved up
+ * front so that the first \a n calls to \ref bvalue_list_append do not
+ * need to grow the list.
+ *
+ * \param n Number of elements to reserve room for.
+ * \returns Pointer to newly allocated value, or NULL on allocation failure.
+ */
+struct bvalue *bvalue_new_list_sized(size_t n);
 /*!
  * 分配一个整数值
  *
@@ -125,6 +172,15 @@ struct bvalue *bvalue_copy(const struct bvalue *val);
  * \param val The value to free.
  */
 void bvalue_free(struct bvalue *val);
+/*!
+ * 释放B编码值视图
+ *
+ * Free a value returned by \ref bdecode_buf_view. Only the tree structure is
+ * released, the strings it points to belong to the decoded buffer.
+ *
+ * \param val The value to free.
+ */
+void bvalue_free_view(struct bvalue *val);
 
 /*!
  * 将值附加到列表。
@@ -226,6 +282,13 @@ int bvalue_integer_ll(const struct bvalue *val, long long int *intval);
 /*!
  * 分析B编码文件
  *
+ * Reads exactly one value from \a stream. Only use this on trusted input,
+ * such as a file written by \ref bencode_file: unlike the memory decoders,
+ * it recurses once per nesting level with no depth bound, does not detect
+ * integer or length overflows, and allocates strings before checking that
+ * the stream holds enough data. Read untrusted data into memory and decode
+ * it with \ref bdecode_buf_limits instead.
+ *
  * \param stream Stream to parse (FILE pointer).
  * \returns Parsed value or NULL if parsing failed.
  */
@@ -247,6 +310,35 @@ int bencode_file(const struct bvalue *val, FILE *stream);
  * \returns Parsed value or NULL if parsing failed.
  */
 struct bvalue *bdecode_buf(const unsigned char *buf, size_t len);
+/*!
+ * 分析B编码字符串缓冲(不复制字符串)
+ *
+ * This function is analog to \ref bdecode_buf, except that string values and
+ * dictionary keys are not copied: they point directly into \a buf and are
+ * not null-terminated. \a buf must therefore remain valid and unmodified for
+ * as long as the returned value is in use. The returned tree is meant to be
+ * read only; use \ref bvalue_copy to get a regular value out of it. It must be
+ * freed with \ref bvalue_free_view.
+ *
+ * \param buf string buffer to parse.
+ * \param len Length to parse.
+ * \returns Parsed value or NULL if parsing failed.
+ */
+struct bvalue *bdecode_buf_view(const unsigned char *buf, size_t len);
+/*!
+ * 在限制内分析B编码字符串缓冲
+ *
+ * This function is analog to \ref bdecode_buf, except that decoding fails if
+ * the data is nested deeper or contains more values than allowed by
+ * \a limits. The other memory decoders only enforce \ref BDECODE_MAX_DEPTH.
+ *
+ * \param buf string buffer to parse.
+ * \param len Length to parse.
+ * \param limits Decoding limits.
+ * \returns Parsed value or NULL if parsing failed.
+ */
+struct bvalue *bdecode_buf_limits(const unsigned char *buf, size_t len,
+                                  const struct bdecode_limits *limits);
 /*!
  * B编码值到一个字符串缓冲
  *
@@ -29,6 +29,7 @@ typedef int socklen_t;
 #endif
 
 #include "bencode.h"
+#include "utils.h"
 
 /*!
  * DHT的搜索类型
@@ -48,15 +49,21 @@ enum dht_search_type {
  */
 struct search_node {
     unsigned char id[20];           /*!< Node identifier */
-    struct sockaddr_storage addr;   /*!< Node address */
-    socklen_t addrlen;              /*!< Length of \a addr field */
+    struct dht_endpoint addr;       /*!< Node address */
     struct timeval reply_time;      /*!< Query reply time */
+    struct timeval query_time;      /*!< Last query send time */
+    struct timeval stale_time;      /*!< When the last query is presumed
+                                         lost */
     struct timeval next_query;      /*!< When to send next query */
+    unsigned int rtt;               /*!< Smoothed round-trip time in
+                                         milliseconds, 0 if unknown */
     int queried;                    /*!< Number of queries sent with no reply */
+    int pending;                    /*!< Whether a query is in flight */
+    uint16_t tid;                   /*!< Transaction ID of that query */
     unsigned char *token;           /*!< Storage token */
     size_t token_len;               /*!< Length of token string */
     struct search_node *next;       /*!< Next node in the list */
-    struct sockaddr_storage *peers; /*!< Array of peer addresses */
+    struct dht_endpoint *peers;     /*!< Array of peer addresses */
     struct bvalue *v;               /*!< value received in reply to get query */
     int seq;                        /*!< \a v's sequence number */
     size_t peer_count;              /*!< Number of entries in \a peers array */
@@ -97,6 +104,33 @@ typedef void (*node_output_t)(const unsigned char *data, size_t len,
                               const struct sockaddr *dest, socklen_t addrlen,
                               void *opaque);
 
+/*!
+ * UDP数据报
+ *
+ * One entry of a burst of datagrams, received (see
+ * \ref dht_node_input_batch) or to be sent (see \ref node_output_batch_t).
+ */
+struct dht_datagram {
+    const unsigned char *data;      /*!< Datagram data */
+    size_t len;                     /*!< Length of \a data */
+    const struct sockaddr *addr;    /*!< Sender or destination address */
+    socklen_t addrlen;              /*!< Length of the \a addr field */
+};
+
+/*!
+ * 节点批量输出时回调函数
+ *
+ * User-defined callback for sending several UDP datagrams at once, e.g.
+ * with sendmmsg(). See \ref dht_node_set_output_batch. The datagrams are
+ * only valid for the duration of the call.
+ *
+ * \param msgs Datagrams to send.
+ * \param count Number of entries in \a msgs.
+ * \param opaque User data pointer passed to \ref dht_node_init.
+ */
+typedef void (*node_output_batch_t)(const struct dht_datagram *msgs,
+                                    size_t count, void *opaque);
+
 /*!
  * 引导状态通知回调函数
  *
@@ -110,6 +144,17 @@ typedef void (*node_output_t)(const unsigned char *data, size_t len,
  */
 typedef void (*bootstrap_status_t)(int ready, void *opaque);
 
+/*!
+ * 路由表模式
+ *
+ * See \ref dht_node_set_routing_mode.
+ */
+enum dht_routing_mode {
+    DHT_ROUTING_NORMAL,     /*!< Every bucket holds 8 nodes */
+    DHT_ROUTING_WIDE,       /*!< The 4 buckets furthest from the node ID
+                                 hold 128, 64, 32 and 16 nodes */
+};
+
 /*!
  * 外部IP计数条目
  */
@@ -131,8 +176,26 @@ struct ip_counter {
 
 struct bucket;
 struct search;
+struct search_request;
 struct peer_list;
 struct put_item;
+struct output_queue;
+struct timer_heap;
+struct contact_queue;
+struct pending_query;
+struct cached_result;
+
+/*!
+ * 路由表
+ *
+ * Routing table of one address family.
+ */
+struct routing_table {
+    struct bucket *buckets[160];            /*!< Buckets, indexed by the
+                                                 length of the prefix shared
+                                                 with the node ID */
+    size_t bucket_count;                    /*!< Number of buckets in use */
+};
 
 /*!
  * DHT 节点对象
@@ -141,28 +204,49 @@ struct dht_node {
     unsigned char id[20];                   /*!< DHT node identifier */
     node_output_t output;                   /*!< Datagram output function */
     void *opaque;                           /*!< Output callback user data */
-    struct bucket *buckets;                 /*!< Bucket list */
+    struct routing_table tables[2];         /*!< IPv4 and IPv6 routing
+                                                 tables (BEP 32) */
+    enum dht_routing_mode routing_mode;     /*!< Routing table mode */
     struct {
         struct search *first;
         struct search **tail;
     } searches;                             /*!< List of pending searches */
     uint16_t tid;                           /*!< Transaction ID generation
                                                  counter */
+    struct pending_query *queries;          /*!< Search queries waiting for
+                                                 a response, by transaction
+                                                 ID */
+    size_t query_cap;                       /*!< Size of \a queries */
+    size_t query_count;                     /*!< Queries in flight */
+    struct cached_result *search_cache;     /*!< Recent search results */
+    unsigned int search_cache_ttl;          /*!< Lifetime of cached search
+                                                 results in seconds, 0 if
+                                                 disabled */
     struct ip_counter ip_counter;           /*!< External IP counter */
     unsigned char secret[16];               /*!< Secret for token generation */
     struct peer_list *peer_storage;         /*!< Peer list storage */
     struct put_item *put_storage;           /*!< Put data storage */
-    struct search *bootstrap;               /*!< Bootstrap search handle */
+    struct search_request *bootstrap;       /*!< Bootstrap search handle */
     bootstrap_status_t bootstrap_cb;        /*!< Bootstrap status callback */
     void *bootstrap_priv;                   /*!< Bootstrap callback user data */
+    struct timeval now;                     /*!< Time at which the current
+                                                 input is processed */
+    node_output_batch_t output_batch;       /*!< Batched output function */
+    struct output_queue *outq;              /*!< Datagrams waiting for
+                                                 \ref dht_node_flush */
+    struct timer_heap *timers;              /*!< Pending deadlines */
+    struct contact_queue *contacts;         /*!< Contacts waiting for
+                                                 verification */
 };
 
 /*!
  * Search handle.
  *
- * Handle to a pending DHT search.
+ * Handle to a pending DHT search. Each call to \ref dht_node_search returns
+ * its own handle, even when it shares the search with other callers. A
+ * handle is no longer valid once its completion callback has run.
  */
-typedef struct search *dht_search_t;
+typedef struct search_request *dht_search_t;
 
 /*!
  * 初始化 DHT 节点
@@ -207,7 +291,8 @@ int dht_node_start(struct dht_node *n);
  *
  * This function must be called upon reception of a UDP datagram for
  * the node. Note that his function may bring the node timeout forward.
- * (see \ref dht_node_timeout).
+ * (see \ref dht_node_timeout). With batched output, the replies it stages
+ * are not flushed: call \ref dht_node_flush afterwards.
  *
  * \param n The DHT node.
  * \param data Data received.
@@ -218,6 +303,22 @@ int dht_node_start(struct dht_node *n);
 void dht_node_input(struct dht_node *n, const unsigned char *data, size_t len,
                     const struct sockaddr *src, socklen_t addrlen);
 
+/*!
+ * 批量输入接收的UDP数据报
+ *
+ * Same as calling \ref dht_node_input for each of the \a count datagrams in
+ * \a msgs, but the clock is read only once for the whole burst. Meant for
+ * drivers that drain the socket several datagrams at a time (e.g. with
+ * recvmmsg()). With batched output, the replies it stages are not flushed:
+ * call \ref dht_node_flush afterwards.
+ *
+ * \param n The DHT node.
+ * \param msgs Received datagrams.
+ * \param count Number of entries in \a msgs.
+ */
+void dht_node_input_batch(struct dht_node *n,
+                          const struct dht_datagram *msgs, size_t count);
+
 /*!
  * Ping 远程节点
  *
@@ -233,6 +334,41 @@ void dht_node_input(struct dht_node *n, const unsigned char *data, size_t len,
 void dht_node_ping(struct dht_node *n, struct sockaddr *dest,
                    socklen_t addrlen);
 
+/*!
+ * 联系人
+ *
+ * Known DHT node, see \ref dht_node_add_contacts.
+ */
+struct dht_contact {
+    unsigned char id[20];                   /*!< Node identifier */
+    struct dht_endpoint addr;               /*!< Node address */
+};
+
+/*!
+ * 批量添加联系人
+ *
+ * Inserts a list of known nodes, e.g. from a crawl or from another node of
+ * the same fleet, directly into the routing tables. The buckets are split
+ * once up front for the whole list rather than node by node. Contacts that
+ * do not fit in their bucket are kept as replacement candidates.
+ *
+ * If \a verify is non-zero, the contacts added by this call are also pinged
+ * in the background, a few at a time from \ref dht_node_work, and dropped
+ * from the routing table if they do not respond. Nodes that were already
+ * known are left alone.
+ *
+ * \param n The DHT node.
+ * \param contacts Contacts to add.
+ * \param count Number of entries in \a contacts.
+ * \param verify Whether to ping the contacts.
+ * \returns The number of nodes added to the routing tables, or -1 if
+ *          memory could not be allocated for verification, in which case
+ *          the routing tables are left unchanged.
+ */
+int dht_node_add_contacts(struct dht_node *n,
+                          const struct dht_contact *contacts, size_t count,
+                          int verify);
+
 /*!
  * Get 节点超时
  *
@@ -250,7 +386,9 @@ void dht_node_timeout(struct dht_node *n, struct timeval *tv);
  * The user is required to call this function every so often to perform
  * maintenance work (routing table updates) on the node or make progress
  * on pending searches. It is recommended to call this function every second
- * or use \ref dht_node_timeout to figure out when to call.
+ * or use \ref dht_node_timeout to figure out when to call. With batched
+ * output, the queries it stages are not flushed: call \ref dht_node_flush
+ * afterwards.
  *
  * \param n The DHT node.
  */
@@ -260,7 +398,8 @@ void dht_node_work(struct dht_node *n);
  * 清理 DHT 节点
  *
  * Cleans up the \ref dht_node and frees all ressources used by the node. All
- * the pending searches will be cancelled.
+ * the pending searches will be cancelled. Datagrams still staged for
+ * batched output are flushed first.
  *
  * \param n The DHT node.
  */
@@ -279,6 +418,9 @@ void dht_node_cleanup(struct dht_node *n);
  * nodes found during the search.
  * This is a low-level interface, consider using functions in \ref peers.h or
  * \ref put.h instead.
+ * Starting a search for the same target and type as one that is still
+ * running does not send any new query: the caller joins the running search
+ * and its callback is called with the same list of nodes on completion.
  * The returned search handle becomes invalid after the search completes.
  *
  * \param n The DHT node.
@@ -301,7 +443,10 @@ int dht_node_search(struct dht_node *n, const unsigned char id[20],
  *
  * Cancels a currently running search and frees up associated ressources. The
  * search completion callback will be called immediately with a NULL list of
- * nodes.
+ * nodes. When the search is shared with other callers, only this caller's
+ * callback is cancelled and the search goes on for the others.
+ * Cancelling a search from its own completion callback does nothing, any
+ * other use of a handle whose callback has run is invalid.
  *
  * \param n The DHT node.
  * \param handle Handle to the search to cancel.
@@ -425,6 +570,176 @@ void dht_node_set_bootstrap_callback(struct dht_node *n,
                                      bootstrap_status_t callback,
                                      void *opaque);
 
+/*!
+ * 设置批量输出回调。
+ *
+ * Once a batched output callback is set, outgoing datagrams are no longer
+ * passed to the output callback of \ref dht_node_init one by one. They are
+ * staged in a buffer owned by the node instead, and handed over to
+ * \a output in bursts when \ref dht_node_flush is called (or when the
+ * buffer is full). Setting \a output to NULL flushes pending datagrams and
+ * goes back to unbatched output.
+ *
+ * \param n The DHT node.
+ * \param output Batched output callback, or NULL.
+ * \returns 0 on success or -1 if the staging buffer could not be allocated.
+ */
+int dht_node_set_output_batch(struct dht_node *n, node_output_batch_t output);
+
+/*!
+ * 发送暂存的数据报
+ *
+ * Passes all datagrams staged since the last flush to the batched output
+ * callback. When batched output is used, the driver must call this after
+ * every call that may send datagrams (\ref dht_node_input,
+ * \ref dht_node_input_batch, \ref dht_node_work, searches...), typically
+ * once per event loop iteration: none of them flushes on its own, staged
+ * datagrams are only sent early when the buffer fills up.
+ *
+ * \param n The DHT node.
+ */
+void dht_node_flush(struct dht_node *n);
+
+/*!
+ * 设置路由表模式
+ *
+ * Selects the size of the routing table buckets. In wide mode, the buckets
+ * covering the parts of the ID space furthest from the node ID are larger,
+ * so searches started by the node converge in fewer hops, at the cost of
+ * more memory and more pings to keep the table fresh. This is meant for
+ * long-running, high traffic nodes.
+ *
+ * The mode can only be changed while the routing table is empty, i.e.
+ * before \ref dht_node_start or \ref dht_node_restore.
+ *
+ * \param n The DHT node.
+ * \param mode Routing table mode.
+ * \returns 0 on success, or -1 if the routing table is not empty or memory
+ *          could not be allocated.
+ */
+int dht_node_set_routing_mode(struct dht_node *n, enum dht_routing_mode mode);
+
+/*!
+ * 设置搜索结果缓存
+ *
+ * Enables caching of the results of GET_PEERS and GET searches. The nodes
+ * that replied, with their tokens and the peers or values they returned,
+ * are kept for \a ttl seconds. A search for the same target and type
+ * started in the meantime completes from the cache on the next call to
+ * \ref dht_node_work, without sending any query.
+ *
+ * Announces and puts rely on the cached tokens, which remote nodes only
+ * accept for 5 to 10 minutes after handing them out. \a ttl is therefore
+ * capped at 5 minutes.
+ *
+ * \param n The DHT node.
+ * \param ttl Lifetime of cached results in seconds, at most 300, or 0 to
+ *            disable the cache and drop its content.
+ */
+void dht_node_set_search_cache(struct dht_node *n, unsigned int ttl);
+
+/*!
+ * 路由表快照条目
+ *
+ * One node of a routing table snapshot.
+ */
+struct dht_snapshot_entry {
+    unsigned char id[20];                   /*!< Node identifier */
+    struct dht_endpoint addr;               /*!< Node address */
+    struct timeval last_seen;               /*!< Last time the node was
+                                                 heard from */
+    unsigned int rtt;                       /*!< Smoothed round-trip time in
+                                                 milliseconds, 0 if unknown */
+    int pinged;                             /*!< Unanswered pings */
+};
+
+/*!
+ * 路由表快照
+ *
+ * Immutable, reference-counted copy of the routing tables. See
+ * \ref dht_node_snapshot.
+ */
+struct dht_snapshot;
+
+/*!
+ * 路由表快照迭代器
+ *
+ * Iterates over the nodes of a snapshot, IPv4 table first, by increasing
+ * bucket index. After \ref dht_snapshot_next returned an entry, \a bucket
+ * holds the index of its bucket.
+ */
+struct dht_snapshot_iter {
+    const struct dht_snapshot *snap;        /*!< Snapshot being iterated */
+    size_t table;                           /*!< Current table */
+    size_t bucket;                          /*!< Current bucket */
+    size_t pos;                             /*!< Position in the bucket */
+};
+
+/*!
+ * 获取路由表快照
+ *
+ * Takes a consistent snapshot of the node's routing tables. Buckets that
+ * did not change since the previous snapshot are shared with it rather
+ * than copied, so taking snapshots periodically is cheap.
+ *
+ * This must be called from the thread running the node. The snapshot is
+ * immutable: it can be handed over to other threads and read while the
+ * node keeps running. Release it with \ref dht_snapshot_unref.
+ *
+ * \param n The DHT node.
+ * \returns A snapshot with a reference count of 1, or NULL if memory could
+ *          not be allocated.
+ */
+struct dht_snapshot *dht_node_snapshot(struct dht_node *n);
+
+/*!
+ * 增加快照引用
+ *
+ * Takes an additional reference on a snapshot. Safe to call from any
+ * thread holding a reference.
+ *
+ * \param s The snapshot.
+ * \returns \a s.
+ */
+struct dht_snapshot *dht_snapshot_ref(struct dht_snapshot *s);
+
+/*!
+ * 释放快照引用
+ *
+ * Drops a reference on a snapshot, freeing it when the last one goes away.
+ * Safe to call from any thread.
+ *
+ * \param s The snapshot.
+ */
+void dht_snapshot_unref(struct dht_snapshot *s);
+
+/*!
+ * 快照的节点数
+ *
+ * \param s The snapshot.
+ * \param family AF_INET or AF_INET6.
+ * \returns The number of nodes in the routing table of \a family.
+ */
+size_t dht_snapshot_node_count(const struct dht_snapshot *s, int family);
+
+/*!
+ * 初始化快照迭代器
+ *
+ * \param it Iterator to initialize.
+ * \param s The snapshot to iterate over.
+ */
+void dht_snapshot_iter_init(struct dht_snapshot_iter *it,
+                            const struct dht_snapshot *s);
+
+/*!
+ * 快照的下一个节点
+ *
+ * \param it The iterator.
+ * \returns The next node of the snapshot, or NULL at the end. The entry is
+ *          valid as long as the snapshot is referenced.
+ */
+const struct dht_snapshot_entry *dht_snapshot_next(struct dht_snapshot_iter *it);
+
 #ifdef __cplusplus
 }
 #endif
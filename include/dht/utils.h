@@ -26,6 +26,20 @@ typedef int socklen_t;
 #include <arpa/inet.h>
 #endif
 
+/*!
+ * 紧凑端点
+ *
+ * IPv4 or IPv6 address and port number, in a much smaller form than
+ * struct sockaddr_storage. Unused address bytes are always zero, so two
+ * endpoints can be compared with memcmp().
+ */
+struct dht_endpoint {
+    unsigned char addr[16];     /*!< IP address in network byte order, IPv4
+                                     addresses use the first 4 bytes */
+    unsigned char port[2];      /*!< Port number in network byte order */
+    unsigned short family;      /*!< AF_INET, AF_INET6 or 0 if unset */
+};
+
 /*!
  * Return the hexadecimal representation of a 160-bit value.
  *
@@ -86,6 +100,58 @@ int sockaddr_cmp(const struct sockaddr *s1, const struct sockaddr *s2);
  */
 const char *compactaddr_fmt(const unsigned char *ip, size_t len);
 
+/*!
+ * Convert a socket address to an endpoint.
+ *
+ * \param ep The endpoint to fill.
+ * \param sa The \a AF_INET or \a AF_INET6 socket address.
+ * \param addrlen Length of the socket address structure.
+ * \returns 0 on success, -1 if the address family is not supported.
+ */
+int endpoint_from_sockaddr(struct dht_endpoint *ep, const struct sockaddr *sa,
+                           socklen_t addrlen);
+
+/*!
+ * Convert an endpoint to a socket address.
+ *
+ * \param ep The endpoint.
+ * \param ss The socket address to fill.
+ * \returns Length of the socket address, or 0 if \a ep is unset.
+ */
+socklen_t endpoint_to_sockaddr(const struct dht_endpoint *ep,
+                               struct sockaddr_storage *ss);
+
+/*!
+ * Convert compact address information to an endpoint.
+ *
+ * \param ep The endpoint to fill.
+ * \param ip The compact address (see \ref compactaddr_fmt).
+ * \param len Length of the compact address, 6 or 18.
+ * \returns 0 on success, -1 if the compact address is invalid.
+ */
+int endpoint_from_compact(struct dht_endpoint *ep, const unsigned char *ip,
+                          size_t len);
+
+/*!
+ * Convert an endpoint to compact address information.
+ *
+ * \param ep The endpoint.
+ * \param buf Buffer receiving the compact address.
+ * \returns Length of the compact address, or 0 if \a ep is unset.
+ */
+size_t endpoint_to_compact(const struct dht_endpoint *ep,
+                           unsigned char buf[18]);
+
+/*!
+ * Format an endpoint.
+ *
+ * Same as \ref sockaddr_fmt, for an endpoint.
+ *
+ * \param ep The endpoint.
+ * \returns The address string or NULL if \a ep is unset.
+ */
+const char *endpoint_fmt(const struct dht_endpoint *ep);
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,11 +9,16 @@
 #include <ctype.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include <dht/bencode.h>
 
-// 释放B的值
-void bvalue_free(struct bvalue *val)
+/*
+ * Free a value tree. Strings and keys are only released when the tree owns
+ * them, i.e. when it was not produced by bdecode_buf_view().
+ */
+// 释放B值树
+static void bvalue_release(struct bvalue *val, int owned)
 {
     size_t i;
 
@@ -21,19 +26,22 @@ void bvalue_free(struct bvalue *val)
     case BVALUE_INTEGER:
         break;
     case BVALUE_STRING:
-        free(val->s.bytes);
+        if (owned)
+            free(val->s.bytes);
         break;
     case BVALUE_LIST:
         for (i = 0; i < val->l.len; i++)
-            bvalue_free(val->l.array[i]);
+            bvalue_release(val->l.array[i], owned);
         free(val->l.array);
         break;
     case BVALUE_DICTIONARY:
         for (i = 0; i < val->d.len; i++) {
-            free(val->d.key[i]);
-            bvalue_free(val->d.val[i]);
+            if (owned)
+                free(val->d.key[i]);
+            bvalue_release(val->d.val[i], owned);
         }
         free(val->d.key);
+        free(val->d.key_len);
         free(val->d.val);
         break;
     }
@@ -41,6 +49,70 @@ void bvalue_free(struct bvalue *val)
     free(val);
 }
 
+// 释放B的值
+void bvalue_free(struct bvalue *val)
+{
+    bvalue_release(val, 1);
+}
+
+// 释放B值视图
+void bvalue_free_view(struct bvalue *val)
+{
+    bvalue_release(val, 0);
+}
+
+// 比较字典键
+static int key_cmp(const char *k1, size_t l1, const char *k2, size_t l2)
+{
+    int cmp = memcmp(k1, k2, l1 < l2 ? l1 : l2);
+
+    if (cmp)
+        return cmp;
+
+    return (l1 > l2) - (l1 < l2);
+}
+
+/*
+ * Look up a key. Sorted dictionaries (all of those built with
+ * bvalue_dict_set() and well-formed decoded ones) are binary searched.
+ * Returns 1 if the key exists, with *pos set to its index, or 0 with *pos
+ * set to where it would be inserted.
+ */
+// 查找字典键
+static int dict_find(const struct bvalue *dict, const char *key, size_t l,
+                     size_t *pos)
+{
+    size_t lo = 0, hi = dict->d.len, mid;
+    int cmp;
+
+    if (!dict->d.sorted) {
+        for (lo = 0; lo < dict->d.len; lo++) {
+            if (dict->d.key_len[lo] == l && !memcmp(dict->d.key[lo], key, l)) {
+                *pos = lo;
+                return 1;
+            }
+        }
+        *pos = dict->d.len;
+        return 0;
+    }
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = key_cmp(key, l, dict->d.key[mid], dict->d.key_len[mid]);
+        if (cmp == 0) {
+            *pos = mid;
+            return 1;
+        }
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    *pos = lo;
+
+    return 0;
+}
+
 // 从字典中获取B的值
 const struct bvalue *bvalue_dict_get(const struct bvalue *dict, const char *key)
 {
@@ -49,12 +121,10 @@ const struct bvalue *bvalue_dict_get(const struct bvalue *dict, const char *key)
     if (dict->type != BVALUE_DICTIONARY)
         return NULL;
 
-    for (i = 0; i < dict->d.len; i++) {
-        if (!strcmp(dict->d.key[i], key))
-            return dict->d.val[i];
-    }
+    if (!dict_find(dict, key, strlen(key), &i))
+        return NULL;
 
-    return NULL;
+    return dict->d.val[i];
 }
 
 // 从列表中获取B的值
@@ -160,16 +230,121 @@ static size_t stream_write(const void *buf, size_t len, void *stream,
     return l;
 }
 
-// B编码
+// 读取字符串
+static unsigned char *read_string(size_t len, void *stream,
+                                  const struct stream_ops *ops)
+{
+    unsigned char *s;
+
+    s = malloc(len + 1);
+    if (!s)
+        return NULL;
+    if (stream_read(s, len, stream, ops) != len) {
+        free(s);
+        return NULL;
+    }
+    s[len] = '\0';
+
+    return s;
+}
+
+/*
+ * Lists and dictionaries grow geometrically so that building or decoding
+ * n elements costs O(n) copies.
+ */
+// 下一个容量
+static size_t next_cap(size_t cap, size_t n)
+{
+    cap = cap ? cap * 2 : 4;
+
+    return cap < n ? n : cap;
+}
+
+// 预留列表容量
+static int list_reserve(struct bvalue *list, size_t n)
+{
+    size_t cap;
+    void *tmp;
+
+    if (n <= list->l.cap)
+        return 0;
+
+    cap = next_cap(list->l.cap, n);
+    tmp = realloc(list->l.array, cap * sizeof(struct bvalue *));
+    if (!tmp)
+        return -1;
+    list->l.array = tmp;
+    list->l.cap = cap;
+
+    return 0;
+}
+
+// 预留字典容量
+static int dict_reserve(struct bvalue *dict, size_t n)
+{
+    size_t cap;
+    void *tmp;
+
+    if (n <= dict->d.cap)
+        return 0;
+
+    cap = next_cap(dict->d.cap, n);
+    tmp = realloc(dict->d.key, cap * sizeof(char *));
+    if (!tmp)
+        return -1;
+    dict->d.key = tmp;
+    tmp = realloc(dict->d.key_len, cap * sizeof(size_t));
+    if (!tmp)
+        return -1;
+    dict->d.key_len = tmp;
+    tmp = realloc(dict->d.val, cap * sizeof(struct bvalue *));
+    if (!tmp)
+        return -1;
+    dict->d.val = tmp;
+    dict->d.cap = cap;
+
+    return 0;
+}
+
+// 列表追加解码的元素
+static int list_push(struct bvalue *list, struct bvalue *v)
+{
+    if (list_reserve(list, list->l.len + 1))
+        return -1;
+    list->l.array[list->l.len++] = v;
+
+    return 0;
+}
+
+// 字典追加解码的键值
+static int dict_push(struct bvalue *dict, char *key, size_t key_len,
+                     struct bvalue *v)
+{
+    if (dict_reserve(dict, dict->d.len + 1))
+        return -1;
+
+    if (dict->d.len > 0 &&
+        key_cmp(dict->d.key[dict->d.len - 1], dict->d.key_len[dict->d.len - 1],
+                key, key_len) >= 0)
+        dict->d.sorted = 0;
+
+    dict->d.key[dict->d.len] = key;
+    dict->d.key_len[dict->d.len] = key_len;
+    dict->d.val[dict->d.len++] = v;
+
+    return 0;
+}
+
+// B解码流
 static struct bvalue *bdecode(void *stream, const struct stream_ops *ops)
 {
     struct bvalue *ret;
     int c;
-    void *tmp;
 
     ret = malloc(sizeof(struct bvalue));
     if (!ret)
         return NULL;
+    ret->type = BVALUE_INTEGER; /* Nothing to release until set */
 
     switch ((c = ops->get_char(stream))) {
     case 'i': // 整数
@@ -183,7 +358,7 @@ static struct bvalue *bdecode(void *stream, const struct stream_ops *ops)
             }
             do {
                 if (c < '0' || c > '9') {
-                    free(ret);
+                    bvalue_free(ret);
                     return NULL;
                 }
                 v = (v * 10) + (c - '0');
@@ -197,23 +372,20 @@ static struct bvalue *bdecode(void *stream, const struct stream_ops *ops)
             ret->type = BVALUE_LIST;
             ret->l.array = NULL;
             ret->l.len = 0;
+            ret->l.cap = 0;
             while (ops->peek_char(stream) != 'e') {
                 struct bvalue *v;
 
-                tmp = realloc(ret->l.array,
-                              (ret->l.len + 1) * sizeof(struct bvalue *));
-                if (!tmp) {
+                v = bdecode(stream, ops);
+                if (!v) {
                     bvalue_free(ret);
                     return NULL;
                 }
-                ret->l.array = tmp;
-                v = bdecode(stream, ops);
-                if (!v) {
+                if (list_push(ret, v)) {
+                    bvalue_free(v);
                     bvalue_free(ret);
                     return NULL;
                 }
-
-                ret->l.array[ret->l.len++] = v;
             }
             ops->get_char(stream); /* Consume 'e' */
         }
@@ -222,27 +394,16 @@ static struct bvalue *bdecode(void *stream, const struct stream_ops *ops)
         {
             ret->type = BVALUE_DICTIONARY;
             ret->d.key = NULL;
+            ret->d.key_len = NULL;
             ret->d.val = NULL;
             ret->d.len = 0;
+            ret->d.cap = 0;
+            ret->d.sorted = 1;
             while ((c = ops->get_char(stream)) != 'e') {
                 size_t l;
                 char *key;
                 struct bvalue *v;
 
-                tmp = realloc(ret->d.key, (ret->d.len + 1) * sizeof(char *));
-                if (!tmp) {
-                    bvalue_free(ret);
-                    return NULL;
-                }
-                ret->d.key = tmp;
-                tmp = realloc(ret->d.val,
-                              (ret->d.len + 1) * sizeof(struct bvalue *));
-                if (!tmp) {
-                    bvalue_free(ret);
-                    return NULL;
-                }
-                ret->d.val = tmp;
-
                 l = 0;
                 do {
                     if (c < '0' || c > '9') {
@@ -252,27 +413,20 @@ static struct bvalue *bdecode(void *stream, const struct stream_ops *ops)
                     l = (l * 10) + (c - '0');
                 } while ((c = ops->get_char(stream)) != ':');
 
-                key = malloc(l + 1);
+                key = (char *)read_string(l, stream, ops);
                 if (!key) {
                     bvalue_free(ret);
                     return NULL;
                 }
-                if (stream_read(key, l, stream, ops) != l) {
-                    free(key);
-                    bvalue_free(ret);
-                    return NULL;
-                }
-                key[l] = '\0';
 
                 v = bdecode(stream, ops);
-                if (!v) {
+                if (!v || dict_push(ret, key, l, v)) {
+                    if (v)
+                        bvalue_free(v);
                     free(key);
                     bvalue_free(ret);
                     return NULL;
                 }
-
-                ret->d.key[ret->d.len] = key;
-                ret->d.val[ret->d.len++] = v;
             }
         }
         break;
@@ -290,26 +444,263 @@ static struct bvalue *bdecode(void *stream, const struct stream_ops *ops)
 
             ret->type = BVALUE_STRING;
             ret->s.len = l;
-            ret->s.bytes = malloc(l + 1);
+            ret->s.bytes = read_string(l, stream, ops);
             if (!ret->s.bytes) {
-                free(ret);
-                return NULL;
-            }
-            if (stream_read(ret->s.bytes, l, stream, ops) != l) {
-                free(ret->s.bytes);
-                free(ret);
+                bvalue_free(ret);
                 return NULL;
             }
-            ret->s.bytes[l] = '\0';
             break;
         }
-        free(ret);
+        bvalue_free(ret);
         return NULL;
     }
 
     return ret;
 }
 
+/*
+ * Decoding from memory works on the buffer directly: lengths and integers
+ * are parsed in place and strings are copied with a single memcpy(), or
+ * borrowed from the buffer when decoding a view.
+ */
+// 从缓冲区解析整数
+static int mem_parse_integer(const unsigned char **pp,
+                             const unsigned char *end, long long int *intval)
+{
+    const unsigned char *p = *pp;
+    long long int v = 0;
+    int neg = 0;
+
+    if (p < end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9')
+        return -1;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (v > (LLONG_MAX - (*p - '0')) / 10)
+            return -1; /* Overflow */
+        v = (v * 10) + (*p++ - '0');
+    }
+    if (p == end || *p != 'e')
+        return -1;
+
+    *intval = neg ? -v : v;
+    *pp = p + 1;
+
+    return 0;
+}
+
+// 从缓冲区读取字符串
+static unsigned char *mem_read_string(const unsigned char **pp,
+                                      const unsigned char *end, size_t *lenp,
+                                      int view)
+{
+    const unsigned char *p = *pp;
+    unsigned char *s;
+    size_t l = 0;
+
+    if (p == end || *p < '0' || *p > '9')
+        return NULL;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (l > (size_t)(end - p))
+            return NULL; /* Longer than the remaining data */
+        l = (l * 10) + (*p++ - '0');
+    }
+    if (p == end || *p++ != ':' || l > (size_t)(end - p))
+        return NULL;
+
+    if (view)
+        s = (unsigned char *)p;
+    else {
+        s = malloc(l + 1);
+        if (!s)
+            return NULL;
+        memcpy(s, p, l);
+        s[l] = '\0';
+    }
+
+    *lenp = l;
+    *pp = p + l;
+
+    return s;
+}
+
+/*
+ * Check that a buffer holds a well-formed value within the limits, without
+ * allocating anything. The nesting state is kept in two bitmasks: whether
+ * each level is a dictionary, and whether the next item at that level must
+ * be a dictionary key.
+ */
+// 检查B编码的缓冲区
+static int bdecode_scan(const unsigned char *p, const unsigned char *end,
+                        const struct bdecode_limits *limits)
+{
+    unsigned int max_depth = limits->max_depth;
+    unsigned int depth = 0;
+    uint64_t dict = 0, key = 0, bit;
+    size_t count = 0, l;
+    long long int i;
+
+    if (max_depth > BDECODE_MAX_DEPTH)
+        max_depth = BDECODE_MAX_DEPTH;
+
+    do {
+        if (p == end)
+            return -1;
+
+        if (depth > 0) {
+            bit = (uint64_t)1 << (depth - 1);
+
+            if (*p == 'e') {
+                if ((dict & bit) && !(key & bit))
+                    return -1; /* Key without value */
+                p++;
+                depth--;
+                continue;
+            }
+
+            if (dict & bit) {
+                if (key & bit) {
+                    if (!mem_read_string(&p, end, &l, 1) ||
+                        ++count > limits->max_values)
+                        return -1;
+                    key &= ~bit;
+                    continue;
+                }
+                key |= bit;
+            }
+        }
+
+        if (++count > limits->max_values)
+            return -1;
+
+        switch (*p) {
+        case 'i':
+            p++;
+            if (mem_parse_integer(&p, end, &i))
+                return -1;
+            break;
+        case 'l':
+        case 'd':
+            if (depth == max_depth)
+                return -1;
+            bit = (uint64_t)1 << depth++;
+            if (*p++ == 'd') {
+                dict |= bit;
+                key |= bit;
+            } else {
+                dict &= ~bit;
+                key &= ~bit;
+            }
+            break;
+        default:
+            if (!mem_read_string(&p, end, &l, 1))
+                return -1;
+            break;
+        }
+    } while (depth > 0);
+
+    return 0;
+}
+
+/*
+ * Build the tree of a buffer that passed bdecode_scan(). Open lists and
+ * dictionaries are kept on an explicit stack instead of recursing, and
+ * every value is attached to its parent as soon as it is created so that
+ * releasing the root is enough to clean up after an allocation failure.
+ */
+// B解码缓冲区
+static struct bvalue *bdecode_mem(const unsigned char *buf, size_t len,
+                                  int view,
+                                  const struct bdecode_limits *limits)
+{
+    const unsigned char *p = buf, *end = buf + len;
+    struct bvalue *stack[BDECODE_MAX_DEPTH];
+    struct bvalue *root = NULL, *parent, *v;
+    unsigned int sp = 0;
+
+    if (bdecode_scan(buf, end, limits))
+        return NULL;
+
+    do {
+        char *key = NULL;
+        size_t l = 0;
+
+        parent = sp > 0 ? stack[sp - 1] : NULL;
+        if (parent && *p == 'e') {
+            p++;
+            sp--;
+            continue;
+        }
+
+        if (parent && parent->type == BVALUE_DICTIONARY) {
+            key = (char *)mem_read_string(&p, end, &l, view);
+            if (!key)
+                goto fail;
+        }
+
+        v = malloc(sizeof(struct bvalue));
+        if (!v) {
+            if (!view)
+                free(key);
+            goto fail;
+        }
+        v->type = BVALUE_INTEGER; /* Nothing to release until set */
+
+        switch (*p) {
+        case 'i': // 整数
+            p++;
+            mem_parse_integer(&p, end, &v->i);
+            break;
+        case 'l': // 列表
+            v->type = BVALUE_LIST;
+            v->l.array = NULL;
+            v->l.len = 0;
+            v->l.cap = 0;
+            break;
+        case 'd': // 字典
+            v->type = BVALUE_DICTIONARY;
+            v->d.key = NULL;
+            v->d.key_len = NULL;
+            v->d.val = NULL;
+            v->d.len = 0;
+            v->d.cap = 0;
+            v->d.sorted = 1;
+            break;
+        default: // 字符串
+            v->type = BVALUE_STRING;
+            v->s.bytes = mem_read_string(&p, end, &v->s.len, view);
+            break;
+        }
+
+        if ((v->type == BVALUE_STRING && !v->s.bytes) ||
+            (parent && (key ? dict_push(parent, key, l, v)
+                            : list_push(parent, v)))) {
+            bvalue_release(v, !view);
+            if (!view)
+                free(key);
+            goto fail;
+        }
+        if (!parent)
+            root = v;
+
+        if (v->type == BVALUE_LIST || v->type == BVALUE_DICTIONARY) {
+            p++;
+            stack[sp++] = v;
+        }
+    } while (sp > 0);
+
+    return root;
+
+fail:
+    if (root)
+        bvalue_release(root, !view);
+    return NULL;
+}
+
 // 新字典的值
 struct bvalue *bvalue_new_dict(void)
 {
@@ -320,8 +711,11 @@ struct bvalue *bvalue_new_dict(void)
 
     v->type = BVALUE_DICTIONARY;
     v->d.key = NULL;
+    v->d.key_len = NULL;
     v->d.val = NULL;
     v->d.len = 0;
+    v->d.cap = 0;
+    v->d.sorted = 1;
 
     return v;
 }
@@ -337,6 +731,33 @@ struct bvalue *bvalue_new_list(void)
     v->type = BVALUE_LIST;
     v->l.array = NULL;
     v->l.len = 0;
+    v->l.cap = 0;
+
+    return v;
+}
+
+// 新指定容量字典的值
+struct bvalue *bvalue_new_dict_sized(size_t n)
+{
+    struct bvalue *v = bvalue_new_dict();
+
+    if (v && dict_reserve(v, n)) {
+        bvalue_free(v);
+        return NULL;
+    }
+
+    return v;
+}
+
+// 新指定容量列表的值
+struct bvalue *bvalue_new_list_sized(size_t n)
+{
+    struct bvalue *v = bvalue_new_list();
+
+    if (v && list_reserve(v, n)) {
+        bvalue_free(v);
+        return NULL;
+    }
 
     return v;
 }
@@ -363,8 +784,13 @@ struct bvalue *bvalue_new_string(const unsigned char *s, size_t len)
     if (!v)
         return NULL;
 
-    v->type = BVALUE_STRING;
     v->s.bytes = malloc(len + 1);
+    if (!v->s.bytes) {
+        free(v);
+        return NULL;
+    }
+
+    v->type = BVALUE_STRING;
     memcpy(v->s.bytes, s, len);
     v->s.bytes[len] = '\0';
     v->s.len = len;
@@ -375,52 +801,38 @@ struct bvalue *bvalue_new_string(const unsigned char *s, size_t len)
 // 附加B值到列表
 int bvalue_list_append(struct bvalue *list, struct bvalue *val)
 {
-    void *tmp;
-
-    tmp = realloc(list->l.array, (list->l.len + 1) * sizeof(struct bvalue *));
-    if (!tmp)
-        return -1;
-
-    list->l.array = tmp;
-    list->l.array[list->l.len] = val;
-
-    list->l.len++;
-
-    return 0;
+    return list_push(list, val);
 }
 
 // 设置B值到字典
 int bvalue_dict_set(struct bvalue *dict, const char *key, struct bvalue *val)
 {
-    void *tmp;
     size_t i, j;
+    size_t l = strlen(key);
+    char *k;
 
-    for (i = 0; i < dict->d.len; i++) {
-        int cmp = strcmp(key, dict->d.key[i]);
-
-        if (cmp == 0) {
-            bvalue_free(dict->d.val[i]);
-            dict->d.val[i] = val;
-            return 0;
-        } else if (cmp < 0)
-            break;
+    if (dict_find(dict, key, l, &i)) {
+        bvalue_free(dict->d.val[i]);
+        dict->d.val[i] = val;
+        return 0;
     }
 
-    tmp = realloc(dict->d.key, (dict->d.len + 1) * sizeof(char *));
-    if (!tmp)
+    if (dict_reserve(dict, dict->d.len + 1))
         return -1;
-    dict->d.key = tmp;
-    tmp = realloc(dict->d.val, (dict->d.len + 1) * sizeof(struct bvalue *));
-    if (!tmp)
+
+    k = malloc(l + 1);
+    if (!k)
         return -1;
-    dict->d.val = tmp;
+    memcpy(k, key, l + 1);
 
     for (j = dict->d.len; j > i; j--) {
         dict->d.key[j] = dict->d.key[j - 1];
+        dict->d.key_len[j] = dict->d.key_len[j - 1];
         dict->d.val[j] = dict->d.val[j - 1];
     }
 
-    dict->d.key[i] = strdup(key);
+    dict->d.key[i] = k;
+    dict->d.key_len[i] = l;
     dict->d.val[i] = val;
 
     dict->d.len++;
@@ -428,34 +840,42 @@ int bvalue_dict_set(struct bvalue *dict, const char *key, struct bvalue *val)
     return 0;
 }
 
-// 放置整数
-static int put_int(long long int val, void *stream,
-                   const struct stream_ops *ops)
+/* Longest decimal integer: "-9223372036854775808" */
+#define INT_BUF_SIZE 20
+
+// 格式化整数
+static const char *format_int(long long int val, char buf[INT_BUF_SIZE],
+                              size_t *len)
 {
-    long long int i = 1000000000000000000LL;
-    int ret = 0;
+    unsigned long long int u = val < 0 ? -(unsigned long long int)val
+                                      : (unsigned long long int)val;
+    char *p = buf + INT_BUF_SIZE;
 
-    if(val < 0) {
-        if (ops->put_char('-', stream) < 0)
-            return -1;
-        ret++;
-        val = -val;
-    }
+    do {
+        *--p = '0' + (u % 10);
+        u /= 10;
+    } while (u);
+    if (val < 0)
+        *--p = '-';
 
-    while(i > val)
-        i /= 10;
+    *len = buf + INT_BUF_SIZE - p;
 
-    do {
-        int digit = val / (i ? i : 1);
+    return p;
+}
 
-        if (ops->put_char('0' + digit, stream) < 0)
-            return -1;
-        ret++;
-        val -= digit * i;
-        i /= 10;
-    } while (i > 0);
+// 放置整数
+static int put_int(long long int val, void *stream,
+                   const struct stream_ops *ops)
+{
+    char buf[INT_BUF_SIZE];
+    const char *p;
+    size_t l;
 
-    return ret;
+    p = format_int(val, buf, &l);
+    if (stream_write(p, l, stream, ops) != l)
+        return -1;
+
+    return (int)l;
 }
 
 // B编码
@@ -506,7 +926,7 @@ static int bencode(const struct bvalue *val, void *stream,
             return -1;
         ret++;
         for (i = 0; i < val->d.len; i++) {
-            size_t l = strlen(val->d.key[i]);
+            size_t l = val->d.key_len[i];
 
             if ((rc = put_int((int)l, stream, ops)) < 0)
                 return -1;
@@ -562,146 +982,227 @@ int bencode_file(const struct bvalue *val, FILE *f)
     return bencode(val, f, &file_ops);
 }
 
-struct mem_stream {
-    union {
-        const unsigned char *rbuf;
-        unsigned char *wbuf;
-    } u;
-    size_t pos;
-    size_t len;
-    int alloc;
-};
-
-static int mem_peek_char(void *stream)
+// 整数的十进制长度
+static size_t int_len(long long int val)
 {
-    struct mem_stream *s = stream;
+    unsigned long long int u = val < 0 ? -(unsigned long long int)val
+                                      : (unsigned long long int)val;
+    size_t l = val < 0 ? 2 : 1;
 
-    if (s->pos == s->len)
-        return EOF;
+    while (u >= 10) {
+        u /= 10;
+        l++;
+    }
 
-    return s->u.rbuf[s->pos];
+    return l;
 }
 
-static int mem_get_char(void *stream)
+/*
+ * Size of the bencoded form of a value, so that memory encoding can check
+ * the output space (or allocate it) once up front. Returns -1 on invalid
+ * values.
+ */
+// B编码的长度
+static long long int bencoded_len(const struct bvalue *val)
 {
-    struct mem_stream *s = stream;
-
-    if (s->pos == s->len)
-        return EOF;
+    long long int ret, rc;
+    size_t i;
 
-    return s->u.rbuf[s->pos++];
+    switch (val->type) {
+    case BVALUE_INTEGER: // 整数
+        return int_len(val->i) + 2;
+    case BVALUE_STRING: // 字符串
+        return int_len(val->s.len) + 1 + val->s.len;
+    case BVALUE_LIST: // 列表
+        ret = 2;
+        for (i = 0; i < val->l.len; i++) {
+            if ((rc = bencoded_len(val->l.array[i])) < 0)
+                return -1;
+            ret += rc;
+        }
+        return ret;
+    case BVALUE_DICTIONARY: // 字典
+        ret = 2;
+        for (i = 0; i < val->d.len; i++) {
+            if ((rc = bencoded_len(val->d.val[i])) < 0)
+                return -1;
+            ret += int_len(val->d.key_len[i]) + 1 + val->d.key_len[i] + rc;
+        }
+        return ret;
+    default:
+        return -1;
+    }
 }
 
-static int mem_put_char(int c, void *stream)
+// 写入字符串到缓冲区
+static unsigned char *mem_put_string(unsigned char *p, const void *s,
+                                     size_t len)
 {
-    struct mem_stream *s = stream;
+    char buf[INT_BUF_SIZE];
+    const char *d;
+    size_t l;
+
+    d = format_int(len, buf, &l);
+    memcpy(p, d, l);
+    p += l;
+    *p++ = ':';
+    memcpy(p, s, len);
 
-    if (s->pos == s->len) {
-        void *tmp;
+    return p + len;
+}
 
-        if (!s->alloc)
-            return EOF;
+/*
+ * Encode a value into a buffer known to be large enough (see
+ * bencoded_len()). Returns the end of the written data.
+ */
+// B编码到缓冲区
+static unsigned char *bencode_mem(const struct bvalue *val, unsigned char *p)
+{
+    char buf[INT_BUF_SIZE];
+    const char *d;
+    size_t i, l;
 
-        tmp = realloc(s->u.wbuf, s->len * 2);
-        if (!tmp)
-            return EOF;
-        s->u.wbuf = tmp;
-        s->len *= 2;
+    switch (val->type) {
+    case BVALUE_INTEGER: // 整数
+        d = format_int(val->i, buf, &l);
+        *p++ = 'i';
+        memcpy(p, d, l);
+        p += l;
+        *p++ = 'e';
+        break;
+    case BVALUE_STRING: // 字符串
+        p = mem_put_string(p, val->s.bytes, val->s.len);
+        break;
+    case BVALUE_LIST: // 列表
+        *p++ = 'l';
+        for (i = 0; i < val->l.len; i++)
+            p = bencode_mem(val->l.array[i], p);
+        *p++ = 'e';
+        break;
+    case BVALUE_DICTIONARY: // 字典
+        *p++ = 'd';
+        for (i = 0; i < val->d.len; i++) {
+            p = mem_put_string(p, val->d.key[i], val->d.key_len[i]);
+            p = bencode_mem(val->d.val[i], p);
+        }
+        *p++ = 'e';
+        break;
     }
-    s->u.wbuf[s->pos++] = (unsigned char)c;
 
-    return (unsigned char)c;
+    return p;
 }
 
-static const struct stream_ops mem_ops = {
-    .peek_char = mem_peek_char,
-    .get_char = mem_get_char,
-    .put_char = mem_put_char,
+/* Limits of the plain memory decoders: the input length bounds the rest */
+static const struct bdecode_limits default_limits = {
+    .max_depth = BDECODE_MAX_DEPTH,
+    .max_values = (size_t)-1,
 };
 
 // B编码的缓存区
 struct bvalue *bdecode_buf(const unsigned char *buf, size_t len)
 {
-    struct bvalue *ret;
-    struct mem_stream stream;
-
-    stream.u.rbuf = buf;
-    stream.len = len;
-    stream.pos = 0;
-    stream.alloc = 0;
+    return bdecode_mem(buf, len, 0, &default_limits);
+}
 
-    ret = bdecode(&stream, &mem_ops);
+// 在限制内B编码的缓存区
+struct bvalue *bdecode_buf_limits(const unsigned char *buf, size_t len,
+                                  const struct bdecode_limits *limits)
+{
+    return bdecode_mem(buf, len, 0, limits);
+}
 
-    return ret;
+// B编码的缓存区视图
+struct bvalue *bdecode_buf_view(const unsigned char *buf, size_t len)
+{
+    return bdecode_mem(buf, len, 1, &default_limits);
 }
 
 int bencode_buf(const struct bvalue *val, unsigned char *buf, size_t len)
 {
-    struct mem_stream stream;
+    long long int l = bencoded_len(val);
+
+    if (l < 0 || l > INT_MAX || (unsigned long long int)l > len)
+        return -1;
 
-    stream.u.wbuf = buf;
-    stream.len = len;
-    stream.pos = 0;
-    stream.alloc = 0;
+    bencode_mem(val, buf);
 
-    return bencode(val, &stream, &mem_ops);
+    return (int)l;
 }
 
 // 分配B编码的缓冲区
 int bencode_buf_alloc(const struct bvalue *val, unsigned char **bufp)
 {
-    struct mem_stream stream;
-    int ret;
+    long long int l = bencoded_len(val);
+    unsigned char *buf;
 
-    stream.u.wbuf = malloc(512);
-    stream.len = 512;
-    stream.pos = 0;
-    stream.alloc = 1;
+    if (l < 0 || l > INT_MAX)
+        return -1;
 
-    ret = bencode(val, &stream, &mem_ops);
-    if (ret < 0) {
-        free(stream.u.wbuf);
-        return ret;
-    }
+    buf = malloc(l);
+    if (!buf)
+        return -1;
 
-    *bufp = stream.u.wbuf;
+    bencode_mem(val, buf);
+    *bufp = buf;
 
-    return ret;
+    return (int)l;
 }
 
+/*
+ * The copy is built with the same helpers as the decoder, so that a partial
+ * copy can be released with bvalue_free() when an allocation fails.
+ */
 // 复制B值
 struct bvalue *bvalue_copy(const struct bvalue *val)
 {
-    struct bvalue *res = NULL;
+    struct bvalue *res = NULL, *v;
     size_t i;
 
     switch (val->type) {
     case BVALUE_INTEGER: // 整数
-        res = bvalue_new_integer(val->i);
-        break;
+        return bvalue_new_integer(val->i);
     case BVALUE_STRING: // 字符串
-        res = bvalue_new_string(val->s.bytes, val->s.len);
-        break;
+        return bvalue_new_string(val->s.bytes, val->s.len);
     case BVALUE_LIST: // 列表
         res = bvalue_new_list();
-        res->l.array = malloc(val->l.len * sizeof(struct bvalue *));
-        for (i = 0; i < val->l.len; i++)
-            res->l.array[i] = bvalue_copy(val->l.array[i]);
-        res->l.len = i;
+        if (!res || list_reserve(res, val->l.len))
+            goto fail;
+        for (i = 0; i < val->l.len; i++) {
+            v = bvalue_copy(val->l.array[i]);
+            if (!v)
+                goto fail;
+            list_push(res, v);
+        }
         break;
     case BVALUE_DICTIONARY: // 字典
         res = bvalue_new_dict();
-        res->d.key = malloc(val->d.len * sizeof(char *));
-        res->d.val = malloc(val->d.len * sizeof(struct bvalue *));
+        if (!res || dict_reserve(res, val->d.len))
+            goto fail;
         for (i = 0; i < val->d.len; i++) {
-            res->d.key[i] = strdup(val->d.key[i]);
-            res->d.val[i] = bvalue_copy(val->d.val[i]);
+            size_t l = val->d.key_len[i];
+            char *key = malloc(l + 1);
+
+            if (!key)
+                goto fail;
+            memcpy(key, val->d.key[i], l);
+            key[l] = '\0';
+
+            v = bvalue_copy(val->d.val[i]);
+            if (!v) {
+                free(key);
+                goto fail;
+            }
+            dict_push(res, key, l, v);
         }
-        res->d.len = i;
         break;
     default:
         break;
     }
 
     return res;
+
+fail:
+    if (res)
+        bvalue_free(res);
+    return NULL;
 }
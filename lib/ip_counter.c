@@ -39,10 +39,10 @@ void ip_counter_init(struct ip_counter *c)
 
 // 更新IP计算
 int ip_counter_update(struct ip_counter *c, const unsigned char *ip,
-                      size_t len)
+                      size_t len, const struct timeval *now)
 {
     struct ip_counter_entry **e = &c->entries;
-    struct timeval tv, now;
+    struct timeval tv;
 
     while (*e && ((*e)->len != len || memcmp((*e)->ip, ip, len)))
         e = &(*e)->next;
@@ -61,12 +61,11 @@ int ip_counter_update(struct ip_counter *c, const unsigned char *ip,
 
     c->total++;
 
-    gettimeofday(&now, NULL);
     tv.tv_sec = 10 * 60;
     tv.tv_usec = 0;
     timeradd(&tv, &c->heat_start, &tv);
 
-    if (c->total >= 120 || timercmp(&tv, &now, <=))
+    if (c->total >= 120 || timercmp(&tv, now, <=))
         return 1;
 
     return 0;
@@ -8,7 +8,8 @@
 #ifndef IP_COUNTER_H_
 #define IP_COUNTER_H_
 
-int ip_counter_update(struct ip_counter *c, const unsigned char *ip, size_t len);
+int ip_counter_update(struct ip_counter *c, const unsigned char *ip, size_t len,
+                      const struct timeval *now);
 int ip_counter_current(struct ip_counter *c, unsigned char ip[18]);
 void ip_counter_init(struct ip_counter *c);
 void ip_counter_reset(struct ip_counter *c);
@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2020 naturalpolice
+ * SPDX-License-Identifier: MIT
+ *
+ * Licensed under the MIT License (see LICENSE).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include <dht/bencode.h>
+
+#include "krpc.h"
+
+/* Maximum nesting level of values skipped over (one bit per level) */
+#define KRPC_MAX_DEPTH 64
+
+// 参数字典中的已知键
+static const struct {
+    const char *name;
+    size_t len;
+    size_t offset;
+} args_keys[] = {
+    { "id", 2, offsetof(struct krpc_args, id) },
+    { "target", 6, offsetof(struct krpc_args, target) },
+    { "info_hash", 9, offsetof(struct krpc_args, info_hash) },
+    { "token", 5, offsetof(struct krpc_args, token) },
+    { "port", 4, offsetof(struct krpc_args, port) },
+    { "implied_port", 12, offsetof(struct krpc_args, implied_port) },
+    { "want", 4, offsetof(struct krpc_args, want) },
+    { "nodes", 5, offsetof(struct krpc_args, nodes) },
+    { "nodes6", 6, offsetof(struct krpc_args, nodes6) },
+    { "values", 6, offsetof(struct krpc_args, values) },
+    { "v", 1, offsetof(struct krpc_args, v) },
+    { "seq", 3, offsetof(struct krpc_args, seq) },
+    { "cas", 3, offsetof(struct krpc_args, cas) },
+    { "k", 1, offsetof(struct krpc_args, k) },
+    { "sig", 3, offsetof(struct krpc_args, sig) },
+    { "salt", 4, offsetof(struct krpc_args, salt) },
+};
+
+// 解析整数
+static int parse_integer(const unsigned char **pp, const unsigned char *end,
+                         long long int *intval)
+{
+    const unsigned char *p = *pp;
+    long long int v = 0;
+    int neg = 0;
+
+    if (p < end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9')
+        return -1;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (v > (LLONG_MAX - (*p - '0')) / 10)
+            return -1; /* Overflow */
+        v = (v * 10) + (*p++ - '0');
+    }
+    if (p == end || *p != 'e')
+        return -1;
+
+    *intval = neg ? -v : v;
+    *pp = p + 1;
+
+    return 0;
+}
+
+// 解析字符串
+static int parse_string(const unsigned char **pp, const unsigned char *end,
+                        const unsigned char **s, size_t *len)
+{
+    const unsigned char *p = *pp;
+    size_t l = 0;
+
+    if (p == end || *p < '0' || *p > '9')
+        return -1;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (l > (size_t)(end - p))
+            return -1; /* Longer than the remaining data */
+        l = (l * 10) + (*p++ - '0');
+    }
+    if (p == end || *p++ != ':')
+        return -1;
+    if (l > (size_t)(end - p))
+        return -1;
+
+    *s = p;
+    *len = l;
+    *pp = p + l;
+
+    return 0;
+}
+
+/*
+ * Skip over a list or dictionary without recursion. The nesting state is
+ * kept in two bitmasks: whether each level is a dictionary, and whether the
+ * next item at that level must be a dictionary key.
+ */
+// 跳过列表或字典
+static int skip_container(const unsigned char **pp, const unsigned char *end)
+{
+    const unsigned char *p = *pp;
+    uint64_t dict = 0, key = 0, bit;
+    int depth = 0;
+    long long int i;
+    const unsigned char *s;
+    size_t l;
+
+    do {
+        if (p == end)
+            return -1;
+
+        if (depth > 0) {
+            bit = (uint64_t)1 << (depth - 1);
+
+            if (*p == 'e') {
+                if ((dict & bit) && !(key & bit))
+                    return -1; /* Key without value */
+                p++;
+                depth--;
+                continue;
+            }
+
+            if (dict & bit) {
+                if (key & bit) {
+                    if (parse_string(&p, end, &s, &l))
+                        return -1;
+                    key &= ~bit;
+                    continue;
+                }
+                key |= bit;
+            }
+        }
+
+        switch (*p) {
+        case 'i':
+            p++;
+            if (parse_integer(&p, end, &i))
+                return -1;
+            break;
+        case 'l':
+        case 'd':
+            if (depth == KRPC_MAX_DEPTH)
+                return -1;
+            bit = (uint64_t)1 << depth++;
+            if (*p++ == 'd') {
+                dict |= bit;
+                key |= bit;
+            } else {
+                dict &= ~bit;
+                key &= ~bit;
+            }
+            break;
+        default:
+            if (parse_string(&p, end, &s, &l))
+                return -1;
+            break;
+        }
+    } while (depth > 0);
+
+    *pp = p;
+
+    return 0;
+}
+
+// 解析任意值
+static int parse_value(const unsigned char **pp, const unsigned char *end,
+                       struct krpc_value *v)
+{
+    const unsigned char *p = *pp;
+
+    if (p == end)
+        return -1;
+
+    v->raw = p;
+    switch (*p) {
+    case 'i':
+        v->type = 'i';
+        p++;
+        if (parse_integer(&p, end, &v->i))
+            return -1;
+        break;
+    case 'l':
+    case 'd':
+        v->type = *p;
+        if (skip_container(&p, end))
+            return -1;
+        break;
+    default:
+        v->type = 's';
+        if (parse_string(&p, end, &v->s, &v->len))
+            return -1;
+        break;
+    }
+    v->raw_len = p - v->raw;
+    *pp = p;
+
+    return 0;
+}
+
+// 查找参数字段
+static struct krpc_value *args_field(struct krpc_args *args,
+                                     const unsigned char *key, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(args_keys) / sizeof(args_keys[0]); i++) {
+        if (args_keys[i].len == len && !memcmp(args_keys[i].name, key, len))
+            return (struct krpc_value *)((char *)args + args_keys[i].offset);
+    }
+
+    return NULL;
+}
+
+// 解析参数字典
+static int parse_args(const unsigned char **pp, const unsigned char *end,
+                      struct krpc_value *dict, struct krpc_args *args)
+{
+    const unsigned char *p = *pp;
+
+    dict->type = 'd';
+    dict->raw = p++;
+
+    while (p < end && *p != 'e') {
+        const unsigned char *key;
+        size_t len;
+        struct krpc_value tmp, *v;
+
+        if (parse_string(&p, end, &key, &len))
+            return -1;
+        v = args_field(args, key, len);
+        if (parse_value(&p, end, v ? v : &tmp))
+            return -1;
+    }
+    if (p == end)
+        return -1;
+    p++;
+
+    dict->raw_len = p - dict->raw;
+    *pp = p;
+
+    return 0;
+}
+
+// 查找消息字段
+static struct krpc_value *msg_field(struct krpc_msg *msg,
+                                    const unsigned char *key, size_t len)
+{
+    if (len == 1) {
+        switch (key[0]) {
+        case 't': return &msg->t;
+        case 'y': return &msg->y;
+        case 'q': return &msg->q;
+        case 'e': return &msg->e;
+        case 'a': return &msg->a;
+        case 'r': return &msg->r;
+        default: break;
+        }
+    } else if (len == 2 && !memcmp(key, "ip", 2))
+        return &msg->ip;
+
+    return NULL;
+}
+
+/*
+ * Decode a KRPC message in a single pass over the datagram. Only the keys
+ * the node cares about are recorded, everything else is validated and
+ * skipped. No memory is allocated.
+ *
+ * A message carries either query arguments or response values: one with
+ * both "a" and "r", or either of them twice, is rejected since their keys
+ * would be mixed up in msg->args. As with bdecode_buf(), bytes after the
+ * end of the dictionary are ignored.
+ */
+// 解析KRPC消息
+int krpc_parse(const unsigned char *buf, size_t len, struct krpc_msg *msg)
+{
+    const unsigned char *p = buf;
+    const unsigned char *end = buf + len;
+
+    memset(msg, 0, sizeof(*msg));
+
+    if (p == end || *p++ != 'd')
+        return -1;
+
+    while (p < end && *p != 'e') {
+        const unsigned char *key;
+        size_t l;
+        struct krpc_value tmp, *v;
+
+        if (parse_string(&p, end, &key, &l))
+            return -1;
+
+        if (l == 1 && (key[0] == 'a' || key[0] == 'r')) {
+            if (msg->a.type || msg->r.type)
+                return -1; /* Both "a" and "r", or a duplicate */
+            if (p < end && *p == 'd') {
+                if (parse_args(&p, end, key[0] == 'a' ? &msg->a : &msg->r,
+                               &msg->args))
+                    return -1;
+                continue;
+            }
+        }
+
+        v = msg_field(msg, key, l);
+        if (parse_value(&p, end, v ? v : &tmp))
+            return -1;
+    }
+    if (p == end)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Iterate over the elements of a list value. *pos must be initialized to 0
+ * before the first call.
+ */
+// 列表的下一个元素
+int krpc_list_next(const struct krpc_value *list, size_t *pos,
+                   struct krpc_value *elem)
+{
+    const unsigned char *p, *end;
+
+    if (list->type != 'l')
+        return 0;
+
+    p = list->raw + (*pos ? *pos : 1);
+    end = list->raw + list->raw_len - 1; /* Trailing 'e' */
+    if (p >= end)
+        return 0;
+
+    if (parse_value(&p, end, elem))
+        return -1;
+    *pos = p - list->raw;
+
+    return 1;
+}
+
+// 字符串值
+const unsigned char *krpc_string(const struct krpc_value *v, size_t *len)
+{
+    if (v->type != 's')
+        return NULL;
+
+    if (len)
+        *len = v->len;
+
+    return v->s;
+}
+
+// 比较字符串值
+int krpc_string_eq(const struct krpc_value *v, const char *s)
+{
+    size_t l = strlen(s);
+
+    return v->type == 's' && v->len == l && !memcmp(v->s, s, l);
+}
+
+// 整数值
+int krpc_integer(const struct krpc_value *v, int *intval)
+{
+    if (v->type != 'i')
+        return -1;
+
+    if (v->i < INT_MIN || v->i > INT_MAX)
+        return -1; /* Overflow */
+
+    *intval = (int)v->i;
+
+    return 0;
+}
+
+// 初始化写入器
+void krpc_writer_init(struct krpc_writer *w, unsigned char *buf, size_t size)
+{
+    w->buf = buf;
+    w->size = size;
+    w->pos = 0;
+    w->error = 0;
+}
+
+// 写入的长度
+int krpc_writer_len(const struct krpc_writer *w)
+{
+    if (w->error)
+        return -1;
+
+    return (int)w->pos;
+}
+
+// 写入原始数据
+void krpc_write_raw(struct krpc_writer *w, const void *data, size_t len)
+{
+    if (w->error || len > w->size - w->pos) {
+        w->error = 1;
+        return;
+    }
+
+    memcpy(w->buf + w->pos, data, len);
+    w->pos += len;
+}
+
+// 写入字符
+void krpc_write_char(struct krpc_writer *w, int c)
+{
+    if (w->error || w->pos == w->size) {
+        w->error = 1;
+        return;
+    }
+
+    w->buf[w->pos++] = (unsigned char)c;
+}
+
+// 写入十进制数
+static void write_decimal(struct krpc_writer *w, unsigned long long int v)
+{
+    char tmp[20];
+    size_t i = sizeof(tmp);
+
+    do {
+        tmp[--i] = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+
+    krpc_write_raw(w, tmp + i, sizeof(tmp) - i);
+}
+
+// 写入字符串
+void krpc_write_string(struct krpc_writer *w, const void *s, size_t len)
+{
+    write_decimal(w, len);
+    krpc_write_char(w, ':');
+    krpc_write_raw(w, s, len);
+}
+
+// 写入键
+void krpc_write_key(struct krpc_writer *w, const char *key)
+{
+    krpc_write_string(w, key, strlen(key));
+}
+
+// 写入整数
+void krpc_write_integer(struct krpc_writer *w, long long int i)
+{
+    krpc_write_char(w, 'i');
+    if (i < 0) {
+        krpc_write_char(w, '-');
+        write_decimal(w, -(unsigned long long int)i);
+    } else
+        write_decimal(w, i);
+    krpc_write_char(w, 'e');
+}
+
+// 写入B值
+void krpc_write_bvalue(struct krpc_writer *w, const struct bvalue *v)
+{
+    int rc;
+
+    if (w->error)
+        return;
+
+    rc = bencode_buf(v, w->buf + w->pos, w->size - w->pos);
+    if (rc < 0) {
+        w->error = 1;
+        return;
+    }
+
+    w->pos += rc;
+}
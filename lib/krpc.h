@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2020 naturalpolice
+ * SPDX-License-Identifier: MIT
+ *
+ * Licensed under the MIT License (see LICENSE).
+ */
+
+#ifndef KRPC_H_
+#define KRPC_H_
+
+#include <stddef.h>
+
+/*
+ * Borrowed view of a bencoded value inside a KRPC datagram. Nothing is
+ * copied: all pointers reference the input buffer, which must outlive the
+ * view.
+ */
+struct krpc_value {
+    int type;                   /* 0 if absent, 'i', 's', 'l' or 'd' */
+    long long int i;            /* Integer value */
+    const unsigned char *s;     /* String bytes (not null-terminated) */
+    size_t len;                 /* String length */
+    const unsigned char *raw;   /* Complete bencoded form of the value */
+    size_t raw_len;             /* Length of raw */
+};
+
+// 查询参数("a")或响应值("r")
+struct krpc_args {
+    struct krpc_value id;
+    struct krpc_value target;
+    struct krpc_value info_hash;
+    struct krpc_value token;
+    struct krpc_value port;
+    struct krpc_value implied_port;
+    struct krpc_value want;
+    struct krpc_value nodes;
+    struct krpc_value nodes6;
+    struct krpc_value values;
+    struct krpc_value v;
+    struct krpc_value seq;
+    struct krpc_value cas;
+    struct krpc_value k;
+    struct krpc_value sig;
+    struct krpc_value salt;
+};
+
+// KRPC消息
+struct krpc_msg {
+    struct krpc_value t;
+    struct krpc_value y;
+    struct krpc_value q;
+    struct krpc_value ip;
+    struct krpc_value e;
+    struct krpc_value a;        /* Raw "a" dictionary */
+    struct krpc_value r;        /* Raw "r" dictionary */
+    struct krpc_args args;      /* Known keys of the "a" or "r" dictionary */
+};
+
+/*
+ * Streaming bencode writer for outgoing KRPC messages. Keys must be written
+ * in canonical (sorted) order by the caller. Running out of space is
+ * recorded and reported by krpc_writer_len().
+ */
+struct krpc_writer {
+    unsigned char *buf;
+    size_t size;
+    size_t pos;
+    int error;
+};
+
+struct bvalue;
+
+int krpc_parse(const unsigned char *buf, size_t len, struct krpc_msg *msg);
+int krpc_list_next(const struct krpc_value *list, size_t *pos,
+                   struct krpc_value *elem);
+const unsigned char *krpc_string(const struct krpc_value *v, size_t *len);
+int krpc_string_eq(const struct krpc_value *v, const char *s);
+int krpc_integer(const struct krpc_value *v, int *intval);
+
+void krpc_writer_init(struct krpc_writer *w, unsigned char *buf, size_t size);
+int krpc_writer_len(const struct krpc_writer *w);
+void krpc_write_raw(struct krpc_writer *w, const void *data, size_t len);
+void krpc_write_char(struct krpc_writer *w, int c);
+void krpc_write_string(struct krpc_writer *w, const void *s, size_t len);
+void krpc_write_key(struct krpc_writer *w, const char *key);
+void krpc_write_integer(struct krpc_writer *w, long long int i);
+void krpc_write_bvalue(struct krpc_writer *w, const struct bvalue *v);
+
+#endif /* KRPC_H_ */
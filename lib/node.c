@@ -27,6 +27,8 @@
 #include "hmac.h"
 #include "random.h"
 #include "ip_counter.h"
+#include "krpc.h"
+#include "timer.h"
 #include "node.h"
 
 static
@@ -52,88 +54,107 @@ int debug_printf(const char *format, ...)
 #define TRACE(x) do { if (0) debug_printf x; } while (0)
 #endif
 
-// 发送查询
-static void send_query(struct dht_node *n, const char *method, uint16_t tid,
-                       struct bvalue *arguments,
-                       const struct sockaddr *dest, socklen_t addrlen)
-{
-    unsigned char buf[2048];
-    struct bvalue *query;
-    struct bvalue *v;
-    int rc;
-
-    query = bvalue_new_dict();
-    v = bvalue_new_string((unsigned char *)&tid, sizeof(tid));
-    bvalue_dict_set(query, "t", v);
+/* Bounds for stored values decoded from the network (at most 1000 bytes) */
+static const struct bdecode_limits value_limits = {
+    .max_depth = 16,
+    .max_values = 256,
+};
 
-    v = bvalue_new_string((unsigned char *)"q", 1);
-    bvalue_dict_set(query, "y", v);
+/* Staging buffer for batched output */
+#define OUTPUT_QUEUE_SLOTS 64
+#define OUTPUT_QUEUE_SIZE 65536
 
-    v = bvalue_new_string((unsigned char *)method, strlen(method));
-    bvalue_dict_set(query, "q", v);
+struct output_queue {
+    struct dht_datagram msgs[OUTPUT_QUEUE_SLOTS];
+    struct sockaddr_storage addrs[OUTPUT_QUEUE_SLOTS];
+    size_t count;
+    size_t used;
+    unsigned char data[OUTPUT_QUEUE_SIZE];
+};
 
-    if (!arguments)
-        arguments = bvalue_new_dict();
-    v = bvalue_new_string(n->id, 20);
-    bvalue_dict_set(arguments, "id", v);
-    bvalue_dict_set(query, "a", arguments);
+// 输出数据报
+static void node_output(struct dht_node *n, const unsigned char *data,
+                        size_t len, const struct sockaddr *dest,
+                        socklen_t addrlen)
+{
+    struct output_queue *q = n->outq;
+    struct dht_datagram *d;
 
-    rc = bencode_buf(query, buf, sizeof(buf));
-    if (rc < 0) {
-        TRACE(("bencoding failed\n"));
-        bvalue_free(query);
+    if (!q) {
+        n->output(data, len, dest, addrlen, n->opaque);
         return;
     }
 
-    n->output(buf, rc, dest, addrlen, n->opaque);
+    if (q->count == OUTPUT_QUEUE_SLOTS || len > OUTPUT_QUEUE_SIZE - q->used)
+        dht_node_flush(n);
 
-    bvalue_free(query);
+    memcpy(q->data + q->used, data, len);
+    memcpy(&q->addrs[q->count], dest, addrlen);
+
+    d = &q->msgs[q->count++];
+    d->data = q->data + q->used;
+    d->len = len;
+    d->addr = (struct sockaddr *)&q->addrs[q->count - 1];
+    d->addrlen = addrlen;
+
+    q->used += len;
 }
 
-int compact_to_sockaddr(const struct bvalue *v, struct sockaddr *addr,
-                        socklen_t *addrlen)
+// 开始查询
+static void query_begin(struct krpc_writer *w, unsigned char *buf, size_t len)
 {
-    size_t l;
-    const unsigned char *p;
+    krpc_writer_init(w, buf, len);
+    krpc_write_char(w, 'd');
+    krpc_write_key(w, "a");
+    krpc_write_char(w, 'd');
+}
 
-    if (!(p = bvalue_string(v, &l)))
-        return -1;
+// 写入节点ID
+static void write_id(struct dht_node *n, struct krpc_writer *w)
+{
+    krpc_write_key(w, "id");
+    krpc_write_string(w, n->id, 20);
+}
 
-    switch (l) {
-    case 6:
-        {
-            struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+/*
+ * Terminate a query started with query_begin() and send it. The arguments,
+ * including "id", must have been written in canonical order.
+ */
+// 发送查询
+static void send_query(struct dht_node *n, struct krpc_writer *w,
+                       const char *method, uint16_t tid,
+                       const struct dht_endpoint *dest)
+{
+    struct sockaddr_storage ss;
+    socklen_t addrlen;
+    int rc;
 
-            sin->sin_family = AF_INET;
-            memcpy(&sin->sin_addr, p, 4);
-            memcpy(&sin->sin_port, p + 4, 2);
-            *addrlen = sizeof(*sin);
-            break;
-        }
-    case 18:
-        {
-            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+    krpc_write_char(w, 'e');
+    krpc_write_key(w, "q");
+    krpc_write_key(w, method);
+    krpc_write_key(w, "t");
+    krpc_write_string(w, &tid, sizeof(tid));
+    krpc_write_key(w, "y");
+    krpc_write_key(w, "q");
+    krpc_write_char(w, 'e');
 
-            sin6->sin6_family = AF_INET6;
-            memcpy(&sin6->sin6_addr, p, 16);
-            memcpy(&sin6->sin6_port, p + 16, 2);
-            *addrlen = sizeof(*sin6);
-            break;
-        }
-    default:
-        return -1;
+    rc = krpc_writer_len(w);
+    if (rc < 0) {
+        TRACE(("bencoding failed\n"));
+        return;
     }
 
-    return 0;
+    addrlen = endpoint_to_sockaddr(dest, &ss);
+    if (!addrlen)
+        return;
+
+    node_output(n, w->buf, rc, (struct sockaddr *)&ss, addrlen);
 }
 
-static struct bvalue *bvalue_new_compact(const struct sockaddr *addr,
-                                         socklen_t addrlen)
+// 套接字地址转为紧凑地址
+static size_t sockaddr_to_compact(const struct sockaddr *addr,
+                                  unsigned char buf[18])
 {
-    unsigned char buf[18];
-
-    (void)addrlen;
-
     switch (addr->sa_family) {
     case AF_INET:
         {
@@ -142,7 +163,7 @@ static struct bvalue *bvalue_new_compact(const struct sockaddr *addr,
             memcpy(buf, &sin->sin_addr, 4);
             memcpy(buf + 4, &sin->sin_port, 2);
         }
-        return bvalue_new_string(buf, 6);
+        return 6;
     case AF_INET6:
         {
             const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
@@ -150,53 +171,88 @@ static struct bvalue *bvalue_new_compact(const struct sockaddr *addr,
             memcpy(buf, &sin6->sin6_addr, 16);
             memcpy(buf + 16, &sin6->sin6_port, 2);
         }
-        return bvalue_new_string(buf, 18);
+        return 18;
     default:
         break;
     }
 
-    return NULL;
+    return 0;
+}
+
+// 写入紧凑地址
+static void write_compact(struct krpc_writer *w, const struct sockaddr *addr)
+{
+    unsigned char buf[18];
+    size_t l = sockaddr_to_compact(addr, buf);
+
+    if (l)
+        krpc_write_string(w, buf, l);
+}
+
+// 写入紧凑端点
+static void write_endpoint(struct krpc_writer *w,
+                           const struct dht_endpoint *ep)
+{
+    unsigned char buf[18];
+    size_t l = endpoint_to_compact(ep, buf);
+
+    if (l)
+        krpc_write_string(w, buf, l);
+}
+
+/*
+ * Start a response to dest. The caller then writes the remaining keys of
+ * the "r" dictionary, which always come after "id", in canonical order.
+ */
+// 开始响应
+static void response_begin(struct dht_node *n, struct krpc_writer *w,
+                           unsigned char *buf, size_t len,
+                           const struct sockaddr *dest)
+{
+    krpc_writer_init(w, buf, len);
+    krpc_write_char(w, 'd');
+    if (dest->sa_family == AF_INET || dest->sa_family == AF_INET6) {
+        krpc_write_key(w, "ip");
+        write_compact(w, dest);
+    }
+    krpc_write_key(w, "r");
+    krpc_write_char(w, 'd');
+    write_id(n, w);
 }
 
-#ifndef TESTING
 // 发送响应
-static void send_response(struct dht_node *n,
+static void send_response(struct dht_node *n, struct krpc_writer *w,
                           const unsigned char *tid, size_t tid_len,
-                          struct bvalue *ret,
                           const struct sockaddr *dest, socklen_t addrlen)
 {
-    unsigned char buf[2048];
-    struct bvalue *response;
-    struct bvalue *v;
     int rc;
 
-    response = bvalue_new_dict(); // 新建B编码字典
-    v = bvalue_new_string(tid, tid_len); // 新建B编码字符串
-    bvalue_dict_set(response, "t", v); // 设置"t"字典值
+    krpc_write_char(w, 'e');
+    krpc_write_key(w, "t");
+    krpc_write_string(w, tid, tid_len);
+    krpc_write_key(w, "y");
+    krpc_write_key(w, "r");
+    krpc_write_char(w, 'e');
 
-    v = bvalue_new_string((unsigned char *)"r", 1); // 新建B编码字符串
-    bvalue_dict_set(response, "y", v); // 设置"y"字典值
-
-    v = bvalue_new_compact(dest, addrlen);
-    if (v)
-        bvalue_dict_set(response, "ip", v); // 设置"ip"字典值
-
-    if (!ret)
-        ret = bvalue_new_dict(); // 新建B编码字典
-    v = bvalue_new_string(n->id, 20); // 新建B编码字符串
-    bvalue_dict_set(ret, "id", v); // 设置"id"字典值
-    bvalue_dict_set(response, "r", ret);
-
-    rc = bencode_buf(response, buf, sizeof(buf));
+    rc = krpc_writer_len(w);
     if (rc < 0) {
         TRACE(("bencoding failed\n"));
-        bvalue_free(response);
         return;
     }
 
-    n->output(buf, rc, dest, addrlen, n->opaque);
+    node_output(n, w->buf, rc, dest, addrlen);
+}
 
-    bvalue_free(response);
+// 发送空响应
+static void send_empty_response(struct dht_node *n,
+                                const unsigned char *tid, size_t tid_len,
+                                const struct sockaddr *dest, socklen_t addrlen)
+{
+    unsigned char buf[256];
+    struct krpc_writer w;
+
+    response_begin(n, &w, buf, sizeof(buf), dest);
+    send_response(n, &w, tid, tid_len, dest, addrlen);
 }
 
 // 发送错误
@@ -205,44 +261,41 @@ static void send_error(struct dht_node *n,
                        int error_code, const char *error_msg,
                        const struct sockaddr *dest, socklen_t addrlen)
 {
-    unsigned char buf[2048];
-    struct bvalue *response;
-    struct bvalue *error;
-    struct bvalue *v;
+    unsigned char buf[512];
+    struct krpc_writer w;
     int rc;
 
-    response = bvalue_new_dict(); // 新建B编码字典
+    krpc_writer_init(&w, buf, sizeof(buf));
+    krpc_write_char(&w, 'd');
 
-    if (tid) {
-        v = bvalue_new_string(tid, tid_len);
-        bvalue_dict_set(response, "t", v); // 设置"t"字典值
-    }
+    krpc_write_key(&w, "e");
+    krpc_write_char(&w, 'l');
+    krpc_write_integer(&w, error_code);
+    krpc_write_key(&w, error_msg);
+    krpc_write_char(&w, 'e');
 
-    v = bvalue_new_string((unsigned char *)"e", 1);
-    bvalue_dict_set(response, "y", v); // 设置"y"字典值
+    if (dest->sa_family == AF_INET || dest->sa_family == AF_INET6) {
+        krpc_write_key(&w, "ip");
+        write_compact(&w, dest);
+    }
 
-    v = bvalue_new_compact(dest, addrlen);
-    bvalue_dict_set(response, "ip", v); // 设置"ip"字典值
+    if (tid) {
+        krpc_write_key(&w, "t");
+        krpc_write_string(&w, tid, tid_len);
+    }
 
-    error = bvalue_new_list();
-    v = bvalue_new_integer(error_code);
-    bvalue_list_append(error, v);
-    v = bvalue_new_string((unsigned char *)error_msg, strlen(error_msg));
-    bvalue_list_append(error, v);
-    bvalue_dict_set(response, "e", error); // 设置"e"字典值
+    krpc_write_key(&w, "y");
+    krpc_write_key(&w, "e");
+    krpc_write_char(&w, 'e');
 
-    rc = bencode_buf(response, buf, sizeof(buf));
+    rc = krpc_writer_len(&w);
     if (rc < 0) {
         TRACE(("bencoding failed\n"));
-        bvalue_free(response);
         return;
     }
 
-    n->output(buf, rc, dest, addrlen, n->opaque);
-
-    bvalue_free(response);
+    node_output(n, buf, rc, dest, addrlen);
 }
-#endif
 
 // 计算节点间距离
 static void distance(const unsigned char id1[20], const unsigned char id2[20],
@@ -254,80 +307,446 @@ static void distance(const unsigned char id1[20], const unsigned char id2[20],
         ret[i] = id1[i] ^ id2[i]; // XOR异或
 }
 
+// 前导零位数
+static int clz32(uint32_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_clz(x);
+#else
+    int ret = 0;
+
+    while (!(x & 0x80000000)) {
+        x <<= 1;
+        ret++;
+    }
+
+    return ret;
+#endif
+}
+
+// 公共前缀长度
+static size_t common_prefix_len(const unsigned char *id1,
+                                const unsigned char *id2)
+{
+    size_t i;
+
+    for (i = 0; i < 20; i += 4) {
+        uint32_t x = ((uint32_t)(id1[i] ^ id2[i]) << 24) |
+                     ((uint32_t)(id1[i + 1] ^ id2[i + 1]) << 16) |
+                     ((uint32_t)(id1[i + 2] ^ id2[i + 2]) << 8) |
+                     (uint32_t)(id1[i + 3] ^ id2[i + 3]);
+
+        if (x)
+            return i * 8 + clz32(x);
+    }
+
+    return 160;
+}
+
+/*
+ * Bucket i holds the nodes sharing exactly i leading bits with our own ID,
+ * except for the last one which holds everything closer (it is the bucket
+ * that gets split).
+ */
+// 桶索引
+static size_t bucket_index(const struct dht_node *n,
+                           const struct routing_table *t,
+                           const unsigned char *id)
+{
+    size_t cpl = common_prefix_len(n->id, id);
+
+    return cpl < t->bucket_count ? cpl : t->bucket_count - 1;
+}
+
+/* IPv4 and IPv6 nodes are kept in separate routing tables (BEP 32) */
+// 地址族的路由表
+static struct routing_table *node_table(struct dht_node *n, int family)
+{
+    switch (family) {
+    case AF_INET:
+        return &n->tables[0];
+    case AF_INET6:
+        return &n->tables[1];
+    default:
+        break;
+    }
+
+    return NULL;
+}
+
+// 路由表是否为空
+static int table_empty(const struct routing_table *t)
+{
+    return t->bucket_count == 1 && t->buckets[0]->cnt == 0;
+}
+
+// 比较与目标的距离
+static int distance_cmp(const unsigned char *target, const unsigned char *id1,
+                        const unsigned char *id2)
+{
+    size_t i;
+
+    for (i = 0; i < 20; i++) {
+        unsigned char d1 = id1[i] ^ target[i];
+        unsigned char d2 = id2[i] ^ target[i];
+
+        if (d1 != d2)
+            return d1 < d2 ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// 按距离插入桶条目
+static size_t insert_closest(const unsigned char *target,
+                             struct bucket_entry *nodes, size_t cnt,
+                             size_t sz, const struct bucket_entry *e)
+{
+    size_t j;
+
+    if (cnt == sz) {
+        if (distance_cmp(target, e->id, nodes[sz - 1].id) >= 0)
+            return cnt;
+        cnt--; /* Drop the farthest one */
+    }
+
+    for (j = cnt; j > 0 && distance_cmp(target, e->id, nodes[j - 1].id) < 0;
+         j--)
+        nodes[j] = nodes[j - 1];
+    nodes[j] = *e;
+
+    return cnt + 1;
+}
+
+// 插入桶的所有条目
+static size_t insert_bucket(const unsigned char *target,
+                            struct bucket_entry *nodes, size_t cnt, size_t sz,
+                            const struct bucket *b)
+{
+    size_t i;
+
+    for (i = 0; i < b->cnt; i++)
+        cnt = insert_closest(target, nodes, cnt, sz, &b->nodes[i]);
+
+    return cnt;
+}
+
+/*
+ * Buckets are visited from the closest to the farthest from the target.
+ * With c the target's bucket, the nodes of bucket c agree with the target
+ * on its first c + 1 bits, those of the deeper buckets on its first c bits
+ * only, and those of a bucket i < c on its first i bits only. The search
+ * stops as soon as sz nodes are found in the groups visited so far.
+ */
 // 获得最近的节点
-static int get_closest(struct dht_node *n, const unsigned char *id,
-                       struct bucket_entry *nodes,
+static int get_closest(struct dht_node *n, const struct routing_table *t,
+                       const unsigned char *id, struct bucket_entry *nodes,
                        size_t sz)
 {
-    size_t i, j, k, cnt = 0;
-    struct bucket *b = n->buckets;
-    unsigned char *distances;
+    size_t c = bucket_index(n, t, id);
+    size_t i, cnt;
 
-    distances = malloc(sz * 20);
-    if (!distances)
-        return -1;
+    cnt = insert_bucket(id, nodes, 0, sz, t->buckets[c]);
 
-    while (b) {
-        for (i = 0; i < b->cnt; i++) {
-            unsigned char d[20];
+    /* The deeper buckets form a single group */
+    if (cnt < sz) {
+        for (i = c + 1; i < t->bucket_count; i++)
+            cnt = insert_bucket(id, nodes, cnt, sz, t->buckets[i]);
+    }
 
-            distance(id, b->nodes[i].id, d);
+    for (i = c; cnt < sz && i > 0; i--)
+        cnt = insert_bucket(id, nodes, cnt, sz, t->buckets[i - 1]);
 
-            for (j = 0; j < cnt; j++) {
-                if (memcmp(d, distances + j * 20, 20) < 0)
-                    break;
-            }
+    return cnt;
+}
 
-            if (j < sz) {
-                for (k = cnt < sz ? cnt : sz - 1; k > j; k--) {
-                    memcpy(distances + k * 20, distances + (k - 1) * 20, 20);
-                    nodes[k] = nodes[k - 1];
-                }
-                memcpy(distances + j * 20, d, 20);
-                nodes[j] = b->nodes[i];
-                if (cnt < sz)
-                    cnt++;
-            }
-        }
+// 获得两个路由表中最近的节点
+static int get_closest_all(struct dht_node *n, const unsigned char *id,
+                           struct bucket_entry *nodes, size_t sz)
+{
+    struct bucket_entry closest6[SEARCH_SEED_MAX];
+    size_t i, cnt, cnt6;
 
-        b = b->next;
-    }
+    if (sz > SEARCH_SEED_MAX)
+        sz = SEARCH_SEED_MAX;
 
-    free(distances);
+    cnt = get_closest(n, &n->tables[0], id, nodes, sz);
+    cnt6 = get_closest(n, &n->tables[1], id, closest6, sz);
+    for (i = 0; i < cnt6; i++)
+        cnt = insert_closest(id, nodes, cnt, sz, &closest6[i]);
 
     return cnt;
 }
 
-// 添加搜索节点
-static void add_search_node(struct search *s, const unsigned char *id,
-                            const struct sockaddr *addr, socklen_t addrlen)
+// 比较往返时间
+static int faster(const struct bucket_entry *a, const struct bucket_entry *b)
+{
+    return a->rtt && (!b->rtt || a->rtt < b->rtt);
+}
+
+/*
+ * Nodes sharing a prefix of the same length with the target are about as
+ * close to it. Among them, move the nodes with the lowest known round-trip
+ * time first, the order of the closest nodes is kept otherwise. Returns the
+ * number of nodes to use, at most sz.
+ */
+// 选择最快的节点
+static int select_fastest(const unsigned char *target,
+                          struct bucket_entry *nodes, int cnt, int sz)
+{
+    int i, j;
+
+    for (i = 1; i < cnt; i++) {
+        struct bucket_entry tmp = nodes[i];
+        size_t cpl = common_prefix_len(target, tmp.id);
+
+        for (j = i; j > 0 && faster(&tmp, &nodes[j - 1]) &&
+                    common_prefix_len(target, nodes[j - 1].id) == cpl; j--)
+            nodes[j] = nodes[j - 1];
+        nodes[j] = tmp;
+    }
+
+    return cnt < sz ? cnt : sz;
+}
+
+// 查找进行中的查询
+static struct pending_query *query_find(struct dht_node *n, uint16_t tid)
+{
+    size_t mask = n->query_cap - 1;
+    size_t i;
+
+    if (!n->query_cap)
+        return NULL;
+
+    for (i = tid & mask; n->queries[i].search; i = (i + 1) & mask) {
+        if (n->queries[i].tid == tid)
+            return &n->queries[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Transaction IDs are shared by all the queries we send, skip the ones of
+ * the pending search queries so that a response to a ping, announce or put
+ * is never taken for the response to one of them.
+ */
+// 下一个事务ID
+static uint16_t next_tid(struct dht_node *n)
+{
+    uint16_t tid;
+
+    do {
+        tid = n->tid++;
+    } while (query_find(n, tid));
+
+    return tid;
+}
+
+// 放置查询
+static void query_place(struct pending_query *slots, size_t cap,
+                        const struct pending_query *q)
+{
+    size_t i = q->tid & (cap - 1);
+
+    while (slots[i].search)
+        i = (i + 1) & (cap - 1);
+    slots[i] = *q;
+}
+
+// 扩大查询表
+static int query_table_grow(struct dht_node *n)
 {
-    struct search_node *new, **pn = &s->queue;
-    unsigned char d1[20];
+    size_t cap = n->query_cap ? 2 * n->query_cap : QUERY_TABLE_MIN;
+    struct pending_query *slots;
+    size_t i;
 
-    distance(id, s->id, d1);
+    slots = calloc(cap, sizeof(struct pending_query));
+    if (!slots)
+        return -1;
 
-    while (*pn) {
-        unsigned char d2[20];
-        int r;
+    for (i = 0; i < n->query_cap; i++) {
+        if (n->queries[i].search)
+            query_place(slots, cap, &n->queries[i]);
+    }
+
+    free(n->queries);
+    n->queries = slots;
+    n->query_cap = cap;
+
+    return 0;
+}
+
+/*
+ * Give the next query to node sn of search s its own transaction ID, so
+ * that the response can be matched in constant time.
+ */
+// 登记查询
+static int query_add(struct dht_node *n, struct search *s,
+                     struct search_node *sn, const struct timeval *now)
+{
+    struct pending_query q;
+
+    if (n->query_count >= UINT16_MAX)
+        return -1; /* All transaction IDs are taken */
+
+    /* Keep the load factor under 1/2 */
+    if (2 * (n->query_count + 1) > n->query_cap && query_table_grow(n))
+        return -1;
 
-        distance((*pn)->id, s->id, d2); // 计算节点间距离
-        r = memcmp(d1, d2, 20);
-        if (r == 0)
-            return; /* We already have this one, skip */
-        else if (r < 0)
+    q.tid = next_tid(n);
+    q.search = s;
+    q.sn = sn;
+    q.sent = *now;
+    query_place(n->queries, n->query_cap, &q);
+    n->query_count++;
+
+    sn->pending = 1;
+    sn->tid = q.tid;
+
+    return 0;
+}
+
+/*
+ * Linear probing deletion: shift back the following entries of the probe
+ * sequence rather than leaving a tombstone.
+ */
+// 移除查询
+static void query_remove(struct dht_node *n, struct pending_query *q)
+{
+    size_t mask = n->query_cap - 1;
+    size_t i = q - n->queries;
+    size_t j = i, home;
+
+    q->sn->pending = 0;
+
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!n->queries[j].search)
             break;
 
-        pn = &(*pn)->next;
+        /* Entry j may move to i unless its home slot lies in (i, j] */
+        home = n->queries[j].tid & mask;
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            n->queries[i] = n->queries[j];
+            i = j;
+        }
     }
 
-    new = malloc(sizeof(struct search_node));
-    if (!new)
-        return;
+    n->queries[i].search = NULL;
+    n->query_count--;
+}
+
+// 取消节点的查询
+static void query_forget(struct dht_node *n, struct search_node *sn)
+{
+    struct pending_query *q;
+
+    if (sn->pending && (q = query_find(n, sn->tid)))
+        query_remove(n, q);
+}
+
+// 释放搜索节点的资源
+static void search_node_clear(struct dht_node *n, struct search_node *sn)
+{
+    query_forget(n, sn);
+    if (sn->token)
+        free(sn->token);
+    if (sn->peers)
+        free(sn->peers);
+    if (sn->v)
+        bvalue_free(sn->v);
+}
+
+// 释放搜索节点内存空间
+static void search_node_free(struct dht_node *n, struct search_node *sn)
+{
+    search_node_clear(n, sn);
+    free(sn);
+}
+
+/*
+ * The nodes of a search form a bounded frontier: an array sorted by
+ * distance to the target, with the distances computed once. The public
+ * list of search nodes (s->queue, chained through next) is kept in the
+ * same order.
+ */
+// 查找前沿位置
+static size_t frontier_find(const struct search *s, const unsigned char *dist,
+                            int *found)
+{
+    size_t lo = 0, hi = s->node_count;
+
+    *found = 0;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int r = memcmp(s->frontier[mid].dist, dist, 20);
+
+        if (r == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (r < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// 移出前沿
+static struct search_node *frontier_remove(struct search *s, size_t i)
+{
+    struct search_node *sn = s->frontier[i].sn;
+    struct search_node *next;
+
+    memmove(&s->frontier[i], &s->frontier[i + 1],
+            (s->node_count - i - 1) * sizeof(struct frontier_entry));
+    s->node_count--;
+
+    next = i < s->node_count ? s->frontier[i].sn : NULL;
+    if (i > 0)
+        s->frontier[i - 1].sn->next = next;
+    else
+        s->queue = next;
+
+    return sn;
+}
+
+// 添加搜索节点
+static struct search_node *add_search_node(struct dht_node *n,
+                                           struct search *s,
+                                           const unsigned char *id,
+                                           const struct dht_endpoint *addr,
+                                           unsigned int rtt)
+{
+    struct search_node *new;
+    unsigned char dist[20];
+    size_t pos;
+    int found;
+
+    distance(id, s->id, dist);
+
+    pos = frontier_find(s, dist, &found);
+    if (found)
+        return NULL; /* We already have this one, skip */
+
+    if (s->node_count == SEARCH_FRONTIER_MAX) {
+        if (pos == SEARCH_FRONTIER_MAX)
+            return NULL; /* Further than all the nodes we know of */
+
+        /* Recycle the furthest node */
+        new = frontier_remove(s, s->node_count - 1);
+        search_node_clear(n, new);
+    } else {
+        new = malloc(sizeof(struct search_node));
+        if (!new)
+            return NULL;
+    }
 
     memcpy(new->id, id, 20);
-    memcpy(&new->addr, addr, addrlen);
-    new->addrlen = addrlen;
+    new->addr = *addr;
     new->token = NULL;
     new->token_len = 0;
     new->peers = NULL;
@@ -335,103 +754,349 @@ static void add_search_node(struct search *s, const unsigned char *id,
     new->v = NULL;
     new->seq = -1;
     timerclear(&new->reply_time);
+    timerclear(&new->query_time);
+    timerclear(&new->stale_time);
     timerclear(&new->next_query);
+    new->rtt = rtt;
     new->queried = 0;
+    new->pending = 0;
+    new->tid = 0;
     new->error = 0;
 
-    new->next = *pn;
-    *pn = new;
-
+    memmove(&s->frontier[pos + 1], &s->frontier[pos],
+            (s->node_count - pos) * sizeof(struct frontier_entry));
+    memcpy(s->frontier[pos].dist, dist, 20);
+    s->frontier[pos].sn = new;
     s->node_count++;
+
+    new->next = pos + 1 < s->node_count ? s->frontier[pos + 1].sn : NULL;
+    if (pos > 0)
+        s->frontier[pos - 1].sn->next = new;
+    else
+        s->queue = new;
+
+    return new;
 }
 
-// 释放搜索节点内存空间
-static void search_node_free(struct search_node *sn)
+/*
+ * The result fields of dst must be empty. On failure they keep what could
+ * be copied, which is released with dst.
+ */
+// 复制搜索节点的结果
+static int search_node_copy_result(struct search_node *dst,
+                                   const struct search_node *src)
+{
+    dst->reply_time = src->reply_time;
+    dst->query_time = src->query_time;
+    dst->seq = src->seq;
+    memcpy(dst->k, src->k, sizeof(dst->k));
+    memcpy(dst->sig, src->sig, sizeof(dst->sig));
+
+    if (src->token) {
+        dst->token = malloc(src->token_len);
+        if (!dst->token)
+            return -1;
+        memcpy(dst->token, src->token, src->token_len);
+        dst->token_len = src->token_len;
+    }
+    if (src->peers) {
+        dst->peers = malloc(src->peer_count * sizeof(struct dht_endpoint));
+        if (!dst->peers)
+            return -1;
+        memcpy(dst->peers, src->peers,
+               src->peer_count * sizeof(struct dht_endpoint));
+        dst->peer_count = src->peer_count;
+    }
+    if (src->v) {
+        dst->v = bvalue_copy(src->v);
+        if (!dst->v)
+            return -1;
+    }
+
+    return 0;
+}
+
+// 查找缓存的搜索结果
+static struct cached_result *cache_find(struct dht_node *n,
+                                        const unsigned char *id,
+                                        int search_type,
+                                        const struct timeval *now)
 {
-    if (sn->token)
-        free(sn->token);
-    if (sn->peers)
-        free(sn->peers);
-    if (sn->v)
-        bvalue_free(sn->v);
-    free(sn);
+    struct cached_result *c;
+
+    for (c = n->search_cache; c; c = c->next) {
+        if (c->search_type == search_type && !memcmp(c->id, id, 20)) {
+            if (now && timercmp(&c->timer.expire, now, <=))
+                return NULL; /* Not collected yet */
+            return c;
+        }
+    }
+
+    return NULL;
 }
 
-// 搜索完成时
-static void search_complete(struct dht_node *n, struct search *s)
+// 释放缓存结果的节点
+static void cache_free_nodes(struct dht_node *n, struct cached_result *c)
 {
-    struct search_node *sn = s->queue;
+    while (c->nodes) {
+        struct search_node *next = c->nodes->next;
 
-    TRACE(("Search %s complete\n", hex(s->id)));
+        search_node_free(n, c->nodes);
+        c->nodes = next;
+    }
+}
 
-    if (s->callback)
-        s->callback(n, sn, s->opaque);
+// 释放缓存的搜索结果
+static void cache_free(struct dht_node *n, struct cached_result *c)
+{
+    if (c->next)
+        c->next->pprev = c->pprev;
+    *c->pprev = c->next;
+    timer_del(n->timers, &c->timer);
+    cache_free_nodes(n, c);
+    free(c);
+}
 
-    sn = s->queue;
-    while (sn) {
-        struct search_node *next = sn->next;
+/*
+ * Keep a copy of the nodes that replied to a GET_PEERS or GET search: the
+ * SEARCH_RESULT_MAX closest ones, which hold the tokens for a later announce
+ * or put, and any other one that returned peers or a value. Results that
+ * came from the cache are not stored again, so that they expire.
+ */
+// 缓存搜索结果
+static void cache_store(struct dht_node *n, const struct search *s,
+                        const struct timeval *now)
+{
+    struct cached_result *c, *o, *oldest = NULL;
+    struct search_node **tail;
+    struct timeval expire, ttl;
+    size_t i, count = 0, nreplied = 0;
+
+    if (!n->search_cache_ttl || s->cached ||
+        (s->search_type != GET_PEERS && s->search_type != GET))
+        return;
+
+    for (i = 0; i < s->node_count; i++) {
+        if (timerisset(&s->frontier[i].sn->reply_time))
+            nreplied++;
+    }
+    if (nreplied < SEARCH_RESULT_MAX)
+        return; /* Cancelled or incomplete */
+
+    c = cache_find(n, s->id, s->search_type, NULL);
+    if (c)
+        cache_free_nodes(n, c);
+    else {
+        c = malloc(sizeof(struct cached_result));
+        if (!c)
+            return;
+        if (timer_add(n->timers, &c->timer, TIMER_CACHE)) {
+            free(c);
+            return;
+        }
 
-        search_node_free(sn);
-        sn = next;
+        /* Only make room once the new entry exists */
+        for (o = n->search_cache; o; o = o->next) {
+            if (!oldest ||
+                timercmp(&o->timer.expire, &oldest->timer.expire, <))
+                oldest = o;
+            count++;
+        }
+        if (count >= SEARCH_CACHE_MAX)
+            cache_free(n, oldest);
+
+        memcpy(c->id, s->id, 20);
+        c->search_type = s->search_type;
+        c->nodes = NULL;
+
+        c->next = n->search_cache;
+        if (c->next)
+            c->next->pprev = &c->next;
+        c->pprev = &n->search_cache;
+        n->search_cache = c;
     }
 
+    tail = &c->nodes;
+    nreplied = 0;
+    for (i = 0; i < s->node_count; i++) {
+        const struct search_node *sn = s->frontier[i].sn;
+        struct search_node *copy;
+
+        if (!timerisset(&sn->reply_time))
+            continue;
+        if (nreplied++ >= SEARCH_RESULT_MAX && !sn->peer_count && !sn->v)
+            continue;
+
+        copy = malloc(sizeof(struct search_node));
+        if (!copy)
+            goto fail;
+        *copy = *sn;
+        copy->pending = 0;
+        copy->token = NULL;
+        copy->token_len = 0;
+        copy->peers = NULL;
+        copy->peer_count = 0;
+        copy->v = NULL;
+        copy->next = NULL;
+
+        *tail = copy;
+        tail = &copy->next;
+        if (search_node_copy_result(copy, sn))
+            goto fail;
+    }
+
+    ttl.tv_sec = n->search_cache_ttl;
+    ttl.tv_usec = 0;
+    timeradd(now, &ttl, &expire);
+    timer_set(n->timers, &c->timer, &expire);
+    return;
+
+fail:
+    /* A partial result would lack tokens, peers or values */
+    cache_free(n, c);
+}
+
+// 移出搜索列表
+static void search_unlink(struct dht_node *n, struct search *s)
+{
     if (s->next)
         s->next->pprev = s->pprev;
     else
         n->searches.tail = s->pprev;
     *s->pprev = s->next;
+}
 
+// 释放搜索
+static void search_free(struct dht_node *n, struct search *s)
+{
+    size_t i;
+
+    for (i = 0; i < s->node_count; i++)
+        search_node_free(n, s->frontier[i].sn);
+
+    timer_del(n->timers, &s->timer);
     free(s);
 }
 
+/*
+ * The search leaves the search list before the callbacks run, so that a
+ * callback starting the same search again gets a new one.
+ */
+// 搜索完成时
+static void search_complete(struct dht_node *n, struct search *s,
+                            const struct timeval *now)
+{
+    struct search_request *r;
+
+    TRACE(("Search %s complete\n", hex(s->id)));
+
+    cache_store(n, s, now);
+
+    search_unlink(n, s);
+    s->done = 1;
+
+    /* A callback may cancel one of the other requests */
+    while ((r = s->requests)) {
+        s->requests = r->next;
+        if (r->callback)
+            r->callback(n, s->queue, r->opaque);
+        free(r);
+    }
+
+    search_free(n, s);
+}
+
 // 获得随机的节点
 static struct bucket_entry *get_random_node(struct dht_node *n)
 {
-    struct bucket *b = n->buckets;
+    struct routing_table *t;
+    struct bucket *b;
     uint32_t r, count = 0;
+    size_t i, k;
 
-    while (b) {
-        count += b->cnt;
-        b = b->next;
+    for (k = 0; k < 2; k++) {
+        t = &n->tables[k];
+        for (i = 0; i < t->bucket_count; i++)
+            count += t->buckets[i]->cnt;
     }
     if (!count)
         return NULL;
     r = random_value_uniform(count);
-    b = n->buckets;
-    while (b) {
-        if (r < b->cnt)
-            break;
-        r -= b->cnt;
-        b = b->next;
+    for (k = 0; k < 2; k++) {
+        t = &n->tables[k];
+        for (i = 0; i < t->bucket_count; i++) {
+            b = t->buckets[i];
+            if (r < b->cnt)
+                return &b->nodes[r];
+            r -= b->cnt;
+        }
     }
 
-    return &b->nodes[r];
+    return NULL;
+}
+
+/*
+ * A query is presumed lost after twice the round-trip time of the node, or
+ * of the nodes that replied so far in the search if the node's is unknown.
+ * The node then no longer counts against the concurrency limit, but a late
+ * response is still accepted until search_query_timeout.
+ */
+// 查询过期时间
+static void query_stale_time(const struct search *s,
+                             struct search_node *sn,
+                             const struct timeval *now)
+{
+    unsigned int rtt = sn->rtt ? sn->rtt : s->rtt;
+    unsigned int ms = rtt ? 2 * rtt : SEARCH_STALE_MAX;
+    struct timeval tv;
+
+    if (ms < SEARCH_STALE_MIN)
+        ms = SEARCH_STALE_MIN;
+    else if (ms > SEARCH_STALE_MAX)
+        ms = SEARCH_STALE_MAX;
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    timeradd(now, &tv, &sn->stale_time);
 }
 
+/*
+ * Keep up to SEARCH_ALPHA queries in flight to the closest nodes that have
+ * not replied yet. This runs whenever a response arrives, and otherwise
+ * when the next pending query turns stale.
+ */
 // 搜索进度
 static void search_progress(struct dht_node *n, struct search *s,
                             const struct timeval *now)
 {
-    struct search_node *sn, **sp;
-    struct bvalue *args, *v;
+    struct search_node *sn;
+    unsigned char buf[256];
+    struct krpc_writer w;
+    struct timeval next;
+    size_t i = 0;
     int nqueries = 0;
+    int ninflight = 0;
     int nreplied = 0;
+    int waiting = 0;
 
-    if (timercmp(&s->next_query, now, >))
-        return;
+    timeradd(now, &search_iteration_timeout, &next);
+
+    while (i < s->node_count) {
+        sn = s->frontier[i].sn;
 
-    sp = &s->queue;
-    while ((sn = *sp)) {
         /* The node has replied */
         if (timerisset(&sn->reply_time)) {
             /*
              * The search terminates when enough nodes close to the target have
-             * replied and we have not heard of other nodes any closer that we
-             * can query.
+             * replied and no closer node is still to be queried or about to
+             * answer. Nodes further away do not matter.
              */
-            if (++nreplied >= SEARCH_RESULT_MAX && !nqueries) {
-                search_complete(n, s);
-                return;
+            if (++nreplied >= SEARCH_RESULT_MAX) {
+                if (!waiting) {
+                    search_complete(n, s, now);
+                    return;
+                }
+                break;
             }
             goto cont;
         }
@@ -442,52 +1107,75 @@ static void search_progress(struct dht_node *n, struct search *s,
 
         /* Only query the same node once every 10 seconds */
         if (timerisset(&sn->next_query) &&
-            timercmp(&sn->next_query, now, >))
+            timercmp(&sn->next_query, now, >)) {
+            if (timercmp(&sn->stale_time, now, >)) {
+                ninflight++;
+                waiting = 1;
+                if (timercmp(&sn->stale_time, &next, <))
+                    next = sn->stale_time;
+            } else if (timercmp(&sn->next_query, &next, <)) {
+                /* Stale, query other nodes meanwhile */
+                next = sn->next_query;
+            }
             goto cont;
+        }
 
         if (sn->queried >= 2) {
             /* This node failed to respond to us twice, evict it from search */
-            *sp = sn->next;
-            free(sn);
+            frontier_remove(s, i);
+            search_node_free(n, sn);
             continue;
         }
 
-        args = bvalue_new_dict();
-        v = bvalue_new_string(s->id, 20);
+        /* Still to be queried, the search cannot complete yet */
+        if (ninflight >= SEARCH_ALPHA)
+            break;
+
+        /* A late response to the previous query is no longer expected */
+        query_forget(n, sn);
+        if (query_add(n, s, sn, now))
+            break; /* Try again at the next iteration */
+
+        query_begin(&w, buf, sizeof(buf));
+        write_id(n, &w);
         switch (s->search_type) {
         case FIND_NODE: // 查找节点
-            bvalue_dict_set(args, "target", v);
-            send_query(n, "find_node", s->tid, args,
-                       (struct sockaddr *)&sn->addr, sn->addrlen);
+            krpc_write_key(&w, "target");
+            krpc_write_string(&w, s->id, 20);
+            send_query(n, &w, "find_node", sn->tid, &sn->addr);
             break;
         case GET_PEERS: // 获得对等端
-            bvalue_dict_set(args, "info_hash", v);
-            send_query(n, "get_peers", s->tid, args,
-                       (struct sockaddr *)&sn->addr, sn->addrlen);
+            krpc_write_key(&w, "info_hash");
+            krpc_write_string(&w, s->id, 20);
+            send_query(n, &w, "get_peers", sn->tid, &sn->addr);
             break;
         case GET: // 获取
-            bvalue_dict_set(args, "target", v);
-            send_query(n, "get", s->tid, args,
-                       (struct sockaddr *)&sn->addr, sn->addrlen);
+            krpc_write_key(&w, "target");
+            krpc_write_string(&w, s->id, 20);
+            send_query(n, &w, "get", sn->tid, &sn->addr);
             break;
         default:
             break;
         }
 
         sn->queried++;
+        sn->query_time = *now;
         timeradd(now, &search_query_timeout, &sn->next_query);
+        query_stale_time(s, sn, now);
+        if (timercmp(&sn->stale_time, &next, <))
+            next = sn->stale_time;
 
-        /* Only query the 8 closest nodes we heard about */
-        if (++nqueries >= 8)
-            break;
+        waiting = 1;
+        nqueries++;
+        ninflight++;
     cont:
-        sp = &sn->next;
+        i++;
     }
 
-    TRACE(("search %s: replied=%d, queried=%d\n", hex(s->id),
-           nreplied, nqueries));
+    TRACE(("search %s: replied=%d, queried=%d, in flight=%d\n", hex(s->id),
+           nreplied, nqueries, ninflight));
 
-    if (nqueries == 0) {
+    if (ninflight == 0) {
         struct bucket_entry *e = get_random_node(n);
 
         /*
@@ -495,25 +1183,83 @@ static void search_progress(struct dht_node *n, struct search *s,
          * the search has stalled.
          */
         if (e)
-            add_search_node(s, e->id, (struct sockaddr *)&e->addr, e->addrlen);
+            add_search_node(n, s, e->id, &e->addr, e->rtt);
     }
 
-    timeradd(now, &search_iteration_timeout, &s->next_query);
+    s->next_query = next;
+    timer_set(n->timers, &s->timer, &s->next_query);
 }
 
-// 节点搜索
-int dht_node_search(struct dht_node *n, const unsigned char id[20],
-                    int search_type,
-                    search_complete_t callback, void *opaque,
-                    dht_search_t *handle)
+// 查找进行中的搜索
+static struct search *find_search(struct dht_node *n,
+                                  const struct routing_table *t,
+                                  const unsigned char *id, int search_type)
 {
-    struct search *s = malloc(sizeof(struct search));
+    struct search *s;
+
+    for (s = n->searches.first; s; s = s->next) {
+        if (s->table == t && s->search_type == search_type &&
+            !memcmp(s->id, id, 20))
+            return s;
+    }
+
+    return NULL;
+}
+
+/*
+ * Start a search seeded with the closest nodes from routing table t, or
+ * from both tables if t is NULL. If the same search is already running,
+ * the caller is added to its requests instead.
+ */
+// 开始搜索
+static int start_search(struct dht_node *n, const struct routing_table *t,
+                        const unsigned char id[20], int search_type,
+                        search_complete_t callback, void *opaque,
+                        dht_search_t *handle)
+{
+    struct search_request *r = malloc(sizeof(struct search_request));
+    struct search_request **pr;
+    struct search *s;
+    struct cached_result *c = NULL;
+    struct search_node *sn;
     struct timeval now;
     int i, cnt;
-    struct bucket_entry closest[8];
+    struct bucket_entry closest[SEARCH_SEED_MAX];
 
-    if (!s)
-      return -1;
+    if (!r)
+        return -1;
+
+    r->callback = callback;
+    r->opaque = opaque;
+
+    s = find_search(n, t, id, search_type);
+    if (s) {
+        TRACE(("Joining search for %s\n", hex(id)));
+
+        /* Callbacks are called in the order the searches were started */
+        for (pr = &s->requests; *pr; pr = &(*pr)->next)
+            ;
+        r->search = s;
+        r->next = NULL;
+        *pr = r;
+
+        if (handle)
+            *handle = r;
+
+        return 0;
+    }
+
+    s = malloc(sizeof(struct search));
+    if (!s) {
+        free(r);
+        return -1;
+    }
+
+    if (timer_add(n->timers, &s->timer, TIMER_SEARCH)) {
+        free(s);
+        free(r);
+        return -1;
+    }
 
     gettimeofday(&now, NULL);
 
@@ -521,71 +1267,286 @@ int dht_node_search(struct dht_node *n, const unsigned char id[20],
 
     memcpy(s->id, id, 20);
     s->next_query = now;
-    s->tid = n->tid++;
     s->search_type = search_type;
-    s->callback = callback;
-    s->opaque = opaque;
+    s->table = t;
     s->queue = NULL;
     s->node_count = 0;
+    s->rtt = 0;
+    s->cached = 0;
+    s->done = 0;
+
+    r->search = s;
+    r->next = NULL;
+    s->requests = r;
 
     s->next = NULL;
     s->pprev = n->searches.tail;
     *n->searches.tail = s;
     n->searches.tail = &s->next;
 
-    cnt = get_closest(n, s->id, closest, 8);
-    for (i = 0; i < cnt; i++)
-        add_search_node(s, closest[i].id, (struct sockaddr *)&closest[i].addr,
-                        closest[i].addrlen);
-    search_progress(n, s, &now);
+    if (!t && (search_type == GET_PEERS || search_type == GET))
+        c = cache_find(n, s->id, search_type, &now);
+
+    if (c) {
+        TRACE(("Search %s answered from cache\n", hex(id)));
+
+        /*
+         * Complete from the cached nodes on the next dht_node_work() call,
+         * the caller does not expect its callback before this returns.
+         */
+        for (sn = c->nodes; sn; sn = sn->next) {
+            struct search_node *new = add_search_node(n, s, sn->id, &sn->addr,
+                                                      sn->rtt);
+
+            /* Not a result without its token, peers or value */
+            if (new && search_node_copy_result(new, sn))
+                timerclear(&new->reply_time);
+        }
+        s->cached = 1;
+        timer_set(n->timers, &s->timer, &now);
+    } else {
+        if (t)
+            cnt = get_closest(n, t, s->id, closest, SEARCH_SEED_MAX);
+        else
+            cnt = get_closest_all(n, s->id, closest, SEARCH_SEED_MAX);
+        cnt = select_fastest(s->id, closest, cnt, 8);
+        for (i = 0; i < cnt; i++)
+            add_search_node(n, s, closest[i].id, &closest[i].addr,
+                            closest[i].rtt);
+        search_progress(n, s, &now);
+    }
 
     if (handle)
-        *handle = s;
+        *handle = r;
 
     return 0;
 }
 
+// 节点搜索
+int dht_node_search(struct dht_node *n, const unsigned char id[20],
+                    int search_type,
+                    search_complete_t callback, void *opaque,
+                    dht_search_t *handle)
+{
+    return start_search(n, NULL, id, search_type, callback, opaque, handle);
+}
+
+/*
+ * Only the network search is stopped once its last request is cancelled,
+ * the other callers keep waiting for its results. A completion callback
+ * cancelling its own request finds it already off the list.
+ */
 // 取消节点
 void dht_node_cancel(struct dht_node *n, dht_search_t handle)
 {
-    struct search *s = handle;
-    struct search_node *sn = s->queue;
+    struct search_request *r = handle;
+    struct search_request **pr;
+    struct search *s = r->search;
 
-    /* Free search queue */
-    sn = s->queue;
-    while (sn) {
-        struct search_node *next = sn->next;
+    for (pr = &s->requests; *pr && *pr != r; pr = &(*pr)->next)
+        ;
+    if (!*pr)
+        return;
+    *pr = r->next;
 
-        search_node_free(sn);
-        sn = next;
+    if (!s->requests && !s->done) {
+        TRACE(("Search %s cancelled\n", hex(s->id)));
+        search_unlink(n, s);
+        search_free(n, s);
     }
-    s->queue = NULL;
 
-    search_complete(n, s);
+    if (r->callback)
+        r->callback(n, NULL, r->opaque);
+    free(r);
 }
 
 // 转存节点的桶
 void dht_node_dump_buckets(struct dht_node *n)
 {
-    struct bucket *b = n->buckets;
+    size_t i, j, k;
 
-    fprintf(stdout, "buckets:\n");
-    while (b) {
-        size_t i;
+    for (k = 0; k < 2; k++) {
+        const struct routing_table *t = &n->tables[k];
 
-        fprintf(stdout, "  - %s", hex(b->first));
-        if (b->next)
-            fprintf(stdout, "-%s:\n", hex(b->next->first));
-        else
-            fprintf(stdout, ":\n");
+        fprintf(stdout, "%s:\n", k ? "buckets6" : "buckets");
+        for (i = 0; i < t->bucket_count; i++) {
+            struct bucket *b = t->buckets[i];
+
+            fprintf(stdout, "  - %zu%s:\n", i,
+                    i == t->bucket_count - 1 ? "+" : "");
+
+            for (j = 0; j < b->cnt; j++)
+                fprintf(stdout, "    * %s %s\n", hex(b->nodes[j].id),
+                        endpoint_fmt(&b->nodes[j].addr));
+        }
+    }
+}
+
+/*
+ * Snapshot reference counts may be dropped from other threads than the one
+ * running the node.
+ */
+#ifdef _WIN32
+#define refcnt_inc(p) InterlockedIncrement(p)
+#define refcnt_dec(p) InterlockedDecrement(p)
+#else
+#define refcnt_inc(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#define refcnt_dec(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#endif
+
+// 释放桶快照引用
+static void bucket_snapshot_unref(struct bucket_snapshot *bs)
+{
+    if (!refcnt_dec(&bs->refcnt))
+        free(bs);
+}
+
+/*
+ * Drop the cached copy of a bucket. Must be called whenever the nodes of
+ * the bucket change, the next snapshot copies the bucket again.
+ */
+// 桶已修改
+static void bucket_dirty(struct bucket *b)
+{
+    if (b->snap) {
+        bucket_snapshot_unref(b->snap);
+        b->snap = NULL;
+    }
+}
+
+// 桶快照
+static struct bucket_snapshot *bucket_snapshot(struct bucket *b)
+{
+    struct bucket_snapshot *bs = b->snap;
+    size_t i;
+
+    if (!bs) {
+        bs = malloc(sizeof(struct bucket_snapshot) +
+                    b->cnt * sizeof(struct dht_snapshot_entry));
+        if (!bs)
+            return NULL;
+        bs->refcnt = 1; /* Reference held by the bucket */
+        bs->cnt = b->cnt;
+        for (i = 0; i < b->cnt; i++) {
+            struct dht_snapshot_entry *e = &bs->nodes[i];
+
+            memcpy(e->id, b->nodes[i].id, 20);
+            e->addr = b->nodes[i].addr;
+            e->last_seen = b->nodes[i].last_seen;
+            e->rtt = b->nodes[i].rtt;
+            e->pinged = b->nodes[i].pinged;
+        }
+        b->snap = bs;
+    }
+
+    refcnt_inc(&bs->refcnt);
+
+    return bs;
+}
+
+// 获取路由表快照
+struct dht_snapshot *dht_node_snapshot(struct dht_node *n)
+{
+    struct dht_snapshot *s = malloc(sizeof(struct dht_snapshot));
+    size_t i, k;
+
+    if (!s)
+        return NULL;
+
+    s->refcnt = 1;
+    for (k = 0; k < 2; k++) {
+        struct routing_table *t = &n->tables[k];
+
+        s->bucket_count[k] = 0;
+        for (i = 0; i < t->bucket_count; i++) {
+            s->buckets[k][i] = bucket_snapshot(t->buckets[i]);
+            if (!s->buckets[k][i]) {
+                dht_snapshot_unref(s);
+                return NULL;
+            }
+            s->bucket_count[k]++;
+        }
+    }
+
+    return s;
+}
+
+// 增加快照引用
+struct dht_snapshot *dht_snapshot_ref(struct dht_snapshot *s)
+{
+    refcnt_inc(&s->refcnt);
+
+    return s;
+}
+
+// 释放快照引用
+void dht_snapshot_unref(struct dht_snapshot *s)
+{
+    size_t i, k;
+
+    if (refcnt_dec(&s->refcnt))
+        return;
+
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < s->bucket_count[k]; i++)
+            bucket_snapshot_unref(s->buckets[k][i]);
+    }
+    free(s);
+}
+
+// 快照的节点数
+size_t dht_snapshot_node_count(const struct dht_snapshot *s, int family)
+{
+    size_t i, k, cnt = 0;
+
+    switch (family) {
+    case AF_INET:
+        k = 0;
+        break;
+    case AF_INET6:
+        k = 1;
+        break;
+    default:
+        return 0;
+    }
+
+    for (i = 0; i < s->bucket_count[k]; i++)
+        cnt += s->buckets[k][i]->cnt;
 
-        for (i = 0; i < b->cnt; i++)
-            fprintf(stdout, "    * %s %s\n", hex(b->nodes[i].id),
-                    sockaddr_fmt((struct sockaddr *)&b->nodes[i].addr,
-                                 b->nodes[i].addrlen));
+    return cnt;
+}
+
+// 初始化快照迭代器
+void dht_snapshot_iter_init(struct dht_snapshot_iter *it,
+                            const struct dht_snapshot *s)
+{
+    it->snap = s;
+    it->table = 0;
+    it->bucket = 0;
+    it->pos = 0;
+}
+
+// 快照的下一个节点
+const struct dht_snapshot_entry *dht_snapshot_next(struct dht_snapshot_iter *it)
+{
+    const struct dht_snapshot *s = it->snap;
+
+    while (it->table < 2) {
+        if (it->bucket < s->bucket_count[it->table]) {
+            const struct bucket_snapshot *bs = s->buckets[it->table][it->bucket];
 
-        b = b->next;
+            if (it->pos < bs->cnt)
+                return &bs->nodes[it->pos++];
+            it->bucket++;
+            it->pos = 0;
+            continue;
+        }
+        it->table++;
+        it->bucket = 0;
+        it->pos = 0;
     }
+
+    return NULL;
 }
 
 // CRC32校验
@@ -677,6 +1638,123 @@ static void bootstrap_done(struct dht_node *n,
                            const struct search_node *nodes,
                            void *opaque);
 
+/*
+ * In wide mode the buckets furthest from our ID, which cover most of the ID
+ * space, hold more nodes (as in libtorrent's extended routing table).
+ */
+static const size_t wide_bucket_sizes[] = { 128, 64, 32, 16 };
+
+// 桶的容量
+static size_t bucket_size(const struct dht_node *n, size_t i)
+{
+    if (n->routing_mode == DHT_ROUTING_WIDE &&
+        i < sizeof(wide_bucket_sizes) / sizeof(wide_bucket_sizes[0]))
+        return wide_bucket_sizes[i];
+
+    return BUCKET_ENTRY_MAX;
+}
+
+/*
+ * Arm the bucket timer for the next time the bucket needs attention: its
+ * refresh time, unless a refresh is already running, and when the bucket
+ * is full, the next time bucket_gc() may evict a failed node or ping the
+ * least recently seen one.
+ */
+// 调度桶
+static void bucket_schedule(struct dht_node *n, struct bucket *b)
+{
+    const struct bucket_entry *oldest = NULL;
+    const struct timeval *expire = NULL;
+    size_t i;
+
+    if (!b->refresh)
+        expire = &b->refresh_time;
+
+    if (b->cnt == b->size) {
+        for (i = 0; i < b->cnt; i++) {
+            const struct bucket_entry *e = &b->nodes[i];
+
+            if (e->pinged >= 2 &&
+                (!expire || timercmp(&e->next_ping, expire, <)))
+                expire = &e->next_ping;
+            if (!oldest || timercmp(&e->last_seen, &oldest->last_seen, <))
+                oldest = e;
+        }
+        if (oldest && (!expire || timercmp(&oldest->next_ping, expire, <)))
+            expire = &oldest->next_ping;
+    }
+
+    if (expire)
+        timer_set(n->timers, &b->timer, expire);
+    else
+        timer_clear(n->timers, &b->timer);
+}
+
+// 新建桶
+static struct bucket *bucket_new(struct dht_node *n, struct routing_table *t,
+                                 size_t i)
+{
+    size_t size = bucket_size(n, i);
+    struct bucket *b;
+
+    b = malloc(sizeof(struct bucket) + size * sizeof(struct bucket_entry));
+    if (!b)
+        return NULL;
+    if (timer_add(n->timers, &b->timer, TIMER_BUCKET)) {
+        free(b);
+        return NULL;
+    }
+    b->size = size;
+    b->cnt = 0;
+    b->rcnt = 0;
+    timeradd(&n->now, &bucket_refresh_timeout, &b->refresh_time);
+    b->refresh = NULL;
+    b->table = t;
+    b->index = i;
+    b->snap = NULL;
+    bucket_schedule(n, b);
+
+    return b;
+}
+
+// 释放桶
+static void bucket_free(struct dht_node *n, struct bucket *b)
+{
+    timer_del(n->timers, &b->timer);
+    bucket_dirty(b);
+    free(b);
+}
+
+/*
+ * Reset the routing tables to a single empty bucket each. Pending bucket
+ * refresh searches are detached from the buckets being freed.
+ */
+// 清空桶
+static void clear_buckets(struct dht_node *n)
+{
+    size_t i, k;
+
+    for (k = 0; k < 2; k++) {
+        struct routing_table *t = &n->tables[k];
+        struct bucket *b = t->buckets[0];
+
+        for (i = 0; i < t->bucket_count; i++) {
+            if (t->buckets[i]->refresh)
+                t->buckets[i]->refresh->opaque = NULL;
+            if (i > 0)
+                bucket_free(n, t->buckets[i]);
+        }
+
+        b->cnt = 0;
+        b->rcnt = 0;
+        b->refresh = NULL;
+        timeradd(&n->now, &bucket_refresh_timeout, &b->refresh_time);
+        bucket_dirty(b);
+        bucket_schedule(n, b);
+        t->bucket_count = 1;
+    }
+}
+
 // 更新前缀
 static void update_prefix(struct dht_node *n, int notify)
 {
@@ -684,7 +1762,6 @@ static void update_prefix(struct dht_node *n, int notify)
     unsigned char new_id[20];
     size_t len;
     unsigned char current_ip[18];
-    struct bucket *b;
 
     /* Do not change node ID while we're still in the bootstrap process */
     if (n->bootstrap)
@@ -720,19 +1797,8 @@ static void update_prefix(struct dht_node *n, int notify)
     /* Start search to fill up new routing table */
     dht_node_search(n, new_id, FIND_NODE, bootstrap_done, NULL, &n->bootstrap);
 
-    /* Clear bucket list */
-    b = n->buckets;
-    while (b->next) {
-        struct bucket *next = b->next;
-
-        free(b);
-        b = next;
-    }
-    memset(b->first, 0x0, 20);
-    b->cnt = 0;
-    gettimeofday(&b->refresh_time, NULL);
-    timeradd(&b->refresh_time, &bucket_refresh_timeout, &b->refresh_time);
-    n->buckets = b;
+    /* Clear routing table */
+    clear_buckets(n);
 
     if (notify && n->bootstrap_cb)
         n->bootstrap_cb(0, n->bootstrap_priv);
@@ -765,6 +1831,7 @@ int dht_node_init(struct dht_node *n, const unsigned char *id,
 {
     struct bucket *b;
     struct timeval now;
+    size_t k;
 
     gettimeofday(&now, NULL);
 
@@ -772,26 +1839,44 @@ int dht_node_init(struct dht_node *n, const unsigned char *id,
         memcpy(n->id, id, 20);
     else
         gen_random_bytes(n->id, 20);
+    n->now = now;
     n->output = output;
+    n->output_batch = NULL;
+    n->outq = NULL;
+    n->contacts = NULL;
     n->opaque = opaque;
     n->tid = 0;
+    n->queries = NULL;
+    n->query_cap = 0;
+    n->query_count = 0;
+    n->search_cache = NULL;
+    n->search_cache_ttl = 0;
     n->searches.first = NULL;
     n->searches.tail = &n->searches.first;
     ip_counter_init(&n->ip_counter);
     gen_random_bytes(n->secret, sizeof(n->secret));
     n->peer_storage = NULL;
     n->put_storage = NULL;
+    n->routing_mode = DHT_ROUTING_NORMAL;
 
-    b = malloc(sizeof(struct bucket));
-    if (!b)
+    n->timers = malloc(sizeof(struct timer_heap));
+    if (!n->timers)
         return -1;
-    memset(b->first, 0x0, 20);
-    b->cnt = 0;
-    timeradd(&now, &bucket_refresh_timeout, &b->refresh_time);
-    b->next = NULL;
-    b->refresh = NULL;
+    timer_heap_init(n->timers);
+
+    for (k = 0; k < 2; k++) {
+        b = bucket_new(n, &n->tables[k], 0);
+        if (!b) {
+            if (k)
+                bucket_free(n, n->tables[0].buckets[0]);
+            timer_heap_free(n->timers);
+            free(n->timers);
+            return -1;
+        }
 
-    n->buckets = b;
+        n->tables[k].buckets[0] = b;
+        n->tables[k].bucket_count = 1;
+    }
     n->bootstrap = NULL;
     n->bootstrap_cb = NULL;
     n->bootstrap_priv = NULL;
@@ -814,8 +1899,8 @@ int dht_node_start(struct dht_node *n)
 {
     TRACE(("Starting node %s\n", hex(n->id)));
 
-    /* Routing table is empty, ping bootstrap nodes */
-    if (n->buckets->next == NULL && n->buckets->cnt == 0) {
+    /* Routing tables are empty, ping bootstrap nodes */
+    if (table_empty(&n->tables[0]) && table_empty(&n->tables[1])) {
         struct addrinfo hints;
         size_t i;
         memset(&hints, 0, sizeof(hints));
@@ -863,87 +1948,202 @@ int dht_node_start(struct dht_node *n)
     return 0;
 }
 
-// 获得桶
-static struct bucket *get_bucket(struct dht_node *n, const unsigned char *id)
+/*
+ * Bucket entries are kept sorted by ID. Returns whether the ID is in the
+ * bucket, and sets *pos to its index or to the index it should be inserted
+ * at.
+ */
+// 在桶中查找
+static int bucket_find(const struct bucket *b, const unsigned char *id,
+                       size_t *pos)
 {
-    struct bucket *b = n->buckets;
+    size_t lo = 0, hi = b->cnt;
 
-    while (b->next && memcmp(id, b->next->first, 20) >= 0)
-        b = b->next;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(id, b->nodes[mid].id, 20);
 
-    return b;
+        if (!cmp) {
+            *pos = mid;
+            return 1;
+        }
+        if (cmp > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *pos = lo;
+
+    return 0;
 }
 
 // 获得桶的条目
-static struct bucket_entry *get_bucket_entry(struct dht_node *n,
+static struct bucket_entry *get_bucket_entry(struct dht_node *n, int family,
+                                             const unsigned char *id,
+                                             struct bucket **bucket)
+{
+    struct routing_table *t = node_table(n, family);
+    struct bucket *b;
+    size_t i;
+
+    if (!t)
+        return NULL;
+
+    b = t->buckets[bucket_index(n, t, id)];
+    if (!bucket_find(b, id, &i))
+        return NULL;
+    if (bucket)
+        *bucket = b;
+
+    return &b->nodes[i];
+}
+
+// 插入桶的条目
+static void bucket_insert(struct bucket *b, size_t pos,
+                          const struct bucket_entry *e)
+{
+    size_t i;
+
+    for (i = b->cnt; i > pos; i--)
+        b->nodes[i] = b->nodes[i - 1];
+    b->nodes[pos] = *e;
+    b->cnt++;
+}
+
+/* Smoothed round-trip time, as for TCP (RFC 6298, alpha = 1/8) */
+// 更新往返时间
+static void update_rtt(unsigned int *rtt, const struct timeval *sent,
+                       const struct timeval *now)
+{
+    struct timeval d;
+    unsigned int sample;
+
+    if (timercmp(now, sent, <))
+        return;
+
+    timersub(now, sent, &d);
+    if (d.tv_sec >= search_query_timeout.tv_sec)
+        return;
+
+    sample = d.tv_sec * 1000 + d.tv_usec / 1000;
+    if (!sample)
+        sample = 1; /* 0 stands for unknown */
+
+    *rtt = *rtt ? (7 * *rtt + sample) / 8 : sample;
+}
+
+/*
+ * The replacement cache of a bucket holds nodes that were seen while the
+ * bucket was full, ordered from least to most recently seen.
+ */
+// 加入替换缓存
+static void replacement_add(struct bucket *b, const struct bucket_entry *e)
+{
+    size_t i;
+
+    for (i = 0; i < b->rcnt; i++) {
+        if (!memcmp(b->replacements[i].id, e->id, 20))
+            break;
+    }
+
+    if (i == b->rcnt) {
+        if (b->rcnt == REPLACEMENT_MAX)
+            i = 0; /* Drop the least recently seen candidate */
+        else
+            b->rcnt++;
+    }
+
+    for (; i < b->rcnt - 1; i++)
+        b->replacements[i] = b->replacements[i + 1];
+    b->replacements[b->rcnt - 1] = *e;
+}
+
+// 移出替换缓存
+static void replacement_remove(struct bucket *b, const unsigned char *id)
+{
+    size_t i;
+
+    for (i = 0; i < b->rcnt; i++) {
+        if (!memcmp(b->replacements[i].id, id, 20)) {
+            for (; i < b->rcnt - 1; i++)
+                b->replacements[i] = b->replacements[i + 1];
+            b->rcnt--;
+            return;
+        }
+    }
+}
+
+// 查找替换节点
+static struct bucket_entry *replacement_find(struct bucket *b,
                                              const unsigned char *id)
 {
-    struct bucket *b = get_bucket(n, id);
     size_t i;
 
-    for (i = 0; i < b->cnt; i++) {
-        if (!memcmp(b->nodes[i].id, id, 20))
-            return &b->nodes[i];
+    for (i = 0; i < b->rcnt; i++) {
+        if (!memcmp(b->replacements[i].id, id, 20))
+            return &b->replacements[i];
     }
 
     return NULL;
 }
 
-// 低比特位
-static int lowbit(const unsigned char *id)
+// 提升替换节点
+static void replacement_promote(struct bucket *b)
 {
-    int i, j;
-    for(i = 19; i >= 0; i--)
-        if(id[i] != 0)
-            break;
+    size_t pos;
 
-    if(i < 0)
-        return -1;
+    /* Most recently seen candidates first */
+    while (b->rcnt > 0 && b->cnt < b->size) {
+        const struct bucket_entry *e = &b->replacements[--b->rcnt];
 
-    for(j = 7; j >= 0; j--)
-        if((id[i] & (0x80 >> j)) != 0)
-            break;
+        if (bucket_find(b, e->id, &pos))
+            continue;
 
-    return 8 * i + j;
+        TRACE(("promoting replacement node %s\n", hex(e->id)));
+        bucket_insert(b, pos, e);
+    }
 }
 
-// 桶中间
-static int bucket_middle(struct bucket *b, unsigned char *id)
+// 随机的桶
+static void bucket_random(const struct dht_node *n,
+                          const struct routing_table *t, size_t i,
+                          unsigned char *id)
 {
-    int bit1 = lowbit(b->first);
-    int bit2 = b->next ? lowbit(b->next->first) : -1;
-    int bit = ((bit1 > bit2) ? bit1 : bit2) + 1;
-
-    if(bit >= 160)
-        return -1;
+    size_t byte = i / 8;
+    unsigned char before = 0xFF00 >> (i % 8);
+    unsigned char bit = 0x80 >> (i % 8);
 
-    memcpy(id, b->first, 20);
-    id[bit / 8] |= (0x80 >> (bit % 8));
+    /* Keep the first i bits of our ID and randomize the rest */
+    gen_random_bytes(id, 20);
+    memcpy(id, n->id, byte);
+    id[byte] = (n->id[byte] & before) | (id[byte] & ~before);
 
-    return 0;
+    /* Differ on bit i, unless this is the last bucket */
+    if (i < t->bucket_count - 1)
+        id[byte] = (id[byte] & ~bit) | (~n->id[byte] & bit);
 }
 
-// 随机的桶
-static void bucket_random(struct bucket *b, unsigned char *id)
+// Ping端点
+static void ping_node(struct dht_node *n, const struct dht_endpoint *dest)
 {
-    int bit1 = lowbit(b->first);
-    int bit2 = b->next ? lowbit(b->next->first) : -1;
-    int bit = ((bit1 > bit2) ? bit1 : bit2) + 1;
-    int i;
-    unsigned char r[20];
+    unsigned char buf[128];
+    struct krpc_writer w;
 
-    gen_random_bytes(r, 20);
+    query_begin(&w, buf, sizeof(buf));
+    write_id(n, &w);
+    send_query(n, &w, "ping", next_tid(n), dest);
+}
 
-    if(bit >= 160) {
-        memcpy(id, b->first, 20);
-        return;
-    }
+// 移除桶的条目
+static void bucket_remove(struct bucket *b, size_t pos)
+{
+    size_t i;
 
-    memcpy(id, b->first, bit / 8);
-    id[bit / 8] = b->first[bit / 8] & (0xFF00 >> (bit % 8));
-    id[bit / 8] |= r[bit / 8] & 0xFF >> (bit % 8);
-    for(i = bit / 8 + 1; i < 20; i++)
-        id[i] = r[i];
+    for (i = pos; i < b->cnt - 1; i++)
+        b->nodes[i] = b->nodes[i + 1];
+    b->cnt--;
+    replacement_promote(b);
+    bucket_dirty(b);
 }
 
 // 桶的垃圾回收
@@ -958,16 +2158,14 @@ static void bucket_gc(struct dht_node *n, struct bucket *b,
      * ping the least recently seen questionable node (if any)
      */
 
-    if (b->cnt < BUCKET_ENTRY_MAX)
+    if (b->cnt < b->size)
         return;
 
     for (i = 0; i < b->cnt; i++) {
         if (b->nodes[i].pinged >= 2 &&
             timercmp(&b->nodes[i].next_ping, now, <=)) {
             TRACE(("removing bad node %s\n", hex(b->nodes[i].id)));
-            for (; i < b->cnt - 1; i++)
-              b->nodes[i] = b->nodes[i + 1];
-            b->cnt = i;
+            bucket_remove(b, i);
             return;
         }
 
@@ -978,152 +2176,160 @@ static void bucket_gc(struct dht_node *n, struct bucket *b,
     if (timercmp(&oldest->next_ping, now, <=)) {
         TRACE(("pinging old node %s (count=%d)\n", hex(oldest->id),
                oldest->pinged));
-        dht_node_ping(n, (struct sockaddr *)&oldest->addr, oldest->addrlen);
+        ping_node(n, &oldest->addr);
         oldest->pinged++;
         timeradd(now, &ping_timeout, &oldest->next_ping);
+        bucket_dirty(b);
     }
 }
 
-// 添加节点
-static void add_node(struct dht_node *n, const unsigned char *id,
-                     const struct sockaddr *src, socklen_t addrlen)
+// 分裂最后的桶
+static int split_last_bucket(struct dht_node *n, struct routing_table *t)
 {
-    struct bucket *b = get_bucket(n, id);
-    size_t i;
-    struct timeval now;
+    size_t last = t->bucket_count - 1;
+    struct bucket *b = t->buckets[last];
+    struct bucket *new;
+    size_t i, cnt = 0;
 
-    gettimeofday(&now, NULL);
+    if (t->bucket_count == sizeof(t->buckets) / sizeof(t->buckets[0]))
+        return -1;
+
+    new = bucket_new(n, t, last + 1);
+    if (!new)
+        return -1;
+    new->refresh_time = b->refresh_time;
+
+    /* Move the replacement candidates sharing more than `last` bits */
+    for (i = 0; i < b->rcnt; i++) {
+        if (common_prefix_len(n->id, b->replacements[i].id) <= last)
+            b->replacements[cnt++] = b->replacements[i];
+        else
+            replacement_add(new, &b->replacements[i]);
+    }
+    b->rcnt = cnt;
+
+    /*
+     * Move the nodes sharing more than `last` bits to the new bucket. In
+     * wide mode the new bucket may be smaller than the one being split,
+     * the nodes that do not fit become replacement candidates.
+     */
+    cnt = 0;
+    for (i = 0; i < b->cnt; i++) {
+        if (common_prefix_len(n->id, b->nodes[i].id) <= last)
+            b->nodes[cnt++] = b->nodes[i];
+        else if (new->cnt < new->size)
+            new->nodes[new->cnt++] = b->nodes[i];
+        else
+            replacement_add(new, &b->nodes[i]);
+    }
+    b->cnt = cnt;
+
+    /* Fill the room left in both buckets */
+    replacement_promote(b);
+    replacement_promote(new);
+    bucket_dirty(b);
+    bucket_schedule(n, b);
+    bucket_schedule(n, new);
+
+    t->buckets[t->bucket_count++] = new;
+
+    return 0;
+}
+
+// 插入节点
+static void insert_node(struct dht_node *n, const unsigned char *id,
+                        const struct dht_endpoint *addr,
+                        const struct timeval *last_seen)
+{
+    struct routing_table *t = node_table(n, addr->family);
+    size_t idx;
+    struct bucket *b;
+    struct bucket_entry e;
+    size_t i;
 
-    if (!memcmp(n->id, id, 20))
+    if (!t || !memcmp(n->id, id, 20))
         return; /* Trying to add ourselves in the routing table */
 
-    i = 0;
-    while (i < b->cnt && memcmp(id, b->nodes[i].id, 20) > 0)
-        i++;
+    idx = bucket_index(n, t, id);
+    b = t->buckets[idx];
 
-    if (i < b->cnt && !memcmp(id, b->nodes[i].id, 20)) {
+    if (bucket_find(b, id, &i)) {
         /* Already in bucket */
 
         b->nodes[i].pinged = 0;
-        b->nodes[i].last_seen = now;
-        timeradd(&now, &bucket_node_timeout, &b->nodes[i].next_ping);
-        memcpy(&b->nodes[i].addr, src, addrlen);
-        b->nodes[i].addrlen = addrlen;
-        timeradd(&now, &bucket_refresh_timeout, &b->refresh_time);
+        b->nodes[i].last_seen = *last_seen;
+        timeradd(last_seen, &bucket_node_timeout, &b->nodes[i].next_ping);
+        b->nodes[i].addr = *addr;
+        timeradd(&n->now, &bucket_refresh_timeout, &b->refresh_time);
+        bucket_dirty(b);
+        bucket_schedule(n, b);
         return;
     }
 
-    if (b->cnt < BUCKET_ENTRY_MAX) {
-        size_t j;
+    memcpy(e.id, id, 20);
+    e.addr = *addr;
+    e.last_seen = *last_seen;
+    timeradd(last_seen, &bucket_node_timeout, &e.next_ping);
+    e.pinged = 0;
+    e.rtt = 0;
 
+    if (b->cnt < b->size) {
         TRACE(("Adding node %s\n", hex(id)));
 
-        i = 0;
-        while (i < b->cnt && memcmp(id, b->nodes[i].id, 20) > 0)
-            i++;
-        for (j = b->cnt; j > i; j--)
-            b->nodes[j] = b->nodes[j - 1];
-        memcpy(b->nodes[i].id, id, 20);
-        memcpy(&b->nodes[i].addr, src, addrlen);
-        b->nodes[i].addrlen = addrlen;
-        b->nodes[i].last_seen = now;
-        timeradd(&now, &bucket_node_timeout, &b->nodes[i].next_ping);
-        b->nodes[i].pinged = 0;
-        timeradd(&now, &bucket_refresh_timeout, &b->refresh_time);
-        b->cnt++;
-    } else if (memcmp(n->id, b->first, 20) >= 0 &&
-               (!b->next || memcmp(n->id, b->next->first, 20) < 0)) {
-        /* Split */
-        struct bucket *new = malloc(sizeof(struct bucket));
-
-        if (!new || bucket_middle(b, new->first))
-            return;
-        new->next = b->next;
-        new->cnt = 0;
-        new->refresh = NULL;
-        new->refresh_time = b->refresh_time;
-
-        b->next = new;
-
-        i = 0;
-        while (i < BUCKET_ENTRY_MAX &&
-               memcmp(b->nodes[i].id, new->first, 20) < 0)
-            i++;
-        b->cnt = i;
-        while (i < BUCKET_ENTRY_MAX)
-            new->nodes[new->cnt++] = b->nodes[i++];
-
-        add_node(n, id, src, addrlen);
+        replacement_remove(b, id);
+        bucket_insert(b, i, &e);
+        timeradd(&n->now, &bucket_refresh_timeout, &b->refresh_time);
+        bucket_dirty(b);
+        bucket_schedule(n, b);
+    } else if (idx == t->bucket_count - 1 && !split_last_bucket(n, t)) {
+        /* The last bucket covered our own ID and was split */
+        insert_node(n, id, addr, last_seen);
+    } else {
+        /* Keep it around until a node of the bucket goes bad */
+        replacement_add(b, &e);
     }
 }
 
-// 获得搜索
-static struct search *get_search(struct dht_node *n, uint16_t tid)
+// 添加节点
+static void add_node(struct dht_node *n, const unsigned char *id,
+                     const struct sockaddr *src, socklen_t addrlen)
 {
-    struct search *s = n->searches.first;
-
-    while (s) {
-        if (s->tid == tid)
-           return s;
-        s = s->next;
-    }
+    struct dht_endpoint ep;
 
-    return NULL;
+    if (!endpoint_from_sockaddr(&ep, src, addrlen))
+        insert_node(n, id, &ep, &n->now);
 }
 
 // 添加已完成的节点IPv4
-static void add_compact_nodes(struct search *s, const unsigned char *nodes,
-                              size_t nodes_len)
+static void add_compact_nodes(struct dht_node *n, struct search *s,
+                              const unsigned char *nodes, size_t nodes_len)
 {
     const unsigned char *end = nodes + nodes_len;
 
     while (nodes + 26 <= end) {
-        struct sockaddr_in sin;
+        struct dht_endpoint ep;
 
-        sin.sin_family = AF_INET;
-        memcpy(&sin.sin_addr, nodes + 20, 4);
-        memcpy(&sin.sin_port, nodes + 24, 2);
-
-        add_search_node(s, nodes, (struct sockaddr *)&sin, sizeof(sin));
+        endpoint_from_compact(&ep, nodes + 20, 6);
+        add_search_node(n, s, nodes, &ep, 0);
         nodes += 26;
     }
 }
 
 // 添加已完成的节点IPv6
-static void add_compact_nodes6(struct search *s, const unsigned char *nodes6,
-                               size_t nodes6_len)
+static void add_compact_nodes6(struct dht_node *n, struct search *s,
+                               const unsigned char *nodes6, size_t nodes6_len)
 {
     const unsigned char *end = nodes6 + nodes6_len;
 
     while (nodes6 + 38 <= end) {
-        struct sockaddr_in6 sin6;
-
-        memset(&sin6, 0, sizeof(sin6));
-        sin6.sin6_family = AF_INET6;
-        memcpy(&sin6.sin6_addr, nodes6 + 20, 16);
-        memcpy(&sin6.sin6_port, nodes6 + 36, 2);
+        struct dht_endpoint ep;
 
-        add_search_node(s, nodes6, (struct sockaddr *)&sin6, sizeof(sin6));
+        endpoint_from_compact(&ep, nodes6 + 20, 18);
+        add_search_node(n, s, nodes6, &ep, 0);
         nodes6 += 38;
     }
 }
 
-// 获得搜索节点
-static struct search_node *get_search_node(struct search *s,
-                                           const unsigned char *id)
-
-{
-    struct search_node *sn = s->queue;
-
-    while (sn) {
-        if (!memcmp(sn->id, id, 20))
-            return sn;
-        sn = sn->next;
-    }
-
-    return NULL;
-}
-
 // 设置搜索节点的token
 static void search_node_set_token(struct search_node *sn,
                                   const unsigned char *token,
@@ -1139,257 +2345,248 @@ static void search_node_set_token(struct search_node *sn,
 
 // 设置搜索节点的值
 static void search_node_set_values(struct search_node *sn,
-                                   const struct bvalue *list)
+                                   const struct krpc_value *list)
 {
-    size_t i;
-    socklen_t dummy;
+    struct krpc_value v;
+    size_t pos = 0;
+    size_t cnt = 0;
 
-    if (list->type != BVALUE_LIST)
+    if (list->type != 'l')
         return;
 
-    sn->peers = malloc(list->l.len * sizeof(struct sockaddr_storage));
+    while (krpc_list_next(list, &pos, &v) > 0)
+        cnt++;
+
+    sn->peers = malloc(cnt * sizeof(struct dht_endpoint));
     if (!sn->peers)
         return;
     sn->peer_count = 0;
 
-    for (i = 0; i < list->l.len; i++) {
-        if (compact_to_sockaddr(list->l.array[i],
-                                (struct sockaddr *)&sn->peers[sn->peer_count],
-                                &dummy))
+    pos = 0;
+    while (krpc_list_next(list, &pos, &v) > 0) {
+        if (v.type != 's' ||
+            endpoint_from_compact(&sn->peers[sn->peer_count], v.s, v.len))
             continue;
         sn->peer_count++;
     }
 }
 
 // 设置搜索节点的v值
-static void search_node_set_v(struct search_node *sn, const struct bvalue *v)
+static void search_node_set_v(struct search_node *sn,
+                              const struct krpc_value *v)
 {
-    unsigned char flattened[1000];
-    int rc;
-
-    rc = bencode_buf(v, flattened, sizeof(flattened));
-    if (rc < 0)
+    if (v->raw_len > 1000)
         return;
 
     /* Make copy of v */
-    sn->v = bdecode_buf(flattened, rc);
+    sn->v = bdecode_buf_limits(v->raw, v->raw_len, &value_limits);
+}
+
+// 获得消息的事务ID
+static int msg_get_tid(const struct krpc_msg *msg, uint16_t *tid)
+{
+    if (msg->t.type != 's' || msg->t.len != sizeof(*tid))
+        return -1;
+
+    memcpy(tid, msg->t.s, sizeof(*tid));
+
+    return 0;
 }
 
 // 响应处理
-static void handle_response(struct dht_node *n, struct bvalue *dict,
+static void handle_response(struct dht_node *n, const struct krpc_msg *msg,
                             const struct sockaddr *src, socklen_t addrlen)
 {
-    const struct bvalue *v, *r;
-    const void *p;
+    const struct krpc_args *r = &msg->args;
     size_t l;
     uint16_t tid;
     const unsigned char *id;
-    struct search *s;
+    struct pending_query *q;
+    struct bucket_entry *e;
+    struct bucket *b;
 
-    v = bvalue_dict_get(dict, "t");
-    if (!v) {
+    if (!msg->t.type) {
         TRACE(("'t' key missing\n"));
         return;
     }
-    p = bvalue_string(v, &l);
-    if (!p || l != sizeof(tid)) {
+    if (msg_get_tid(msg, &tid)) {
         TRACE(("invalid 't' key\n"));
         return;
     }
-    tid = *(uint16_t *)p;
 
-    r = bvalue_dict_get(dict, "r");
-    if (!r) {
+    if (msg->r.type != 'd') {
         TRACE(("'r' key missing\n"));
         return;
     }
 
-    if ((v = bvalue_dict_get(dict, "ip")) &&
-        (p = bvalue_string(v, &l)) &&
-        ip_counter_update(&n->ip_counter, p, l) > 0)
+    if (msg->ip.type == 's' &&
+        ip_counter_update(&n->ip_counter, msg->ip.s, msg->ip.len,
+                          &n->now) > 0)
         update_prefix(n, 1);
 
-    v = bvalue_dict_get(r, "id");
-    if (!v) {
+    if (!r->id.type) {
         TRACE(("'r.id' key missing\n"));
         return;
     }
-    id = (unsigned char *)bvalue_string(v, &l);
+    id = krpc_string(&r->id, &l);
     if (!id || l != 20) {
         TRACE(("invalid 'r.id' key\n"));
         return;
     }
 
     add_node(n, id, src, addrlen);
-    s = get_search(n, tid);
-    if (s) {
-        const unsigned char *nodes = NULL;
-        const unsigned char *nodes6 = NULL;
-        size_t nodes_len = 0;
-        size_t nodes6_len = 0;
-        struct search_node *sn;
+    q = query_find(n, tid);
+    if (q) {
+        struct search *s = q->search;
+        struct search_node *sn = q->sn;
+        const unsigned char *p;
 
-        if (is_prefix_valid(id, src, addrlen) &&
-            (sn = get_search_node(s, id))) {
-            const unsigned char *s;
-            size_t l;
+        /*
+         * A search query may reuse the ID of a ping, announce or put still
+         * in flight, and anyone can echo an ID: only take the nodes and
+         * values of the node that was asked.
+         */
+        if (!memcmp(sn->id, id, 20) && is_prefix_valid(id, src, addrlen)) {
+            if ((p = krpc_string(&r->token, &l)) && !sn->token)
+                search_node_set_token(sn, p, l);
 
-            if ((v = bvalue_dict_get(r, "token")) &&
-                (s = bvalue_string(v, &l)) &&
-                !sn->token)
-                search_node_set_token(sn, s, l);
+            if (r->values.type && !sn->peers)
+                search_node_set_values(sn, &r->values);
 
-            if ((v = bvalue_dict_get(r, "values")) && !sn->peers)
-                search_node_set_values(sn, v);
+            if (r->v.type && !sn->v)
+                search_node_set_v(sn, &r->v);
 
-            if ((v = bvalue_dict_get(r, "v")) && !sn->v)
-                search_node_set_v(sn, v);
+            if (r->seq.type)
+                krpc_integer(&r->seq, &sn->seq);
 
-            if ((v = bvalue_dict_get(r, "seq")))
-                bvalue_integer(v, &sn->seq);
+            if ((p = krpc_string(&r->k, &l)) && l == 32)
+                memcpy(sn->k, p, 32);
 
-            if ((v = bvalue_dict_get(r, "k")) &&
-                (s = bvalue_string(v, &l)) && l == 32)
-                memcpy(sn->k, s, 32);
+            if ((p = krpc_string(&r->sig, &l)) && l == 64)
+                memcpy(sn->sig, p, 64);
 
-            if ((v = bvalue_dict_get(r, "sig")) &&
-                (s = bvalue_string(v, &l)) && l == 64)
-                memcpy(sn->sig, s, 64);
+            sn->reply_time = n->now;
 
-            gettimeofday(&sn->reply_time, NULL);
-        }
+            /* Each query has its own ID, the sample is never ambiguous */
+            update_rtt(&sn->rtt, &q->sent, &n->now);
+            update_rtt(&s->rtt, &q->sent, &n->now);
+            if ((e = get_bucket_entry(n, sn->addr.family, id, &b))) {
+                update_rtt(&e->rtt, &q->sent, &n->now);
+                bucket_dirty(b);
+            }
+            query_remove(n, q);
 
-        if ((v = bvalue_dict_get(r, "nodes")) &&
-            (nodes = (unsigned char *)bvalue_string(v, &nodes_len)))
-            add_compact_nodes(s, nodes, nodes_len);
+            if ((p = krpc_string(&r->nodes, &l)))
+                add_compact_nodes(n, s, p, l);
 
-        if ((v = bvalue_dict_get(r, "nodes6")) &&
-            (nodes6 = (unsigned char *)bvalue_string(v, &nodes6_len)))
-            add_compact_nodes6(s, nodes6, nodes6_len);
+            if ((p = krpc_string(&r->nodes6, &l)))
+                add_compact_nodes6(n, s, p, l);
+
+            /* Use the free query slot right away */
+            search_progress(n, s, &n->now);
+        }
     }
 }
 
 // 错误处理
-static void handle_error(struct dht_node *n, struct bvalue *dict,
+static void handle_error(struct dht_node *n, const struct krpc_msg *msg,
                          const struct sockaddr *src, socklen_t addrlen)
 {
-    const struct bvalue *v, *e;
+    struct krpc_value v;
+    size_t pos = 0;
     int code;
-    const char *msg;
-    size_t l;
-    uint16_t *tid;
-    struct search *s;
-    const void *p;
+    const unsigned char *text;
+    size_t text_len;
+    uint16_t tid;
+    struct pending_query *q;
+    struct dht_endpoint ep;
 
-    e = bvalue_dict_get(dict, "e");
-    if (!e) {
+    if (!msg->e.type) {
         TRACE(("'e' key missing\n"));
         return;
     }
 
-    if (!(v = bvalue_list_get(e, 0)) || bvalue_integer(v, &code) ||
-        !(v = bvalue_list_get(e, 1)) ||
-        !(msg = (char *)bvalue_string(v, NULL))) {
+    if (krpc_list_next(&msg->e, &pos, &v) <= 0 || krpc_integer(&v, &code) ||
+        krpc_list_next(&msg->e, &pos, &v) <= 0 ||
+        !(text = krpc_string(&v, &text_len))) {
         TRACE(("Malformed error message\n"));
         return;
     }
 
-    if ((v = bvalue_dict_get(dict, "ip")) &&
-        (p = bvalue_string(v, &l)) &&
-        ip_counter_update(&n->ip_counter, p, l) > 0)
+    if (msg->ip.type == 's' &&
+        ip_counter_update(&n->ip_counter, msg->ip.s, msg->ip.len,
+                          &n->now) > 0)
         update_prefix(n, 1);
 
-    TRACE(("Error from %s: %d %s\n", sockaddr_fmt(src, addrlen), code, msg));
-
-    if ((v = bvalue_dict_get(dict, "t")) &&
-        (tid = (uint16_t *)bvalue_string(v, &l)) &&
-        l == sizeof(*tid) &&
-        (s = get_search(n, *tid))) {
-        struct search_node *sn = s->queue;
-
-        /* Get search node by address and mark it as errored */
-        while (sn) {
-            if (sn->addrlen == addrlen &&
-                !sockaddr_cmp((struct sockaddr *)&sn->addr, src)) {
-                TRACE(("Marking node %s from pending search as errored\n",
-                       hex(sn->id)));
-                timerclear(&sn->reply_time);
-                if (sn->token) {
-                    /* Make sure node doesn't get used for storage */
-                    free(sn->token);
-                    sn->token = NULL;
-                }
-                sn->error = code;
-                break;
-            }
-            sn = sn->next;
+    TRACE(("Error from %s: %d %.*s\n", sockaddr_fmt(src, addrlen), code,
+           (int)text_len, text));
+
+    if (!msg_get_tid(msg, &tid) && (q = query_find(n, tid)) &&
+        !endpoint_from_sockaddr(&ep, src, addrlen) &&
+        !memcmp(&q->sn->addr, &ep, sizeof(ep))) {
+        struct search *s = q->search;
+        struct search_node *sn = q->sn;
+
+        TRACE(("Marking node %s from pending search as errored\n",
+               hex(sn->id)));
+        timerclear(&sn->reply_time);
+        if (sn->token) {
+            /* Make sure node doesn't get used for storage */
+            free(sn->token);
+            sn->token = NULL;
         }
+        sn->error = code;
+        query_remove(n, q);
+        search_progress(n, s, &n->now);
     }
 }
 
 #define WANT_N4 0x1
 #define WANT_N6 0x2
 
-// 字典设置节点
-static int dict_set_nodes(struct dht_node *n, const unsigned char *id,
-                          struct bvalue *ret, int want)
+// 写入路由表中最近的节点
+static void write_closest(struct dht_node *n, struct krpc_writer *w,
+                          const char *key, const struct routing_table *t,
+                          const unsigned char *id)
 {
     struct bucket_entry closest[8];
+    unsigned char nodes[38 * 8];
+    size_t len = 0;
     int i, cnt;
-    unsigned char nodes[26 * 8];
-    unsigned char nodes6[38 * 8];
-    size_t nodes_len;
-    size_t nodes6_len;
-    struct bvalue *v;
-
-    cnt = get_closest(n, id, closest, 8);
-    if (cnt < 0)
-        return -1;
 
-    nodes_len = 0;
-    nodes6_len = 0;
+    cnt = get_closest(n, t, id, closest, 8);
     for (i = 0; i < cnt; i++) {
-        switch (closest[i].addr.ss_family) {
-        case AF_INET:
-            memcpy(&nodes[nodes_len], closest[i].id, 20);
-            memcpy(&nodes[nodes_len + 20],
-                   &((struct sockaddr_in *)&closest[i].addr)->sin_addr, 4);
-            memcpy(&nodes[nodes_len + 24],
-                   &((struct sockaddr_in *)&closest[i].addr)->sin_port, 2);
-            nodes_len += 26;
-            break;
-        case AF_INET6:
-            memcpy(&nodes6[nodes6_len], closest[i].id, 20);
-            memcpy(&nodes6[nodes6_len + 20],
-                   &((struct sockaddr_in6 *)&closest[i].addr)->sin6_addr, 16);
-            memcpy(&nodes6[nodes6_len + 36],
-                   &((struct sockaddr_in6 *)&closest[i].addr)->sin6_port, 2);
-            nodes6_len += 38;
-            break;
-        default:
-            continue;
-        }
+        memcpy(&nodes[len], closest[i].id, 20);
+        len += 20;
+        len += endpoint_to_compact(&closest[i].addr, &nodes[len]);
     }
 
-    if (want & WANT_N4) {
-        v = bvalue_new_string(nodes, nodes_len);
-        bvalue_dict_set(ret, "nodes", v);
-    }
-    if (want & WANT_N6) {
-        v = bvalue_new_string(nodes6, nodes6_len);
-        bvalue_dict_set(ret, "nodes6", v);
-    }
+    krpc_write_key(w, key);
+    krpc_write_string(w, nodes, len);
+}
+
+/*
+ * Each family has its own routing table, so both lists hold the 8 closest
+ * nodes of their family.
+ */
+// 写入节点
+static int write_nodes(struct dht_node *n, struct krpc_writer *w,
+                       const unsigned char *id, int want)
+{
+    if (want & WANT_N4)
+        write_closest(n, w, "nodes", &n->tables[0], id);
+    if (want & WANT_N6)
+        write_closest(n, w, "nodes6", &n->tables[1], id);
 
     return 0;
 }
 
-// 字典设置对等端
-static int dict_set_peers(struct dht_node *n, const unsigned char *info_hash,
-                          struct bvalue *ret)
+// 写入对等端
+static int write_peers(struct dht_node *n, struct krpc_writer *w,
+                       const unsigned char *info_hash)
 {
     struct peer_list *pl = n->peer_storage;
     struct peer *p;
-    struct bvalue *values, *v;
 
     while (pl) {
         if (!memcmp(info_hash, pl->info_hash, 20))
@@ -1400,16 +2597,14 @@ static int dict_set_peers(struct dht_node *n, const unsigned char *info_hash,
     if (!pl)
         return -1;
 
-    values = bvalue_new_list();
+    krpc_write_key(w, "values");
+    krpc_write_char(w, 'l');
     p = pl->peers;
     while (p) {
-        v = bvalue_new_compact((struct sockaddr *)&p->addr, p->addrlen);
-        bvalue_list_append(values, v);
-
+        write_endpoint(w, &p->addr);
         p = p->next;
     }
-
-    bvalue_dict_set(ret, "values", values);
+    krpc_write_char(w, 'e');
 
     return 0;
 }
@@ -1453,11 +2648,10 @@ static int make_token_signature(const struct sockaddr *addr, socklen_t addrlen,
     return 0;
 }
 
-// 字典设置 Token
-static int dict_set_token(struct dht_node *n, const struct sockaddr *addr,
-                          socklen_t addrlen, struct bvalue *ret)
+// 写入 Token
+static int write_token(struct dht_node *n, struct krpc_writer *w,
+                       const struct sockaddr *addr, socklen_t addrlen)
 {
-    struct bvalue *v;
     unsigned char token[28];
     time_t t = time(NULL);
 
@@ -1466,8 +2660,8 @@ static int dict_set_token(struct dht_node *n, const struct sockaddr *addr,
         return -1;
     memcpy(token, &t, 8);
 
-    v = bvalue_new_string((unsigned char *)token, sizeof(token));
-    bvalue_dict_set(ret, "token", v);
+    krpc_write_key(w, "token");
+    krpc_write_string(w, token, sizeof(token));
 
     return 0;
 }
@@ -1508,70 +2702,74 @@ static int add_peer(struct dht_node *n, const unsigned char *info_hash,
     while (pl) {
         if (!memcmp(pl->info_hash, info_hash, 20))
             break;
+        pl = pl->next;
     }
 
     if (!pl) {
+        struct timeval expire;
+
         pl = malloc(sizeof(struct peer_list));
         if (!pl)
             return -1;
+        if (timer_add(n->timers, &pl->timer, TIMER_PEERS)) {
+            free(pl);
+            return -1;
+        }
         memcpy(pl->info_hash, info_hash, 20);
         pl->peers = NULL;
         pl->next = n->peer_storage;
+        if (pl->next)
+            pl->next->pprev = &pl->next;
+        pl->pprev = &n->peer_storage;
         n->peer_storage = pl;
+
+        /* Peers added later never expire before the first one */
+        timeradd(&n->now, &peer_timeout, &expire);
+        timer_set(n->timers, &pl->timer, &expire);
     }
 
     p = malloc(sizeof(struct peer));
     if (!p)
         return -1;
-    memcpy(&p->addr, addr, addrlen);
-    p->addrlen = addrlen;
+    if (endpoint_from_sockaddr(&p->addr, addr, addrlen)) {
+        free(p);
+        return -1;
+    }
     if (!implied_port) {
-        switch (p->addr.ss_family) {
-        case AF_INET:
-            ((struct sockaddr_in *)&p->addr)->sin_port = htons(port);
-            break;
-        case AF_INET6:
-            ((struct sockaddr_in6 *)&p->addr)->sin6_port = htons(port);
-            break;
-        default:
-            break;
-        }
+        p->addr.port[0] = (port >> 8) & 0xff;
+        p->addr.port[1] = port & 0xff;
     }
-    gettimeofday(&p->expire_time, NULL);
-    timeradd(&p->expire_time, &peer_timeout, &p->expire_time);
+    timeradd(&n->now, &peer_timeout, &p->expire_time);
     p->next = pl->peers;
     pl->peers = p;
 
     return 0;
 }
 
-static int args_get_want(const struct bvalue *args,
+static int args_get_want(const struct krpc_args *args,
                          const struct sockaddr *src, socklen_t addrlen)
 {
-    const struct bvalue *v;
-
     (void)addrlen;
 
-    if ((v = bvalue_dict_get(args, "want"))) {
-        size_t i;
+    if (args->want.type) {
+        struct krpc_value v;
+        size_t pos = 0;
         int ret = 0;
+        int rc;
 
-        if (v->type != BVALUE_LIST)
+        if (args->want.type != 'l')
             return -1;
 
-        for (i = 0; i < v->l.len; i++) {
-            if (v->l.array[i]->type != BVALUE_STRING)
-                return -1;
-
-            if (!strcmp((char *)v->l.array[i]->s.bytes, "n4"))
+        while ((rc = krpc_list_next(&args->want, &pos, &v)) > 0) {
+            if (krpc_string_eq(&v, "n4"))
                 ret |= WANT_N4;
-            else if (!strcmp((char *)v->l.array[i]->s.bytes, "n6"))
+            else if (krpc_string_eq(&v, "n6"))
                 ret |= WANT_N6;
             else
                 return -1;
         }
 
-        return ret;
+        return rc < 0 ? -1 : ret;
     }
 
     switch (src->sa_family) {
@@ -1589,17 +2787,16 @@ static int args_get_want(const struct bvalue *args,
 // 查找节点的处理
 static void handle_find_node(struct dht_node *n,
                              const unsigned char *tid, size_t tid_len,
-                             const struct bvalue *args,
+                             const struct krpc_args *args,
                              const struct sockaddr *src, socklen_t addrlen)
 {
     const unsigned char *target;
-    const struct bvalue *v;
-    struct bvalue *ret;
+    unsigned char buf[512];
+    struct krpc_writer w;
     size_t l;
     int want;
 
-    if (!(v = bvalue_dict_get(args, "target")) ||
-        !(target = (unsigned char *)bvalue_string(v, &l)) || l != 20) {
+    if (!(target = krpc_string(&args->target, &l)) || l != 20) {
         TRACE(("Invalid target\n"));
         send_error(n, tid, tid_len, 203, "Protocol Error", src, addrlen);
         return;
@@ -1610,25 +2807,24 @@ static void handle_find_node(struct dht_node *n,
         return;
     }
 
-    ret = bvalue_new_dict();
-    dict_set_nodes(n, target, ret, want);
-    send_response(n, tid, tid_len, ret, src, addrlen);
+    response_begin(n, &w, buf, sizeof(buf), src);
+    write_nodes(n, &w, target, want);
+    send_response(n, &w, tid, tid_len, src, addrlen);
 }
 
 // 获得对等端的处理
 static void handle_get_peers(struct dht_node *n,
                              const unsigned char *tid, size_t tid_len,
-                             const struct bvalue *args,
+                             const struct krpc_args *args,
                              const struct sockaddr *src, socklen_t addrlen)
 {
     const unsigned char *info_hash;
-    struct bvalue *ret;
-    const struct bvalue *v;
+    unsigned char buf[2048];
+    struct krpc_writer w;
     size_t l;
     int want;
 
-    if (!(v = bvalue_dict_get(args, "info_hash")) ||
-        !(info_hash = (unsigned char *)bvalue_string(v, &l)) || l != 20) {
+    if (!(info_hash = krpc_string(&args->info_hash, &l)) || l != 20) {
         TRACE(("Invalid info_hash\n"));
         send_error(n, tid, tid_len, 203, "Protocol Error", src, addrlen);
         return;
@@ -1639,89 +2835,69 @@ static void handle_get_peers(struct dht_node *n,
         return;
     }
 
-    ret = bvalue_new_dict();
-    dict_set_nodes(n, info_hash, ret, want);
-    dict_set_token(n, src, addrlen, ret);
-    dict_set_peers(n, info_hash, ret);
-    send_response(n, tid, tid_len, ret, src, addrlen);
+    response_begin(n, &w, buf, sizeof(buf), src);
+    write_nodes(n, &w, info_hash, want);
+    write_token(n, &w, src, addrlen);
+    write_peers(n, &w, info_hash);
+    send_response(n, &w, tid, tid_len, src, addrlen);
 }
 
 // 发布到对等端的处理
 static void handle_announce_peer(struct dht_node *n,
                                  const unsigned char *tid, size_t tid_len,
-                                 const struct bvalue *args,
+                                 const struct krpc_args *args,
                                  const struct sockaddr *src, socklen_t addrlen)
 {
     const unsigned char *info_hash;
     const unsigned char *token;
-    const struct bvalue *v;
     size_t l;
     int implied_port = 0;
     int port = 0;
 
-    if (!(v = bvalue_dict_get(args, "info_hash")) ||
-        !(info_hash = (unsigned char *)bvalue_string(v, &l)) || l != 20 ||
-        !(v = bvalue_dict_get(args, "token")) ||
-        !(token = (unsigned char *)bvalue_string(v, &l)) || l != 28 ||
+    if (!(info_hash = krpc_string(&args->info_hash, &l)) || l != 20 ||
+        !(token = krpc_string(&args->token, &l)) || l != 28 ||
         !is_token_valid(n, token, src, addrlen) ||
-        ((v = bvalue_dict_get(args, "implied_port")) &&
-         bvalue_integer(v, &implied_port)) ||
-        (!implied_port && (!(v = bvalue_dict_get(args, "port")) ||
-                           bvalue_integer(v, &port)))) {
+        (args->implied_port.type &&
+         krpc_integer(&args->implied_port, &implied_port)) ||
+        (!implied_port && krpc_integer(&args->port, &port))) {
         TRACE(("Invalid argument\n"));
         send_error(n, tid, tid_len, 203, "Protocol Error", src, addrlen);
         return;
     }
 
     add_peer(n, info_hash, port, implied_port, src, addrlen);
-    send_response(n, tid, tid_len, NULL, src, addrlen);
+    send_empty_response(n, tid, tid_len, src, addrlen);
 }
 
-// 字典设置放置项
-static int dict_set_put_item(struct dht_node *n, const unsigned char *hash,
-                             struct bvalue *ret)
+// 获得放置项
+static struct put_item *get_put_item(struct dht_node *n,
+                                     const unsigned char *hash)
 {
     struct put_item *item = n->put_storage;
 
     while (item) {
         if (!memcmp(hash, item->hash, 20))
-            break;
+            return item;
         item = item->next;
     }
 
-    if (!item)
-        return -1;
-
-    if (item->seq != -1) {
-        /* mutable item */
-        struct bvalue *v;
-
-        v = bvalue_new_string(item->k, 32);
-        bvalue_dict_set(ret, "k", v);
-        v = bvalue_new_integer(item->seq);
-        bvalue_dict_set(ret, "seq", v);
-        v = bvalue_new_string(item->sig, 64);
-        bvalue_dict_set(ret, "sig", v);
-    }
-    bvalue_dict_set(ret, "v", bvalue_copy(item->v));
-
-    return 0;
+    return NULL;
 }
 
 // 获取的处理
 static void handle_get(struct dht_node *n,
                        const unsigned char *tid, size_t tid_len,
-                       const struct bvalue *args,
+                       const struct krpc_args *args,
                        const struct sockaddr *src, socklen_t addrlen)
 {
     const unsigned char *target;
-    struct bvalue *ret;
-    const struct bvalue *v;
+    const struct put_item *item;
+    unsigned char buf[2048];
+    struct krpc_writer w;
     size_t l;
     int want;
 
-    if (!(v = bvalue_dict_get(args, "target")) ||
-        !(target = (unsigned char *)bvalue_string(v, &l)) || l != 20) {
+    if (!(target = krpc_string(&args->target, &l)) || l != 20) {
         TRACE(("Invalid target\n"));
         send_error(n, tid, tid_len, 203, "Protocol Error", src, addrlen);
         return;
@@ -1732,11 +2908,27 @@ static void handle_get(struct dht_node *n,
         return;
     }
 
-    ret = bvalue_new_dict();
-    dict_set_nodes(n, target, ret, want);
-    dict_set_token(n, src, addrlen, ret);
-    dict_set_put_item(n, target, ret);
-    send_response(n, tid, tid_len, ret, src, addrlen);
+    item = get_put_item(n, target);
+
+    /* Keys of mutable items are interleaved with the nodes and token */
+    response_begin(n, &w, buf, sizeof(buf), src);
+    if (item && item->seq != -1) {
+        krpc_write_key(&w, "k");
+        krpc_write_string(&w, item->k, 32);
+    }
+    write_nodes(n, &w, target, want);
+    if (item && item->seq != -1) {
+        krpc_write_key(&w, "seq");
+        krpc_write_integer(&w, item->seq);
+        krpc_write_key(&w, "sig");
+        krpc_write_string(&w, item->sig, 64);
+    }
+    write_token(n, &w, src, addrlen);
+    if (item) {
+        krpc_write_key(&w, "v");
+        krpc_write_bvalue(&w, item->v);
+    }
+    send_response(n, &w, tid, tid_len, src, addrlen);
 }
 
 // 添加放置项
@@ -1745,93 +2937,103 @@ static int add_put_item(struct dht_node *n,
                         int seq,
                         const unsigned char *k,
                         const unsigned char *sig,
-                        const struct bvalue *v)
+                        const unsigned char *v, size_t v_len)
 {
-    struct put_item *item = n->put_storage;
+    struct put_item *item = get_put_item(n, hash);
+    struct bvalue *val;
 
-    while (item) {
-        if (!memcmp(item->hash, hash, 20))
-            break;
-        item = item->next;
-    }
+    /* Do not mix up mutable and immutable items */
+    if (item && ((seq == -1 && item->seq >= 0) ||
+                 (seq >= 0 && item->seq == -1)))
+        return -1;
 
-    if (item) {
-        /* Do not mix up mutable and immutable items */
-        if ((seq == -1 && item->seq >= 0) ||
-            (seq >= 0 && item->seq == -1))
-            return -1;
+    val = bdecode_buf_limits(v, v_len, &value_limits);
+    if (!val)
+        return -1;
 
+    if (item) {
         bvalue_free(item->v);
     } else {
         item = malloc(sizeof(struct put_item));
-        if (!item)
+        if (!item) {
+            bvalue_free(val);
+            return -1;
+        }
+        if (timer_add(n->timers, &item->timer, TIMER_PUT)) {
+            bvalue_free(val);
+            free(item);
             return -1;
+        }
 
         memcpy(item->hash, hash, 20);
         item->next = n->put_storage;
+        if (item->next)
+            item->next->pprev = &item->next;
+        item->pprev = &n->put_storage;
         n->put_storage = item;
     }
 
-    item->v = bvalue_copy(v);
+    item->v = val;
     item->seq = seq;
-    if (seq > 0) {
+    if (seq >= 0) {
         memcpy(item->k, k, 32);
         memcpy(item->sig, sig, 64);
     }
 
-    gettimeofday(&item->expire_time, NULL);
-    timeradd(&item->expire_time, &put_timeout, &item->expire_time);
+    timeradd(&n->now, &put_timeout, &item->expire_time);
+    timer_set(n->timers, &item->timer, &item->expire_time);
 
     return 0;
 }
 
 // 验证值
-static int verify_value(const struct bvalue *val,
+static int verify_value(const unsigned char *val, size_t val_len,
                         const unsigned char *salt, size_t salt_len,
                         int seq,
                         const unsigned char k[32],
                         const unsigned char sig[64])
 {
-    struct bvalue *v, *dict = bvalue_new_dict();
     unsigned char buf[1024];
+    size_t len = 0;
     int rc;
 
+    /* Signed buffer is the bencoded dictionary without its delimiters */
     if (salt && salt_len) {
-        v = bvalue_new_string(salt, salt_len);
-        bvalue_dict_set(dict, "salt", v);
+        rc = snprintf((char *)buf, sizeof(buf), "4:salt%u:",
+                      (unsigned int)salt_len);
+        if (rc < 0 || salt_len > sizeof(buf) - rc)
+            return -1;
+        memcpy(buf + rc, salt, salt_len);
+        len = rc + salt_len;
     }
 
-    v = bvalue_new_integer(seq);
-    bvalue_dict_set(dict, "seq", v);
-
-    bvalue_dict_set(dict, "v", bvalue_copy(val));
-
-    rc = bencode_buf(dict, buf, sizeof(buf));
-    if (rc < 0) {
-        bvalue_free(dict);
+    rc = snprintf((char *)buf + len, sizeof(buf) - len, "3:seqi%de1:v", seq);
+    if (rc < 0 || (size_t)rc >= sizeof(buf) - len)
         return -1;
-    }
+    len += rc;
 
-    bvalue_free(dict);
+    if (val_len > sizeof(buf) - len)
+        return -1;
+    memcpy(buf + len, val, val_len);
+    len += val_len;
 
-    return ed25519_verify(sig, buf + 1, rc - 2, k);
+    return ed25519_verify(sig, buf, len, k);
 }
 
 // 放置的处理
 static void handle_put(struct dht_node *n,
                        const unsigned char *tid, size_t tid_len,
-                       const struct bvalue *args,
+                       const struct krpc_args *args,
                        const struct sockaddr *src, socklen_t addrlen)
 {
     const unsigned char *token;
-    const struct bvalue *v, *val;
+    const struct krpc_value *val = &args->v;
     size_t l;
     unsigned char hash[20];
     sha1_context h;
 
-    if (!(val = bvalue_dict_get(args, "v")) ||
-        !(v = bvalue_dict_get(args, "token")) ||
-        !(token = (unsigned char *)bvalue_string(v, &l)) || l != 28 ||
+    if (!val->type ||
+        !(token = krpc_string(&args->token, &l)) || l != 28 ||
         !is_token_valid(n, token, src, addrlen)) {
         TRACE(("Invalid argument\n"));
         send_error(n, tid, tid_len, 203, "Protocol Error", src, addrlen);
@@ -1840,22 +3042,21 @@ static void handle_put(struct dht_node *n,
 
     sha1_starts_ret(&h);
 
-    if ((v = bvalue_dict_get(args, "k"))) { /* mutable */
+    if (args->k.type) { /* mutable */
         const unsigned char *k;
         const unsigned char *salt = NULL;
+        size_t salt_len = 0;
         const unsigned char *sig;
         int seq;
         int cas = -1;
 
-        if (!(k = bvalue_string(v, &l)) || l != 32 ||
-            !(v = bvalue_dict_get(args, "seq")) || bvalue_integer(v, &seq) ||
-            seq < 0 ||
-            !(v = bvalue_dict_get(args, "sig")) ||
-            !(sig = bvalue_string(v, &l)) || l != 64 ||
-            ((v = bvalue_dict_get(args, "salt")) &&
-             !(salt = bvalue_string(v, &l))) ||
-            ((v = bvalue_dict_get(args, "cas")) &&
-             (bvalue_integer(v, &cas) || cas < 0))) {
+        if (!(k = krpc_string(&args->k, &l)) || l != 32 ||
+            krpc_integer(&args->seq, &seq) || seq < 0 ||
+            !(sig = krpc_string(&args->sig, &l)) || l != 64 ||
+            (args->salt.type &&
+             !(salt = krpc_string(&args->salt, &salt_len))) ||
+            (args->cas.type &&
+             (krpc_integer(&args->cas, &cas) || cas < 0))) {
             TRACE(("Invalid argument\n"));
             send_error(n, tid, tid_len, 203, "Protocol Error", src, addrlen);
             return;
@@ -1863,7 +3064,7 @@ static void handle_put(struct dht_node *n,
 
         sha1_update_ret(&h, k, 32);
         if (salt)
-            sha1_update_ret(&h, salt, l);
+            sha1_update_ret(&h, salt, salt_len);
         sha1_finish_ret(&h, hash);
 
         if (cas >= 0) {
@@ -1896,7 +3097,8 @@ static void handle_put(struct dht_node *n,
             }
         }
 
-        switch (verify_value(val, salt, l, seq, k, sig)) {
+        switch (verify_value(val->raw, val->raw_len, salt, salt_len, seq,
+                             k, sig)) {
         case -1:
             TRACE(("Value too large\n"));
             send_error(n, tid, tid_len, 205, "Value too large", src, addrlen);
@@ -1907,86 +3109,80 @@ static void handle_put(struct dht_node *n,
             return;
         }
 
-        add_put_item(n, hash, seq, k, sig, val);
+        add_put_item(n, hash, seq, k, sig, val->raw, val->raw_len);
     } else { /* immutable */
-        unsigned char buf[1000];
-        int rc;
-
-        rc = bencode_buf(val, buf, sizeof(buf));
-        if (rc < 0) {
-            /* Value too large */
+        if (val->raw_len > 1000) {
             TRACE(("Value too large\n"));
             send_error(n, tid, tid_len, 205, "Value too large", src, addrlen);
             return;
         }
 
-        sha1_update_ret(&h, buf, rc);
+        /* The target is the hash of the value exactly as it was encoded */
+        sha1_update_ret(&h, val->raw, val->raw_len);
         sha1_finish_ret(&h, hash);
 
-        add_put_item(n, hash, -1, NULL, NULL, val);
+        add_put_item(n, hash, -1, NULL, NULL, val->raw, val->raw_len);
     }
 
-    send_response(n, tid, tid_len, NULL, src, addrlen);
+    send_empty_response(n, tid, tid_len, src, addrlen);
 }
 
 // 查询的处理
-static void handle_query(struct dht_node *n, struct bvalue *dict,
+static void handle_query(struct dht_node *n, const struct krpc_msg *msg,
                          const struct sockaddr *src, socklen_t addrlen)
 {
-    const struct bvalue *v, *a;
-    const void *p;
+    const struct krpc_args *a = &msg->args;
     size_t l;
-    const unsigned char *tid = NULL;
+    const unsigned char *tid;
     size_t tid_len = 0;
     const unsigned char *id;
     struct bucket_entry *e;
-    const char *query;
-
-    if (!(v = bvalue_dict_get(dict, "t")) ||
-        !(tid = (unsigned char *)bvalue_string(v, &tid_len)) ||
-        !(v = bvalue_dict_get(dict, "q")) ||
-        !(query = (char *)bvalue_string(v, NULL)) ||
-        !(a = bvalue_dict_get(dict, "a")) ||
-        !(v = bvalue_dict_get(a, "id")) ||
-        !(id = (unsigned char *)bvalue_string(v, &l)) || l != 20) {
+    struct bucket *b;
+    const struct krpc_value *query = &msg->q;
+
+    if (!(tid = krpc_string(&msg->t, &tid_len)) ||
+        query->type != 's' ||
+        msg->a.type != 'd' ||
+        !(id = krpc_string(&a->id, &l)) || l != 20) {
         TRACE(("Malformed query\n"));
         send_error(n, tid, tid_len, 203, "Protocol Error", src, addrlen);
         return;
     }
 
-    if ((v = bvalue_dict_get(dict, "ip")) &&
-        (p = bvalue_string(v, &l)) &&
-        ip_counter_update(&n->ip_counter, p, l) > 0)
+    if (msg->ip.type == 's' &&
+        ip_counter_update(&n->ip_counter, msg->ip.s, msg->ip.len,
+                          &n->now) > 0)
         update_prefix(n, 1);
 
-    TRACE(("Got query %s from %s %s\n", query, hex(id),
+    TRACE(("Got query %.*s from %s %s\n", (int)query->len, query->s, hex(id),
            sockaddr_fmt(src, addrlen)));
 
-    e = get_bucket_entry(n, id);
+    e = get_bucket_entry(n, src->sa_family, id, &b);
     if (e) {
-        gettimeofday(&e->last_seen, NULL);
+        e->last_seen = n->now;
         timeradd(&e->last_seen, &bucket_node_timeout, &e->next_ping);
         e->pinged = 0;
 
         /* updade address in case it changed */
-        memcpy(&e->addr, src, addrlen);
-        e->addrlen = addrlen;
+        endpoint_from_sockaddr(&e->addr, src, addrlen);
+        bucket_dirty(b);
+        bucket_schedule(n, b);
     }
 
-    if (!strcmp(query, "ping"))
-        send_response(n, tid, tid_len, NULL, src, addrlen);
-    else if (!strcmp(query, "find_node"))
+    if (krpc_string_eq(query, "ping"))
+        send_empty_response(n, tid, tid_len, src, addrlen);
+    else if (krpc_string_eq(query, "find_node"))
         handle_find_node(n, tid, tid_len, a, src, addrlen);
-    else if (!strcmp(query, "get_peers"))
+    else if (krpc_string_eq(query, "get_peers"))
         handle_get_peers(n, tid, tid_len, a, src, addrlen);
-    else if (!strcmp(query, "announce_peer"))
+    else if (krpc_string_eq(query, "announce_peer"))
         handle_announce_peer(n, tid, tid_len, a, src, addrlen);
-    else if (!strcmp(query, "get"))
+    else if (krpc_string_eq(query, "get"))
         handle_get(n, tid, tid_len, a, src, addrlen);
-    else if (!strcmp(query, "put"))
+    else if (krpc_string_eq(query, "put"))
         handle_put(n, tid, tid_len, a, src, addrlen);
     else {
-        TRACE(("Unknown method: %s\n", query));
+        TRACE(("Unknown method: %.*s\n", (int)query->len, query->s));
         send_error(n, tid, tid_len, 204, "Method Unknown", src, addrlen);
     }
 }
@@ -1995,16 +3191,15 @@ static void handle_query(struct dht_node *n, struct bvalue *dict,
 void hexdump(const unsigned char *buf, size_t len, unsigned int indent,
              int (*print)(const char *fmt, ...));
 
-// 节点输入
-void dht_node_input(struct dht_node *n, const unsigned char *data, size_t len,
-                    const struct sockaddr *src, socklen_t addrlen)
+// 处理数据报
+static void node_input(struct dht_node *n, const unsigned char *data,
+                       size_t len, const struct sockaddr *src,
+                       socklen_t addrlen)
 {
-    struct bvalue *dict;
-    const struct bvalue *v;
-    const char *msgtype;
+    struct krpc_msg msg;
 
-    dict = bdecode_buf(data, len);
-    if (!dict) {
+    /* Decoded in place, values point into data */
+    if (krpc_parse(data, len, &msg)) {
         TRACE(("bdecode failed:\n"));
 #ifdef DHT_DEBUG
         hexdump(data, len, 1, debug_printf);
@@ -2012,35 +3207,300 @@ void dht_node_input(struct dht_node *n, const unsigned char *data, size_t len,
         return;
     }
 
-    v = bvalue_dict_get(dict, "y");
-    if (!v) {
-        TRACE(("'y' key missing\n"));
-        goto release;
+    if (!msg.y.type) {
+        TRACE(("'y' key missing\n"));
+        return;
+    }
+    if (msg.y.type != 's') {
+        TRACE(("'y' key not a string\n"));
+        return;
+    }
+
+    if (krpc_string_eq(&msg.y, "r")) {
+        handle_response(n, &msg, src, addrlen);
+    } else if (krpc_string_eq(&msg.y, "q")) {
+        handle_query(n, &msg, src, addrlen);
+    } else if (krpc_string_eq(&msg.y, "e")) {
+        handle_error(n, &msg, src, addrlen);
+    } else {
+        TRACE(("invalid message type: %.*s\n", (int)msg.y.len, msg.y.s));
+    }
+}
+
+// 节点输入
+void dht_node_input(struct dht_node *n, const unsigned char *data, size_t len,
+                    const struct sockaddr *src, socklen_t addrlen)
+{
+    gettimeofday(&n->now, NULL);
+    node_input(n, data, len, src, addrlen);
+}
+
+// 节点批量输入
+void dht_node_input_batch(struct dht_node *n,
+                          const struct dht_datagram *msgs, size_t count)
+{
+    size_t i;
+
+    /* The whole burst is processed at the same time */
+    gettimeofday(&n->now, NULL);
+    for (i = 0; i < count; i++)
+        node_input(n, msgs[i].data, msgs[i].len, msgs[i].addr,
+                   msgs[i].addrlen);
+}
+
+// Ping节点
+void dht_node_ping(struct dht_node *n, struct sockaddr *dest, socklen_t addrlen)
+{
+    struct dht_endpoint ep;
+
+    if (!endpoint_from_sockaddr(&ep, dest, addrlen))
+        ping_node(n, &ep);
+}
+
+// 联系人是否已知
+static int contact_known(struct dht_node *n, const struct dht_contact *c)
+{
+    struct routing_table *t = node_table(n, c->addr.family);
+    struct bucket *b;
+    size_t i;
+
+    if (!t)
+        return 0;
+
+    b = t->buckets[bucket_index(n, t, c->id)];
+
+    return bucket_find(b, c->id, &i) || replacement_find(b, c->id);
+}
+
+// 比较节点编号
+static int id_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, 20);
+}
+
+/*
+ * Split the last bucket of table t as many times as inserting the contacts
+ * one by one would, so that the nodes are only moved once. The last bucket
+ * needs splitting while it covers more nodes than it can hold. Only the
+ * contacts that will be added count, once each.
+ */
+// 预先分裂桶
+static void presplit_table(struct dht_node *n, struct routing_table *t,
+                           const struct dht_contact *contacts, size_t count)
+{
+    size_t last = t->bucket_count - 1;
+    const struct bucket *b = t->buckets[last];
+    size_t hist[160] = { 0 };
+    unsigned char (*ids)[20];
+    size_t i, cpl, nids = 0, total = 0;
+
+    ids = malloc(count * sizeof(*ids));
+    if (!ids)
+        return; /* Split while inserting instead */
+
+    for (i = 0; i < count; i++) {
+        if (node_table(n, contacts[i].addr.family) != t ||
+            contact_known(n, &contacts[i]))
+            continue;
+        if (common_prefix_len(n->id, contacts[i].id) >= last)
+            memcpy(ids[nids++], contacts[i].id, 20);
+    }
+    qsort(ids, nids, sizeof(*ids), id_cmp);
+
+    for (i = 0; i < b->cnt; i++)
+        hist[common_prefix_len(n->id, b->nodes[i].id)]++;
+
+    for (i = 0; i < nids; i++) {
+        if (i > 0 && !memcmp(ids[i - 1], ids[i], 20))
+            continue;
+        cpl = common_prefix_len(n->id, ids[i]);
+        if (cpl < 160)
+            hist[cpl]++;
+    }
+    free(ids);
+
+    for (i = last; i < 160; i++)
+        total += hist[i];
+
+    while (last < 159 && total > bucket_size(n, last)) {
+        if (split_last_bucket(n, t))
+            break;
+        total -= hist[last++];
+    }
+}
+
+// 预留联系人验证队列
+static int reserve_contacts(struct dht_node *n, size_t count)
+{
+    struct contact_queue *q = n->contacts;
+    struct pending_contact *pc;
+
+    if (!q) {
+        q = malloc(sizeof(struct contact_queue));
+        if (!q)
+            return -1;
+        if (timer_add(n->timers, &q->timer, TIMER_CONTACTS)) {
+            free(q);
+            return -1;
+        }
+        q->contacts = NULL;
+        q->count = 0;
+        q->pinged = 0;
+        q->checked = 0;
+        n->contacts = q;
+    }
+
+    /* Forget the contacts already verified */
+    if (q->checked) {
+        memmove(q->contacts, q->contacts + q->checked,
+                (q->count - q->checked) * sizeof(struct pending_contact));
+        q->count -= q->checked;
+        q->pinged -= q->checked;
+        q->checked = 0;
+    }
+
+    pc = realloc(q->contacts,
+                 (q->count + count) * sizeof(struct pending_contact));
+    if (!pc)
+        return -1;
+    q->contacts = pc;
+
+    return 0;
+}
+
+/* Room must have been made with reserve_contacts() */
+// 排队验证联系人
+static void queue_contact(struct dht_node *n, const struct dht_contact *c)
+{
+    struct contact_queue *q = n->contacts;
+    struct pending_contact *pc = &q->contacts[q->count++];
+
+    pc->c = *c;
+    timerclear(&pc->ping_time);
+
+    /* Otherwise already pinging at the configured pace */
+    if (q->pinged == q->count - 1)
+        timer_set(n->timers, &q->timer, &n->now);
+}
+
+/*
+ * Drop the contacts that did not answer their verification ping, then
+ * ping the next few ones. Contacts kept as replacement candidates are
+ * verified too, so that unverified nodes are not promoted later on.
+ */
+// 联系人定时器到期
+static void contacts_expired(struct dht_node *n, struct contact_queue *q,
+                             const struct timeval *now)
+{
+    struct pending_contact *pc;
+    struct routing_table *t;
+    struct bucket_entry *e;
+    struct bucket *b;
+    struct timeval expire;
+    size_t i, sent = 0;
+
+    while (q->checked < q->pinged) {
+        pc = &q->contacts[q->checked];
+        timeradd(&pc->ping_time, &ping_timeout, &expire);
+        if (timercmp(&expire, now, >))
+            break;
+        q->checked++;
+
+        t = node_table(n, pc->c.addr.family);
+        b = t->buckets[bucket_index(n, t, pc->c.id)];
+        if (bucket_find(b, pc->c.id, &i)) {
+            if (timercmp(&b->nodes[i].last_seen, &pc->ping_time, >))
+                continue;
+            TRACE(("removing unverified node %s\n", hex(pc->c.id)));
+            bucket_remove(b, i);
+            bucket_schedule(n, b);
+        } else if ((e = replacement_find(b, pc->c.id)) &&
+                   !timercmp(&e->last_seen, &pc->ping_time, >)) {
+            replacement_remove(b, pc->c.id);
+        }
     }
-    msgtype = (char *)bvalue_string(v, NULL);
-    if (!msgtype) {
-        TRACE(("'y' key not a string\n"));
-        goto release;
+
+    while (q->pinged < q->count && sent < CONTACT_PING_BURST) {
+        pc = &q->contacts[q->pinged++];
+        pc->ping_time = *now;
+
+        e = get_bucket_entry(n, pc->c.addr.family, pc->c.id, &b);
+        if (e) {
+            e->pinged++;
+            timeradd(now, &ping_timeout, &e->next_ping);
+            bucket_dirty(b);
+            bucket_schedule(n, b);
+        }
+
+        ping_node(n, e ? &e->addr : &pc->c.addr);
+        sent++;
     }
 
-    if (!strcmp(msgtype, "r")) {
-        handle_response(n, dict, src, addrlen);
-    } else if (!strcmp(msgtype, "q")) {
-        handle_query(n, dict, src, addrlen);
-    } else if (!strcmp(msgtype, "e")) {
-        handle_error(n, dict, src, addrlen);
+    if (q->pinged < q->count) {
+        timeradd(now, &contact_ping_interval, &expire);
+        timer_set(n->timers, &q->timer, &expire);
+    } else if (q->checked < q->count) {
+        pc = &q->contacts[q->checked];
+        timeradd(&pc->ping_time, &ping_timeout, &expire);
+        timer_set(n->timers, &q->timer, &expire);
     } else {
-        TRACE(("invalid message type: %s\n", msgtype));
+        timer_del(n->timers, &q->timer);
+        free(q->contacts);
+        free(q);
+        n->contacts = NULL;
+    }
+}
+
+// 路由表的节点数
+static size_t node_count(const struct dht_node *n)
+{
+    size_t i, k, cnt = 0;
+
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < n->tables[k].bucket_count; i++)
+            cnt += n->tables[k].buckets[i]->cnt;
     }
 
-release:
-    bvalue_free(dict);
+    return cnt;
 }
 
-// Ping节点
-void dht_node_ping(struct dht_node *n, struct sockaddr *dest, socklen_t addrlen)
+// 批量添加联系人
+int dht_node_add_contacts(struct dht_node *n,
+                          const struct dht_contact *contacts, size_t count,
+                          int verify)
 {
-    send_query(n, "ping", n->tid++, NULL, dest, addrlen);
+    size_t before, after, i, k;
+
+    if (!count)
+        return 0;
+
+    /* Fail before touching the routing tables */
+    if (verify && reserve_contacts(n, count))
+        return -1;
+
+    gettimeofday(&n->now, NULL);
+    before = node_count(n);
+
+    for (k = 0; k < 2; k++)
+        presplit_table(n, &n->tables[k], contacts, count);
+
+    for (i = 0; i < count; i++) {
+        int known = contact_known(n, &contacts[i]);
+
+        insert_node(n, contacts[i].id, &contacts[i].addr, &n->now);
+
+        /*
+         * Only verify the nodes added by this call: a node already known
+         * may be live and must not be dropped after a single lost ping.
+         */
+        if (verify && !known && contact_known(n, &contacts[i]))
+            queue_contact(n, &contacts[i]);
+    }
+
+    /* In wide mode, splitting may turn a few nodes into replacements */
+    after = node_count(n);
+
+    return after > before ? (int)(after - before) : 0;
 }
 
 // 发布到节点
@@ -2048,28 +3508,25 @@ void dht_node_announce(struct dht_node *n, const unsigned char *info_hash,
                        const struct search_node *nodes,
                        int implied_port, int port)
 {
-    struct bvalue *args, *v;
+    unsigned char buf[512];
+    struct krpc_writer w;
     const struct search_node *sn = nodes;
     size_t i = 0;
 
     while (sn && i < 8) {
         if (sn->token) {
-            args = bvalue_new_dict();
-
-            v = bvalue_new_string(info_hash, 20);
-            bvalue_dict_set(args, "info_hash", v);
-
-            v = bvalue_new_string(sn->token, sn->token_len);
-            bvalue_dict_set(args, "token", v);
-
-            v = bvalue_new_integer(implied_port);
-            bvalue_dict_set(args, "implied_port", v);
-
-            v = bvalue_new_integer(port);
-            bvalue_dict_set(args, "port", v);
-
-            send_query(n, "announce_peer", n->tid++, args,
-                       (struct sockaddr *)&sn->addr, sn->addrlen);
+            query_begin(&w, buf, sizeof(buf));
+            write_id(n, &w);
+            krpc_write_key(&w, "implied_port");
+            krpc_write_integer(&w, implied_port);
+            krpc_write_key(&w, "info_hash");
+            krpc_write_string(&w, info_hash, 20);
+            krpc_write_key(&w, "port");
+            krpc_write_integer(&w, port);
+            krpc_write_key(&w, "token");
+            krpc_write_string(&w, sn->token, sn->token_len);
+
+            send_query(n, &w, "announce_peer", next_tid(n), &sn->addr);
 
             i++;
         }
@@ -2082,22 +3539,21 @@ void dht_node_put_immutable(struct dht_node *n,
                             const struct search_node *nodes,
                             const struct bvalue *val)
 {
-    struct bvalue *args, *v;
+    unsigned char buf[2048];
+    struct krpc_writer w;
     const struct search_node *sn = nodes;
     size_t i = 0;
 
     while (sn && i < 8) {
         if (sn->token) {
-            args = bvalue_new_dict();
-
-            v = bvalue_new_string(sn->token, sn->token_len);
-            bvalue_dict_set(args, "token", v);
-
-            v = bvalue_copy(val);
-            bvalue_dict_set(args, "v", v);
-
-            send_query(n, "put", n->tid++, args,
-                       (struct sockaddr *)&sn->addr, sn->addrlen);
+            query_begin(&w, buf, sizeof(buf));
+            write_id(n, &w);
+            krpc_write_key(&w, "token");
+            krpc_write_string(&w, sn->token, sn->token_len);
+            krpc_write_key(&w, "v");
+            krpc_write_bvalue(&w, val);
+
+            send_query(n, &w, "put", next_tid(n), &sn->addr);
             i++;
         }
         sn = sn->next;
@@ -2112,7 +3568,8 @@ void dht_node_put_mutable(struct dht_node *n,
                           const unsigned char *salt, size_t salt_len,
                           int seq, const struct bvalue *val)
 {
-    struct bvalue *args, *v;
+    unsigned char buf[2048];
+    struct krpc_writer w;
     const struct search_node *sn = nodes;
     size_t i = 0;
 
@@ -2121,37 +3578,32 @@ void dht_node_put_mutable(struct dht_node *n,
         if (!sn->token)
             goto next;
 
-        args = bvalue_new_dict();
-
-        v = bvalue_new_string(salt, salt_len);
-        bvalue_dict_set(args, "salt", v);
-
-        v = bvalue_new_integer(seq);
-        bvalue_dict_set(args, "seq", v);
+        query_begin(&w, buf, sizeof(buf));
 
         /*
          * Use compare-and-swap if node holds a value with an old
          * sequence number.
          */
-        if (sn->seq) {
-            v = bvalue_new_integer(sn->seq);
-            bvalue_dict_set(args, "cas", v);
+        if (sn->seq >= 0) {
+            krpc_write_key(&w, "cas");
+            krpc_write_integer(&w, sn->seq);
         }
 
-        v = bvalue_copy(val);
-        bvalue_dict_set(args, "v", v);
-
-        v = bvalue_new_string(signature, 64);
-        bvalue_dict_set(args, "sig", v);
-
-        v = bvalue_new_string(sn->token, sn->token_len);
-        bvalue_dict_set(args, "token", v);
-
-        v = bvalue_new_string(k, 32);
-        bvalue_dict_set(args, "k", v);
-
-        send_query(n, "put", n->tid++, args,
-                   (struct sockaddr *)&sn->addr, sn->addrlen);
+        write_id(n, &w);
+        krpc_write_key(&w, "k");
+        krpc_write_string(&w, k, 32);
+        krpc_write_key(&w, "salt");
+        krpc_write_string(&w, salt, salt_len);
+        krpc_write_key(&w, "seq");
+        krpc_write_integer(&w, seq);
+        krpc_write_key(&w, "sig");
+        krpc_write_string(&w, signature, 64);
+        krpc_write_key(&w, "token");
+        krpc_write_string(&w, sn->token, sn->token_len);
+        krpc_write_key(&w, "v");
+        krpc_write_bvalue(&w, val);
+
+        send_query(n, &w, "put", next_tid(n), &sn->addr);
         i++;
 
 next:
@@ -2166,10 +3618,13 @@ static void refresh_done(struct dht_node *n,
 {
     struct bucket *b = opaque;
 
-    (void)n;
     (void)nodes;
 
-    b->refresh = NULL;
+    /* NULL if the bucket was dropped in the meantime */
+    if (b) {
+        b->refresh = NULL;
+        bucket_schedule(n, b);
+    }
 
     TRACE(("Refresh done\n"));
 }
@@ -2178,8 +3633,7 @@ static void refresh_done(struct dht_node *n,
 void dht_node_timeout(struct dht_node *n, struct timeval *tv)
 {
     struct timeval now, exp;
-    struct bucket *b = n->buckets;
-    struct search *s = n->searches.first;
+    const struct timer *t = timer_first(n->timers);
 
     gettimeofday(&now, NULL);
 
@@ -2188,27 +3642,8 @@ void dht_node_timeout(struct dht_node *n, struct timeval *tv)
     tv->tv_usec = 0;
     timeradd(&now, tv, &exp);
 
-    while (b) {
-        size_t i;
-
-        if (b->cnt == BUCKET_ENTRY_MAX) {
-            for (i = 0; i < BUCKET_ENTRY_MAX; i++) {
-                if (timercmp(&b->nodes[i].next_ping, &exp, <))
-                    exp = b->nodes[i].next_ping;
-            }
-        }
-
-        if (!b->refresh && timercmp(&b->refresh_time, &exp, <))
-            exp = b->refresh_time;
-
-        b = b->next;
-    }
-
-    while (s) {
-        if (timercmp(&s->next_query, &exp, <))
-            exp = s->next_query;
-        s = s->next;
-    }
+    if (t && timercmp(&t->expire, &exp, <))
+        exp = t->expire;
 
     if (timercmp(&now, &exp, <))
         timersub(&exp, &now, tv);
@@ -2216,107 +3651,144 @@ void dht_node_timeout(struct dht_node *n, struct timeval *tv)
         timerclear(tv);
 }
 
-/*
- * Node service task:
- *  - Bucket garbage collection: ping the oldest node from each full bucket
- *  - Refresh buckets that have not been updated in a long time
- *  - Start new search iterations
- *  - Garbage collect expired storage
- */
-// 节点工作
-void dht_node_work(struct dht_node *n)
+// 桶定时器到期
+static void bucket_expired(struct dht_node *n, struct bucket *b,
+                           const struct timeval *now)
 {
-    struct timeval now;
-    struct bucket *b = n->buckets;
-    struct search *s = n->searches.first;
-    struct peer_list **pl = &n->peer_storage;
-    struct put_item **pi = &n->put_storage;
-
-    gettimeofday(&now, NULL);
+    struct routing_table *t = b->table;
+    unsigned char id[20];
 
-    while (b) {
-        bucket_gc(n, b, &now);
-        if (!b->refresh && timercmp(&b->refresh_time, &now, <=)) {
-            unsigned char id[20];
+    bucket_gc(n, b, now);
 
-            TRACE(("Refreshing bucket %s", hex(b->first)));
-            if (b->next)
-                TRACE(("-%s:\n", hex(b->next->first)));
-            else
-                TRACE((":\n"));
+    if (!b->refresh && timercmp(&b->refresh_time, now, <=)) {
+        /*
+         * Refresh at most once per period, even if the search finds
+         * nothing new or cannot be started.
+         */
+        timeradd(now, &bucket_refresh_timeout, &b->refresh_time);
 
-            bucket_random(b, id);
+        /* Nothing to refresh from, e.g. IPv6 on an IPv4-only host */
+        if (!table_empty(t)) {
+            TRACE(("Refreshing %s bucket %zu\n",
+                   t == &n->tables[1] ? "IPv6" : "IPv4", b->index));
 
-            dht_node_search(n, id, FIND_NODE, refresh_done, b,
-                            &b->refresh);
+            bucket_random(n, t, b->index, id);
+            start_search(n, t, id, FIND_NODE, refresh_done, b, &b->refresh);
         }
-
-        b = b->next;
-    }
-
-    while (s) {
-        struct search *next = s->next;
-
-        search_progress(n, s, &now);
-        s = next;
     }
 
-    while (*pl) {
-        struct peer **p = &(*pl)->peers;
+    bucket_schedule(n, b);
+}
 
-        while (*p) {
-            if (timercmp(&(*p)->expire_time, &now, <=)) {
-                struct peer *next = (*p)->next;
+// 对等端列表定时器到期
+static void peer_list_expired(struct dht_node *n, struct peer_list *pl,
+                              const struct timeval *now)
+{
+    struct peer **p = &pl->peers;
+    const struct timeval *expire = NULL;
 
-                free(*p);
-                *p = next;
-                continue;
-            }
+    while (*p) {
+        if (timercmp(&(*p)->expire_time, now, <=)) {
+            struct peer *next = (*p)->next;
 
-            p = &(*p)->next;
+            free(*p);
+            *p = next;
+            continue;
         }
 
-        if (!(*pl)->peers) {
-            struct peer_list *next = (*pl)->next;
+        if (!expire || timercmp(&(*p)->expire_time, expire, <))
+            expire = &(*p)->expire_time;
+        p = &(*p)->next;
+    }
 
-            free(*pl);
-            *pl = next;
-            continue;
-        }
-        pl = &(*pl)->next;
+    if (expire) {
+        timer_set(n->timers, &pl->timer, expire);
+        return;
     }
 
-    while (*pi) {
-        if (timercmp(&(*pi)->expire_time, &now, <=)) {
-            struct put_item *next = (*pi)->next;
+    if (pl->next)
+        pl->next->pprev = pl->pprev;
+    *pl->pprev = pl->next;
+    timer_del(n->timers, &pl->timer);
+    free(pl);
+}
 
-            bvalue_free((*pi)->v);
-            free(*pi);
-            *pi = next;
-            continue;
-        }
+// 放置项定时器到期
+static void put_item_expired(struct dht_node *n, struct put_item *item)
+{
+    if (item->next)
+        item->next->pprev = item->pprev;
+    *item->pprev = item->next;
+    timer_del(n->timers, &item->timer);
+    bvalue_free(item->v);
+    free(item);
+}
+
+#define timer_owner(t, type) ((type *)((char *)(t) - offsetof(type, timer)))
+
+/*
+ * Node service task. Every bucket, search and stored item keeps a timer
+ * for its next deadline, only the expired ones are handled:
+ *  - Bucket garbage collection: ping the oldest node from each full bucket
+ *  - Refresh buckets that have not been updated in a long time
+ *  - Start new search iterations
+ *  - Garbage collect expired storage and cached search results
+ */
+// 节点工作
+void dht_node_work(struct dht_node *n)
+{
+    struct timeval now;
+    struct timer *t;
+
+    gettimeofday(&now, NULL);
 
-        pi = &(*pi)->next;
+    while ((t = timer_first(n->timers)) && timercmp(&t->expire, &now, <=)) {
+        switch (t->type) {
+        case TIMER_BUCKET:
+            bucket_expired(n, timer_owner(t, struct bucket), &now);
+            break;
+        case TIMER_SEARCH:
+            search_progress(n, timer_owner(t, struct search), &now);
+            break;
+        case TIMER_PEERS:
+            peer_list_expired(n, timer_owner(t, struct peer_list), &now);
+            break;
+        case TIMER_PUT:
+            put_item_expired(n, timer_owner(t, struct put_item));
+            break;
+        case TIMER_CONTACTS:
+            contacts_expired(n, timer_owner(t, struct contact_queue), &now);
+            break;
+        case TIMER_CACHE:
+            cache_free(n, timer_owner(t, struct cached_result));
+            break;
+        default:
+            timer_clear(n->timers, t);
+            break;
+        }
     }
 }
 
 // 清理节点
 void dht_node_cleanup(struct dht_node *n)
 {
-    struct bucket *b = n->buckets;
     struct search *s;
     struct peer_list *pl = n->peer_storage;
     struct put_item *pi = n->put_storage;
+    size_t i, k;
 
-    while (b) {
-        struct bucket *next = b->next;
+    /* Refresh searches point to their bucket, cancel them first */
+    while ((s = n->searches.first))
+        dht_node_cancel(n, s->requests);
 
-        free(b);
-        b = next;
-    }
+    while (n->search_cache)
+        cache_free(n, n->search_cache);
 
-    while ((s = n->searches.first))
-        dht_node_cancel(n, s);
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < n->tables[k].bucket_count; i++)
+            bucket_free(n, n->tables[k].buckets[i]);
+        n->tables[k].bucket_count = 0;
+    }
 
     ip_counter_reset(&n->ip_counter);
 
@@ -2341,41 +3813,53 @@ void dht_node_cleanup(struct dht_node *n)
         free(pi);
         pi = next;
     }
+
+    /* Send what the last calls staged, e.g. pings from dht_node_work() */
+    dht_node_flush(n);
+    free(n->outq);
+    n->outq = NULL;
+
+    free(n->queries);
+    n->queries = NULL;
+    n->query_cap = 0;
+    n->query_count = 0;
+
+    if (n->contacts) {
+        free(n->contacts->contacts);
+        free(n->contacts);
+        n->contacts = NULL;
+    }
+
+    timer_heap_free(n->timers);
+    free(n->timers);
+    n->timers = NULL;
 }
 
-// 保存节点
-struct bvalue *dht_node_save(const struct dht_node *n)
+// 保存路由表
+static struct bvalue *save_table(const struct routing_table *t)
 {
-    struct bvalue *v, *dict;
-    struct bvalue *bucket_list;
-    struct bucket *b = n->buckets;
-    size_t i;
-
-    dict = bvalue_new_dict();
-    v = bvalue_new_integer(SAVE_FILE_VERSION);
-    bvalue_dict_set(dict, "version", v);
-    v = bvalue_new_string(n->id, 20);
-    bvalue_dict_set(dict, "id", v);
+    struct bvalue *v, *bucket_list;
+    size_t i, j, l;
+    unsigned char compact[18];
 
-    bucket_list = bvalue_new_list();
-    while (b) {
+    bucket_list = bvalue_new_list_sized(t->bucket_count);
+    for (j = 0; j < t->bucket_count; j++) {
+        const struct bucket *b = t->buckets[j];
         struct bvalue *bucket = bvalue_new_dict();
         struct bvalue *node_list;
 
-        v = bvalue_new_string(b->first, 20);
-        bvalue_dict_set(bucket, "first", v);
-        node_list = bvalue_new_list();
+        node_list = bvalue_new_list_sized(b->cnt);
         for (i = 0; i < b->cnt; i++) {
-            struct bvalue *node = bvalue_new_dict();
+            struct bvalue *node = bvalue_new_dict_sized(3);
             struct bvalue *tm;
 
             v = bvalue_new_string(b->nodes[i].id, 20);
             bvalue_dict_set(node, "id", v);
-            v = bvalue_new_compact((struct sockaddr *)&b->nodes[i].addr,
-                                   b->nodes[i].addrlen);
+            l = endpoint_to_compact(&b->nodes[i].addr, compact);
+            v = bvalue_new_string(compact, l);
             bvalue_dict_set(node, "addr", v);
 
-            tm = bvalue_new_dict();
+            tm = bvalue_new_dict_sized(2);
             v = bvalue_new_integer(b->nodes[i].last_seen.tv_sec);
             bvalue_dict_set(tm, "sec", v);
             v = bvalue_new_integer(b->nodes[i].last_seen.tv_usec);
@@ -2387,112 +3871,118 @@ struct bvalue *dht_node_save(const struct dht_node *n)
         bvalue_dict_set(bucket, "nodes", node_list);
 
         bvalue_list_append(bucket_list, bucket);
-        b = b->next;
     }
-    bvalue_dict_set(dict, "buckets", bucket_list);
 
-    return dict;
+    return bucket_list;
 }
 
-// 恢复节点
-int dht_node_restore(const struct bvalue *dict, struct dht_node *n)
+// 保存节点
+struct bvalue *dht_node_save(const struct dht_node *n)
 {
-    const struct bvalue *v;
-    int version;
-    int ret = -1;
-    const unsigned char *id;
-    size_t l;
-    const struct bvalue *bucket_list, *bucket;
-    size_t i;
-    struct bucket *b, **tail = &n->buckets;
-    struct timeval now;
-
-    gettimeofday(&now, NULL);
-
-    if (!dict)
-        return -1;
-
-    if (!(v = bvalue_dict_get(dict, "version")) || bvalue_integer(v, &version))
-        goto release;
-
-    if (version < SAVE_FILE_VERSION)
-        goto release;
-
-    /*
-     * Free current bucket list
-     */
-    b = n->buckets;
-    while (b) {
-        struct bucket *next = b->next;
+    struct bvalue *v, *dict;
 
-        free(b);
-        b = next;
-    }
+    dict = bvalue_new_dict();
+    v = bvalue_new_integer(SAVE_FILE_VERSION);
+    bvalue_dict_set(dict, "version", v);
+    v = bvalue_new_string(n->id, 20);
+    bvalue_dict_set(dict, "id", v);
+    bvalue_dict_set(dict, "buckets", save_table(&n->tables[0]));
+    bvalue_dict_set(dict, "buckets6", save_table(&n->tables[1]));
 
-    if (!(v = bvalue_dict_get(dict, "id")) || !(id = bvalue_string(v, &l)) ||
-        l != 20)
-        goto release;
-    memcpy(n->id, id, 20);
+    return dict;
+}
 
-    if (!(bucket_list = bvalue_dict_get(dict, "buckets")) ||
-        bucket_list->type != BVALUE_LIST)
-        goto release;
+// 恢复桶列表
+static int restore_buckets(struct dht_node *n, const struct bvalue *bucket_list)
+{
+    const struct bvalue *v, *bucket;
+    const unsigned char *id, *addr;
+    size_t i, l;
 
     for (i = 0; (bucket = bvalue_list_get(bucket_list, i)); i++) {
         const struct bvalue *node_list, *node;
         size_t j;
 
-        b = malloc(sizeof(struct bucket));
-        if (!b)
-            goto release;
-
-        if (!(v = bvalue_dict_get(bucket, "first")) ||
-            !(id = bvalue_string(v, &l)) || l != 20)
-            goto release;
-
-        memcpy(b->first, id, 20);
-
         if (!(node_list = bvalue_dict_get(bucket, "nodes")) ||
             node_list->type != BVALUE_LIST)
-            goto release;
+            return -1;
 
         for (j = 0; (node = bvalue_list_get(node_list, j)); j++) {
             const struct bvalue *tm;
+            struct dht_endpoint ep;
+            struct timeval last_seen;
 
             if (!(v = bvalue_dict_get(node, "id")) ||
                 !(id = bvalue_string(v, &l)) || l != 20)
-                goto release;
-            memcpy(b->nodes[j].id, id, 20);
+                return -1;
 
             if (!(v = bvalue_dict_get(node, "addr")) ||
-                compact_to_sockaddr(v, (struct sockaddr *)&b->nodes[j].addr,
-                                    &b->nodes[j].addrlen))
-                goto release;
+                !(addr = bvalue_string(v, &l)) ||
+                endpoint_from_compact(&ep, addr, l))
+                return -1;
 
             if (!(tm = bvalue_dict_get(node, "last_seen")) ||
                 !(v = bvalue_dict_get(tm, "sec")) ||
-                bvalue_integer_l(v, &b->nodes[j].last_seen.tv_sec) ||
+                bvalue_integer_l(v, &last_seen.tv_sec) ||
                 !(v = bvalue_dict_get(tm, "usec")) ||
-                bvalue_integer_l(v, &b->nodes[j].last_seen.tv_usec))
-                goto release;
+                bvalue_integer_l(v, &last_seen.tv_usec))
+                return -1;
 
-            b->nodes[j].pinged = 0;
-            timerclear(&b->nodes[j].next_ping);
+            insert_node(n, id, &ep, &last_seen);
         }
+    }
 
-        b->cnt = j;
-        timeradd(&now, &bucket_refresh_timeout, &b->refresh_time);
-        b->refresh = NULL;
+    return 0;
+}
 
-        *tail = b;
-        tail = &b->next;
-    }
-    *tail = NULL;
+/*
+ * Nodes are inserted back one by one into the table of their address
+ * family, so any saved layout is accepted: version 2 files (buckets
+ * delimited by their first ID) and version 3 files (both families in
+ * "buckets") restore as well.
+ */
+// 恢复节点
+int dht_node_restore(const struct bvalue *dict, struct dht_node *n)
+{
+    const struct bvalue *v;
+    int version;
+    const unsigned char *id;
+    size_t l;
+    const struct bvalue *bucket_list, *bucket_list6;
 
-    ret = 0;
+    if (!dict)
+        return -1;
 
-release:
-    return ret;
+    if (!(v = bvalue_dict_get(dict, "version")) || bvalue_integer(v, &version))
+        return -1;
+
+    if (version < 2)
+        return -1;
+
+    if (!(v = bvalue_dict_get(dict, "id")) || !(id = bvalue_string(v, &l)) ||
+        l != 20)
+        return -1;
+
+    if (!(bucket_list = bvalue_dict_get(dict, "buckets")) ||
+        bucket_list->type != BVALUE_LIST)
+        return -1;
+
+    bucket_list6 = bvalue_dict_get(dict, "buckets6");
+    if (bucket_list6 && bucket_list6->type != BVALUE_LIST)
+        return -1;
+
+    gettimeofday(&n->now, NULL);
+
+    memcpy(n->id, id, 20);
+    clear_buckets(n);
+
+    if (restore_buckets(n, bucket_list))
+        return -1;
+
+    if (bucket_list6 && restore_buckets(n, bucket_list6))
+        return -1;
+
+    return 0;
 }
 
 // 节点设置引导回调函数
@@ -2503,3 +3993,85 @@ void dht_node_set_bootstrap_callback(struct dht_node *n,
     n->bootstrap_cb = callback;
     n->bootstrap_priv = opaque;
 }
+
+// 设置批量输出回调
+int dht_node_set_output_batch(struct dht_node *n, node_output_batch_t output)
+{
+    if (!output) {
+        dht_node_flush(n);
+        free(n->outq);
+        n->outq = NULL;
+        n->output_batch = NULL;
+        return 0;
+    }
+
+    if (!n->outq) {
+        n->outq = malloc(sizeof(struct output_queue));
+        if (!n->outq)
+            return -1;
+        n->outq->count = 0;
+        n->outq->used = 0;
+    }
+    n->output_batch = output;
+
+    return 0;
+}
+
+// 发送暂存的数据报
+void dht_node_flush(struct dht_node *n)
+{
+    struct output_queue *q = n->outq;
+
+    if (!q || !q->count)
+        return;
+
+    n->output_batch(q->msgs, q->count, n->opaque);
+    q->count = 0;
+    q->used = 0;
+}
+
+// 设置路由表模式
+int dht_node_set_routing_mode(struct dht_node *n, enum dht_routing_mode mode)
+{
+    enum dht_routing_mode old = n->routing_mode;
+    struct bucket *b[2];
+    size_t k;
+
+    for (k = 0; k < 2; k++) {
+        if (!table_empty(&n->tables[k]) || n->tables[k].buckets[0]->refresh)
+            return -1;
+    }
+
+    n->routing_mode = mode;
+    b[0] = bucket_new(n, &n->tables[0], 0);
+    b[1] = bucket_new(n, &n->tables[1], 0);
+    if (!b[0] || !b[1]) {
+        for (k = 0; k < 2; k++) {
+            if (b[k])
+                bucket_free(n, b[k]);
+        }
+        n->routing_mode = old;
+        return -1;
+    }
+
+    for (k = 0; k < 2; k++) {
+        bucket_free(n, n->tables[k].buckets[0]);
+        n->tables[k].buckets[0] = b[k];
+    }
+
+    return 0;
+}
+
+// 设置搜索结果缓存
+void dht_node_set_search_cache(struct dht_node *n, unsigned int ttl)
+{
+    /* The cached tokens must still be accepted by the remote nodes */
+    if (ttl > SEARCH_CACHE_TTL_MAX)
+        ttl = SEARCH_CACHE_TTL_MAX;
+
+    n->search_cache_ttl = ttl;
+    if (!ttl) {
+        while (n->search_cache)
+            cache_free(n, n->search_cache);
+    }
+}
@@ -9,47 +9,150 @@
 #define NODE_H
 
 #define SEARCH_RESULT_MAX 8
+#define SEARCH_SEED_MAX 16
+#define SEARCH_ALPHA 4
+#define SEARCH_FRONTIER_MAX 64
+
+/* Bounds of the per-query stale timeout, in milliseconds */
+#define SEARCH_STALE_MIN 200
+#define SEARCH_STALE_MAX 2000
+
+// 定时器类型
+enum {
+    TIMER_BUCKET,
+    TIMER_SEARCH,
+    TIMER_PEERS,
+    TIMER_PUT,
+    TIMER_CONTACTS,
+    TIMER_CACHE,
+};
+
+// 搜索前沿条目
+struct frontier_entry {
+    unsigned char dist[20]; // 与目标的距离
+    struct search_node *sn; // 搜索节点
+};
 
 // 搜索结构
 struct search {
     unsigned char id[20]; // 编号
-    uint16_t tid;
     struct timeval next_query; // 下一查询结构
+    struct timer timer; // 定时器
     int search_type; // 搜索类型
-    struct search_node *queue; // 搜索节点队列结构
+    const struct routing_table *table; // 种子路由表，NULL为全部
+    struct search_node *queue; // 搜索节点队列结构，按距离排序
     size_t node_count; // 节点总数
-    search_complete_t callback; // 搜索完成的回调函数
-    void *opaque;
+    struct frontier_entry frontier[SEARCH_FRONTIER_MAX]; // 搜索前沿
+    unsigned int rtt; // 平滑往返时间（毫秒），0为未知
+    int cached; // 由缓存结果开始
+    int done; // 已完成，正在通知请求者
+    struct search_request *requests; // 请求者
     struct search *next; // 下一个搜索
     struct search **pprev; // 上一个搜索
 };
 
+/*
+ * Caller of a search, returned as its handle. Several requests may share
+ * the same search.
+ */
+struct search_request {
+    search_complete_t callback; // 搜索完成的回调函数
+    void *opaque;
+    struct search *search; // 搜索
+    struct search_request *next; // 下一个请求
+};
+
+/*
+ * Search query waiting for a response. Entries live in an open addressing
+ * hash table indexed by transaction ID, search is NULL in empty slots.
+ */
+struct pending_query {
+    struct search *search; // 搜索
+    struct search_node *sn; // 被查询的节点
+    struct timeval sent; // 发送时间
+    uint16_t tid; // 事务ID
+};
+
+#define QUERY_TABLE_MIN 64
+
+/*
+ * Result of a completed GET_PEERS or GET search. nodes is a list of copies
+ * of the search nodes that replied, sorted by distance to the target.
+ */
+struct cached_result {
+    unsigned char id[20]; // 搜索目标
+    int search_type; // 搜索类型
+    struct search_node *nodes; // 已应答的节点
+    struct timer timer; // 定时器
+    struct cached_result *next; // 下一个结果
+    struct cached_result **pprev; // 上一个结果
+};
+
+#define SEARCH_CACHE_MAX 64
+#define SEARCH_CACHE_TTL_MAX (5 * 60)
+
 // 桶的条目结构
 struct bucket_entry {
     unsigned char id[20]; // 编号
-    struct sockaddr_storage addr; // 地址
-    socklen_t addrlen; // 地址长度
+    struct dht_endpoint addr; // 地址
     struct timeval last_seen; // 最后一个
     struct timeval next_ping; // 下一个Ping
     int pinged;
+    unsigned int rtt; // 平滑往返时间（毫秒），0为未知
 };
 
 #define BUCKET_ENTRY_MAX 8
+#define REPLACEMENT_MAX 8
 
 // 桶的结构
 struct bucket {
-    unsigned char first[20]; // 第一个
-    struct bucket_entry nodes[BUCKET_ENTRY_MAX]; // 桶条目，节点数
+    size_t size; // 容量
     size_t cnt;
     struct timeval refresh_time; // 刷新时间
-    struct bucket *next; // 下一桶
-    struct search *refresh; // 刷新搜索
+    struct search_request *refresh; // 刷新搜索
+    struct timer timer; // 定时器
+    struct routing_table *table; // 所属路由表
+    size_t index; // 桶索引
+    struct bucket_snapshot *snap; // 快照缓存，修改桶时丢弃
+    struct bucket_entry replacements[REPLACEMENT_MAX]; // 替换缓存
+    size_t rcnt; // 替换节点数
+    struct bucket_entry nodes[]; // 桶条目，节点数
 };
 
+// 桶快照的结构
+struct bucket_snapshot {
+    long refcnt; // 引用计数
+    size_t cnt;
+    struct dht_snapshot_entry nodes[];
+};
+
+// 路由表快照的结构
+struct dht_snapshot {
+    long refcnt; // 引用计数
+    size_t bucket_count[2]; // 桶数
+    struct bucket_snapshot *buckets[2][160]; // 桶快照
+};
+
+// 待验证联系人的结构
+struct pending_contact {
+    struct dht_contact c; // 联系人
+    struct timeval ping_time; // Ping时间
+};
+
+// 联系人验证队列的结构
+struct contact_queue {
+    struct pending_contact *contacts; // 联系人
+    size_t count; // 联系人数
+    size_t pinged; // 已Ping数
+    size_t checked; // 已验证数
+    struct timer timer; // 定时器
+};
+
+#define CONTACT_PING_BURST 16
+
 // 对等端的结构
 struct peer {
-    struct sockaddr_storage addr; // 地址
-    socklen_t addrlen; // 地址长度
+    struct dht_endpoint addr; // 地址
     struct timeval expire_time; // 过期时间
     struct peer *next; // 下一个对等端
 };
@@ -58,7 +161,9 @@ struct peer {
 struct peer_list {
     unsigned char info_hash[20]; // 种子散列值
     struct peer *peers; // 对等端
+    struct timer timer; // 定时器
     struct peer_list *next; // 下一个对等端列表
+    struct peer_list **pprev; // 上一个对等端列表
 };
 
 // 放置项的结构
@@ -69,7 +174,9 @@ struct put_item {
     unsigned char sig[64];
     struct bvalue *v;
     struct timeval expire_time; // 过期时间
+    struct timer timer; // 定时器
     struct put_item *next; // 下一个放置项
+    struct put_item **pprev; // 上一个放置项
 };
 
 // 桶节点超时
@@ -108,12 +215,18 @@ static const struct timeval ping_timeout = {
     .tv_usec = 0,
 };
 
+// 联系人Ping间隔
+static const struct timeval contact_ping_interval = {
+    .tv_sec = 0,
+    .tv_usec = 100000,
+};
+
 // 放置超时
 static const struct timeval put_timeout = {
     .tv_sec = 2 * 60 * 60,
     .tv_usec = 0,
 };
 
-#define SAVE_FILE_VERSION 2
+#define SAVE_FILE_VERSION 4
 
 #endif /* NODE_H */
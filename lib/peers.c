@@ -21,6 +21,27 @@ struct get_peers_context
     void *opaque;
 };
 
+/* Whether peer i of sn already appeared earlier in the result list */
+// 对等端是否已经出现过
+static int peer_seen(const struct search_node *nodes,
+                     const struct search_node *sn, size_t i)
+{
+    const struct search_node *p;
+    size_t j, end;
+
+    for (p = nodes; p; p = p->next) {
+        end = (p == sn) ? i : p->peer_count;
+        for (j = 0; j < end; j++) {
+            if (!memcmp(&p->peers[j], &sn->peers[i],
+                        sizeof(struct dht_endpoint)))
+                return 1;
+        }
+        if (p == sn)
+            break;
+    }
+    return 0;
+}
+
 static void gp_complete(struct dht_node *n,
                         const struct search_node *nodes,
                         void *opaque)
@@ -28,7 +49,7 @@ static void gp_complete(struct dht_node *n,
     struct get_peers_context *ctx = opaque;
     struct sockaddr_storage *peers = NULL;
     size_t count = 0;
-    size_t i, j;
+    size_t i;
     const struct search_node *sn = nodes;
 
     (void)n;
@@ -42,21 +63,18 @@ static void gp_complete(struct dht_node *n,
     while (sn) {
         for (i = 0; i < sn->peer_count; i++) {
             void *tmp;
+            struct sockaddr_storage ss;
 
-            for (j = 0; j < count; j++) {
-                if (!sockaddr_cmp((struct sockaddr *)&sn->peers[i],
-                                  (struct sockaddr *)&peers[j]))
-                    break;
-            }
-            if (j != count)
+            if (peer_seen(nodes, sn, i))
+                continue;
+            if (!endpoint_to_sockaddr(&sn->peers[i], &ss))
                 continue;
 
             tmp = realloc(peers, (count + 1) * sizeof(struct sockaddr_storage));
             if (!tmp)
                 continue;
             peers = tmp;
-            memcpy(&peers[count++], &sn->peers[i],
-                   sizeof(struct sockaddr_storage));
+            memcpy(&peers[count++], &ss, sizeof(struct sockaddr_storage));
         }
 
         sn = sn->next;
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2020 naturalpolice
+ * SPDX-License-Identifier: MIT
+ *
+ * Licensed under the MIT License (see LICENSE).
+ */
+
+#include <stdlib.h>
+
+#include "timer.h"
+
+// 比较定时器
+static int timer_before(const struct timer *a, const struct timer *b)
+{
+    return timercmp(&a->expire, &b->expire, <);
+}
+
+// 放置定时器
+static void heap_place(struct timer_heap *h, size_t i, struct timer *t)
+{
+    h->timers[i] = t;
+    t->index = i;
+}
+
+// 上移定时器
+static void sift_up(struct timer_heap *h, size_t i)
+{
+    struct timer *t = h->timers[i];
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+
+        if (!timer_before(t, h->timers[parent]))
+            break;
+        heap_place(h, i, h->timers[parent]);
+        i = parent;
+    }
+    heap_place(h, i, t);
+}
+
+// 下移定时器
+static void sift_down(struct timer_heap *h, size_t i)
+{
+    struct timer *t = h->timers[i];
+
+    for (;;) {
+        size_t child = 2 * i + 1;
+
+        if (child >= h->count)
+            break;
+        if (child + 1 < h->count &&
+            timer_before(h->timers[child + 1], h->timers[child]))
+            child++;
+        if (!timer_before(h->timers[child], t))
+            break;
+        heap_place(h, i, h->timers[child]);
+        i = child;
+    }
+    heap_place(h, i, t);
+}
+
+// 初始化定时器堆
+void timer_heap_init(struct timer_heap *h)
+{
+    h->timers = NULL;
+    h->count = 0;
+    h->reserved = 0;
+    h->cap = 0;
+}
+
+// 释放定时器堆
+void timer_heap_free(struct timer_heap *h)
+{
+    free(h->timers);
+    timer_heap_init(h);
+}
+
+// 注册定时器
+int timer_add(struct timer_heap *h, struct timer *t, int type)
+{
+    if (h->reserved == h->cap) {
+        size_t cap = h->cap ? 2 * h->cap : 16;
+        struct timer **timers;
+
+        timers = realloc(h->timers, cap * sizeof(struct timer *));
+        if (!timers)
+            return -1;
+        h->timers = timers;
+        h->cap = cap;
+    }
+    h->reserved++;
+
+    t->index = TIMER_IDLE;
+    t->type = type;
+
+    return 0;
+}
+
+// 注销定时器
+void timer_del(struct timer_heap *h, struct timer *t)
+{
+    timer_clear(h, t);
+    h->reserved--;
+}
+
+// 设置定时器
+void timer_set(struct timer_heap *h, struct timer *t,
+               const struct timeval *expire)
+{
+    t->expire = *expire;
+
+    if (t->index == TIMER_IDLE) {
+        heap_place(h, h->count++, t);
+        sift_up(h, t->index);
+        return;
+    }
+
+    sift_up(h, t->index);
+    sift_down(h, t->index);
+}
+
+// 取消定时器
+void timer_clear(struct timer_heap *h, struct timer *t)
+{
+    size_t i = t->index;
+    struct timer *last;
+
+    if (i == TIMER_IDLE)
+        return;
+
+    t->index = TIMER_IDLE;
+    last = h->timers[--h->count];
+    if (last == t)
+        return;
+
+    heap_place(h, i, last);
+    sift_up(h, i);
+    sift_down(h, last->index);
+}
+
+// 最早的定时器
+struct timer *timer_first(const struct timer_heap *h)
+{
+    return h->count ? h->timers[0] : NULL;
+}
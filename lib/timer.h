@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2020 naturalpolice
+ * SPDX-License-Identifier: MIT
+ *
+ * Licensed under the MIT License (see LICENSE).
+ */
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stddef.h>
+
+#include "time.h"
+
+#define TIMER_IDLE ((size_t)-1)
+
+/*
+ * Timer embedded in the object it belongs to. The owner is found back from
+ * the timer type. index is the position of the timer in the heap, or
+ * TIMER_IDLE when it is not scheduled.
+ */
+struct timer {
+    struct timeval expire;
+    size_t index;
+    int type;
+};
+
+/*
+ * Binary min-heap of the scheduled timers. Room is reserved for every
+ * registered timer, so scheduling never allocates memory.
+ */
+struct timer_heap {
+    struct timer **timers;
+    size_t count;
+    size_t reserved;
+    size_t cap;
+};
+
+void timer_heap_init(struct timer_heap *h);
+void timer_heap_free(struct timer_heap *h);
+int timer_add(struct timer_heap *h, struct timer *t, int type);
+void timer_del(struct timer_heap *h, struct timer *t);
+void timer_set(struct timer_heap *h, struct timer *t,
+               const struct timeval *expire);
+void timer_clear(struct timer_heap *h, struct timer *t);
+struct timer *timer_first(const struct timer_heap *h);
+
+#endif /* TIMER_H_ */
@@ -168,3 +168,124 @@ const char *compactaddr_fmt(const unsigned char *ip, size_t len)
 
     return ret;
 }
+
+// 套接字地址转为端点
+int endpoint_from_sockaddr(struct dht_endpoint *ep, const struct sockaddr *sa,
+                           socklen_t addrlen)
+{
+    memset(ep, 0, sizeof(*ep));
+
+    switch (sa->sa_family) {
+    case AF_INET: // IPv4
+        {
+            const struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+
+            if (addrlen < sizeof(*sin))
+                return -1;
+
+            memcpy(ep->addr, &sin->sin_addr, 4);
+            memcpy(ep->port, &sin->sin_port, 2);
+        }
+        break;
+    case AF_INET6: // IPv6
+        {
+            const struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+
+            if (addrlen < sizeof(*sin6))
+                return -1;
+
+            memcpy(ep->addr, &sin6->sin6_addr, 16);
+            memcpy(ep->port, &sin6->sin6_port, 2);
+        }
+        break;
+    default:
+        return -1;
+    }
+    ep->family = sa->sa_family;
+
+    return 0;
+}
+
+// 端点转为套接字地址
+socklen_t endpoint_to_sockaddr(const struct dht_endpoint *ep,
+                               struct sockaddr_storage *ss)
+{
+    memset(ss, 0, sizeof(*ss));
+
+    switch (ep->family) {
+    case AF_INET: // IPv4
+        {
+            struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+
+            sin->sin_family = AF_INET;
+            memcpy(&sin->sin_addr, ep->addr, 4);
+            memcpy(&sin->sin_port, ep->port, 2);
+        }
+        return sizeof(struct sockaddr_in);
+    case AF_INET6: // IPv6
+        {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+            sin6->sin6_family = AF_INET6;
+            memcpy(&sin6->sin6_addr, ep->addr, 16);
+            memcpy(&sin6->sin6_port, ep->port, 2);
+        }
+        return sizeof(struct sockaddr_in6);
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+// 紧凑地址转为端点
+int endpoint_from_compact(struct dht_endpoint *ep, const unsigned char *ip,
+                          size_t len)
+{
+    memset(ep, 0, sizeof(*ep));
+
+    switch (len) {
+    case 6: // IPv4
+        ep->family = AF_INET;
+        break;
+    case 18: // IPv6
+        ep->family = AF_INET6;
+        break;
+    default:
+        return -1;
+    }
+    memcpy(ep->addr, ip, len - 2);
+    memcpy(ep->port, ip + len - 2, 2);
+
+    return 0;
+}
+
+// 端点转为紧凑地址
+size_t endpoint_to_compact(const struct dht_endpoint *ep,
+                           unsigned char buf[18])
+{
+    size_t l;
+
+    switch (ep->family) {
+    case AF_INET: // IPv4
+        l = 4;
+        break;
+    case AF_INET6: // IPv6
+        l = 16;
+        break;
+    default:
+        return 0;
+    }
+    memcpy(buf, ep->addr, l);
+    memcpy(buf + l, ep->port, 2);
+
+    return l + 2;
+}
+
+// 将端点转换为字符串
+const char *endpoint_fmt(const struct dht_endpoint *ep)
+{
+    unsigned char buf[18];
+
+    return compactaddr_fmt(buf, endpoint_to_compact(ep, buf));
+}
@@ -242,16 +242,16 @@ static int l_node_restore(lua_State *L)
     const char *data = luaL_checklstring(L, 2, &len);
     struct bvalue *v;
 
-    v = bdecode_buf((const unsigned char *)data, len);
+    v = bdecode_buf_view((const unsigned char *)data, len);
     if (!v)
         return luaL_error(L, "bdecoding failed");
 
     if (dht_node_restore(v, &n->node)) {
-        bvalue_free(v);
+        bvalue_free_view(v);
         return luaL_error(L, "dht_node_restore failed");
     }
 
-    bvalue_free(v);
+    bvalue_free_view(v);
 
     return 0;
 }
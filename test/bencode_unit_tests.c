@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <stdarg.h>
+
+#include <cmocka.h>
+
+/* Count the allocations made by the decoder */
+static size_t allocs;
+
+static void *counting_malloc(size_t size)
+{
+    allocs++;
+    return malloc(size);
+}
+
+static void *counting_realloc(void *ptr, size_t size)
+{
+    allocs++;
+    return realloc(ptr, size);
+}
+
+#define malloc counting_malloc
+#define realloc counting_realloc
+#include "../lib/bencode.c"
+#undef malloc
+#undef realloc
+
+static struct bvalue *decode(const char *s, unsigned int max_depth,
+                             size_t max_values)
+{
+    struct bdecode_limits limits;
+
+    limits.max_depth = max_depth;
+    limits.max_values = max_values;
+    allocs = 0;
+
+    return bdecode_buf_limits((const unsigned char *)s, strlen(s), &limits);
+}
+
+/* Decoding fails without allocating anything */
+static void assert_rejected(const char *s, unsigned int max_depth,
+                            size_t max_values)
+{
+    assert_null(decode(s, max_depth, max_values));
+    assert_int_equal(allocs, 0);
+}
+
+/* Build depth nested lists around an integer */
+static char *nested_lists(size_t depth)
+{
+    char *s = malloc(depth * 2 + 4);
+    size_t i;
+
+    assert_non_null(s);
+    for (i = 0; i < depth; i++)
+        s[i] = 'l';
+    memcpy(s + depth, "i1e", 3);
+    for (i = 0; i < depth; i++)
+        s[depth + 3 + i] = 'e';
+    s[depth * 2 + 3] = '\0';
+
+    return s;
+}
+
+static void depth_limit(void **state)
+{
+    struct bvalue *v;
+
+    v = decode("llli1eeee", 3, 100);
+    assert_non_null(v);
+    assert_int_equal(v->type, BVALUE_LIST);
+    bvalue_free(v);
+
+    assert_rejected("lllli1eeeee", 3, 100);
+    assert_rejected("d1:ad1:bd1:cd1:di1eeeee", 3, 100);
+
+    v = decode("d1:ad1:bd1:ci1eeee", 3, 100);
+    assert_non_null(v);
+    bvalue_free(v);
+}
+
+static void depth_capped(void **state)
+{
+    struct bvalue *v;
+    char *s;
+
+    s = nested_lists(BDECODE_MAX_DEPTH);
+    v = decode(s, 1000, (size_t)-1);
+    assert_non_null(v);
+    bvalue_free(v);
+    free(s);
+
+    s = nested_lists(BDECODE_MAX_DEPTH + 1);
+    assert_rejected(s, 1000, (size_t)-1);
+    free(s);
+
+    s = nested_lists(200000);
+    assert_rejected(s, 1000, (size_t)-1);
+    free(s);
+}
+
+static void values_limit(void **state)
+{
+    struct bvalue *v;
+
+    /* The dictionary, two keys and two integers */
+    v = decode("d1:ai1e1:bi2ee", 10, 5);
+    assert_non_null(v);
+    assert_int_equal(v->d.len, 2);
+    bvalue_free(v);
+
+    assert_rejected("d1:ai1e1:bi2ee", 10, 4);
+
+    /* The list and three elements */
+    v = decode("li1e1:xi3ee", 10, 4);
+    assert_non_null(v);
+    assert_int_equal(v->l.len, 3);
+    bvalue_free(v);
+
+    assert_rejected("li1e1:xi3ee", 10, 3);
+    assert_rejected("i1e", 10, 0);
+}
+
+static void string_overflow(void **state)
+{
+    assert_rejected("5:abc", 10, 100);
+    assert_rejected("l5:abce", 10, 100);
+    assert_rejected("d9:abci1ee", 10, 100);
+    assert_rejected("d1:a5:abce", 10, 100);
+    assert_rejected("4294967296:x", 10, 100);
+    assert_rejected("18446744073709551616:x", 10, 100);
+    assert_rejected("99999999999999999999999999:x", 10, 100);
+    assert_rejected("i99999999999999999999e", 10, 100);
+}
+
+static void malformed(void **state)
+{
+    assert_rejected("", 10, 100);
+    assert_rejected("l", 10, 100);
+    assert_rejected("li1e", 10, 100);
+    assert_rejected("d1:ae", 10, 100);
+    assert_rejected("di1ei2ee", 10, 100);
+    assert_rejected("i-e", 10, 100);
+    assert_rejected("x", 10, 100);
+}
+
+static void exact_limits(void **state)
+{
+    const char *s = "d1:ald1:bi1eee1:c3:xyze";
+    unsigned char buf[64];
+    struct bvalue *v;
+    int rc;
+
+    /* d, a, l, d, b, 1, c, xyz: 8 values, 3 levels */
+    v = decode(s, 3, 8);
+    assert_non_null(v);
+    rc = bencode_buf(v, buf, sizeof(buf));
+    assert_int_equal(rc, strlen(s));
+    assert_memory_equal(buf, s, rc);
+    bvalue_free(v);
+
+    assert_rejected(s, 2, 8);
+    assert_rejected(s, 3, 7);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(depth_limit),
+        cmocka_unit_test(depth_capped),
+        cmocka_unit_test(values_limit),
+        cmocka_unit_test(string_overflow),
+        cmocka_unit_test(malformed),
+        cmocka_unit_test(exact_limits),
+    };
+
+    return cmocka_run_group_tests_name("bencode", tests, NULL, NULL);
+}
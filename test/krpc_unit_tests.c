@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <stdarg.h>
+
+#include <cmocka.h>
+
+#include "../lib/krpc.h"
+
+static int parse(const char *s, struct krpc_msg *msg)
+{
+    return krpc_parse((const unsigned char *)s, strlen(s), msg);
+}
+
+/* Build "d1:x" followed by depth nested lists and "e" */
+static char *nested_lists(size_t depth)
+{
+    char *s = malloc(depth * 2 + 6);
+    size_t i;
+
+    assert_non_null(s);
+    memcpy(s, "d1:x", 4);
+    for (i = 0; i < depth; i++)
+        s[4 + i] = 'l';
+    for (i = 0; i < depth; i++)
+        s[4 + depth + i] = 'e';
+    s[4 + depth * 2] = 'e';
+    s[5 + depth * 2] = '\0';
+
+    return s;
+}
+
+static void query(void **state)
+{
+    struct krpc_msg msg;
+    size_t len;
+
+    assert_int_equal(parse("d1:ad2:id20:abcdefghij0123456789"
+                           "9:info_hash20:mnopqrstuvwxyz012345e"
+                           "1:q9:get_peers1:t2:aa1:y1:qe", &msg), 0);
+    assert_true(krpc_string_eq(&msg.y, "q"));
+    assert_true(krpc_string_eq(&msg.q, "get_peers"));
+    assert_non_null(krpc_string(&msg.t, &len));
+    assert_int_equal(len, 2);
+    assert_int_equal(msg.a.type, 'd');
+    assert_int_equal(msg.r.type, 0);
+    assert_non_null(krpc_string(&msg.args.id, &len));
+    assert_int_equal(len, 20);
+    assert_memory_equal(msg.args.info_hash.s, "mnopqrstuvwxyz012345", 20);
+    assert_int_equal(msg.args.target.type, 0);
+}
+
+static void response_values(void **state)
+{
+    struct krpc_msg msg;
+    struct krpc_value v;
+    size_t pos = 0;
+    int port;
+
+    assert_int_equal(parse("d1:rd2:id20:abcdefghij01234567894:porti6881e"
+                           "6:valuesl6:AAAAAA6:BBBBBBee1:t2:aa1:y1:re",
+                           &msg), 0);
+    assert_int_equal(msg.r.type, 'd');
+    assert_int_equal(krpc_integer(&msg.args.port, &port), 0);
+    assert_int_equal(port, 6881);
+
+    assert_int_equal(krpc_list_next(&msg.args.values, &pos, &v), 1);
+    assert_int_equal(v.type, 's');
+    assert_memory_equal(v.s, "AAAAAA", 6);
+    assert_int_equal(krpc_list_next(&msg.args.values, &pos, &v), 1);
+    assert_memory_equal(v.s, "BBBBBB", 6);
+    assert_int_equal(krpc_list_next(&msg.args.values, &pos, &v), 0);
+
+    /* Not a list */
+    pos = 0;
+    assert_int_equal(krpc_list_next(&msg.args.port, &pos, &v), 0);
+}
+
+static void truncated(void **state)
+{
+    static const char *const inputs[] = {
+        "",
+        "d",
+        "d1:t",
+        "d1:t2:a",
+        "d1:t9999999999:a",
+        "d1:y1:q",
+        "d1:ti12",
+        "d1:ti12e",
+        "d1:ad2:id",
+        "d1:ad2:id20:abcdefghij0123456789",
+        "d1:ad2:id20:abcdefghij0123456789e",
+        "d1:xl",
+        "d1:xli1e",
+        "d1:xd1:k",
+        "d1:xd1:ki1e",
+        "d1:xd1:ke",
+    };
+    struct krpc_msg msg;
+    size_t i;
+
+    for (i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++)
+        assert_int_equal(parse(inputs[i], &msg), -1);
+}
+
+static void malformed(void **state)
+{
+    struct krpc_msg msg;
+
+    assert_int_equal(parse("le", &msg), -1);
+    assert_int_equal(parse("i1e", &msg), -1);
+    assert_int_equal(parse("di1ei2ee", &msg), -1);
+    assert_int_equal(parse("d1:ti-e", &msg), -1);
+    assert_int_equal(parse("d1:ti99999999999999999999e", &msg), -1);
+    assert_int_equal(parse("d1:t-1:ae", &msg), -1);
+    assert_int_equal(parse("d1:xdi1ei2eee", &msg), -1);
+}
+
+static void non_string_fields(void **state)
+{
+    struct krpc_msg msg;
+    int i;
+
+    /* Accepted, but none of them reads as a string */
+    assert_int_equal(parse("d1:ad2:id20:abcdefghij0123456789e"
+                           "1:qli1ee1:td1:xi1ee1:yi113ee", &msg), 0);
+    assert_int_equal(msg.t.type, 'd');
+    assert_int_equal(msg.y.type, 'i');
+    assert_int_equal(msg.q.type, 'l');
+    assert_null(krpc_string(&msg.t, NULL));
+    assert_null(krpc_string(&msg.q, NULL));
+    assert_false(krpc_string_eq(&msg.y, "q"));
+    assert_int_equal(krpc_integer(&msg.y, &i), 0);
+    assert_int_equal(i, 113);
+    assert_int_equal(krpc_integer(&msg.t, &i), -1);
+}
+
+static void deep_nesting(void **state)
+{
+    struct krpc_msg msg;
+    char *s;
+
+    s = nested_lists(64);
+    assert_int_equal(parse(s, &msg), 0);
+    assert_int_equal(msg.a.type, 0);
+    free(s);
+
+    s = nested_lists(65);
+    assert_int_equal(parse(s, &msg), -1);
+    free(s);
+
+    s = nested_lists(200000);
+    assert_int_equal(parse(s, &msg), -1);
+    free(s);
+
+    /* Same limit inside the argument dictionary */
+    assert_int_equal(parse("d1:ad1:vlllleeeee1:y1:qe", &msg), 0);
+    assert_int_equal(msg.args.v.type, 'l');
+}
+
+static void args_wrong_type(void **state)
+{
+    struct krpc_msg msg;
+
+    assert_int_equal(parse("d1:al2:id20:abcdefghij0123456789e1:y1:qe",
+                           &msg), 0);
+    assert_int_equal(msg.a.type, 'l');
+    assert_int_equal(msg.args.id.type, 0);
+
+    assert_int_equal(parse("d1:r5:hello1:y1:re", &msg), 0);
+    assert_int_equal(msg.r.type, 's');
+    assert_int_equal(msg.args.id.type, 0);
+
+    assert_int_equal(parse("d1:ai42e1:y1:qe", &msg), 0);
+    assert_int_equal(msg.a.type, 'i');
+}
+
+static void args_and_values(void **state)
+{
+    struct krpc_msg msg;
+
+    /* Arguments and values would share msg.args */
+    assert_int_equal(parse("d1:ad2:id20:abcdefghij0123456789e"
+                           "1:rd2:id20:mnopqrstuvwxyz012345e1:y1:re",
+                           &msg), -1);
+    assert_int_equal(parse("d1:ad2:id20:abcdefghij0123456789e"
+                           "1:ad2:id20:mnopqrstuvwxyz012345e1:y1:qe",
+                           &msg), -1);
+    assert_int_equal(parse("d1:ali1ee1:rd2:id20:abcdefghij0123456789e"
+                           "1:y1:re", &msg), -1);
+}
+
+static void trailing_bytes(void **state)
+{
+    struct krpc_msg msg;
+
+    /* Ignored, as by bdecode_buf() */
+    assert_int_equal(parse("d1:t2:aa1:y1:qejunk", &msg), 0);
+    assert_true(krpc_string_eq(&msg.y, "q"));
+    assert_int_equal(parse("d1:t2:aa1:y1:qed1:y1:re", &msg), 0);
+    assert_true(krpc_string_eq(&msg.y, "q"));
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(query),
+        cmocka_unit_test(response_values),
+        cmocka_unit_test(truncated),
+        cmocka_unit_test(malformed),
+        cmocka_unit_test(non_string_fields),
+        cmocka_unit_test(deep_nesting),
+        cmocka_unit_test(args_wrong_type),
+        cmocka_unit_test(args_and_values),
+        cmocka_unit_test(trailing_bytes),
+    };
+
+    return cmocka_run_group_tests_name("krpc", tests, NULL, NULL);
+}
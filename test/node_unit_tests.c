@@ -0,0 +1,609 @@
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cmocka.h>
+
+#include "../lib/node.c"
+
+static void output(const unsigned char *data, size_t len,
+                   const struct sockaddr *dest, socklen_t addrlen,
+                   void *opaque)
+{
+}
+
+static void endpoint_v4(struct dht_endpoint *ep, unsigned int i)
+{
+    memset(ep, 0, sizeof(*ep));
+    ep->family = AF_INET;
+    ep->addr[0] = 10;
+    ep->addr[1] = (i >> 16) & 0xff;
+    ep->addr[2] = (i >> 8) & 0xff;
+    ep->addr[3] = i & 0xff;
+    ep->port[0] = 0x1a;
+    ep->port[1] = 0xe1;
+}
+
+/* Add count random IPv4 nodes, enough to split the routing table */
+static void fill_table(struct dht_node *n, unsigned int count)
+{
+    struct dht_endpoint ep;
+    unsigned char id[20];
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        gen_random_bytes(id, sizeof(id));
+        endpoint_v4(&ep, i + 1);
+        insert_node(n, id, &ep, &n->now);
+    }
+}
+
+/* Random ID sharing exactly cpl leading bits with the node ID */
+static void prefix_id(const struct dht_node *n, size_t cpl, unsigned char *id)
+{
+    size_t byte = cpl / 8;
+    unsigned char before = 0xFF00 >> (cpl % 8);
+    unsigned char bit = 0x80 >> (cpl % 8);
+
+    gen_random_bytes(id, 20);
+    memcpy(id, n->id, byte);
+    id[byte] = (n->id[byte] & before) | (id[byte] & ~before);
+    id[byte] = (id[byte] & ~bit) | (~n->id[byte] & bit);
+}
+
+/* Node i with an ID sharing cpl bits, seen at second i */
+static void prefix_entry(const struct dht_node *n, size_t cpl, unsigned int i,
+                         struct bucket_entry *e)
+{
+    memset(e, 0, sizeof(*e));
+    prefix_id(n, cpl, e->id);
+    endpoint_v4(&e->addr, i);
+    e->last_seen = n->now;
+    e->last_seen.tv_sec += i;
+}
+
+static void insert_prefix(struct dht_node *n, size_t cpl, unsigned int i,
+                          struct bucket_entry *e)
+{
+    prefix_entry(n, cpl, i, e);
+    insert_node(n, e->id, &e->addr, &e->last_seen);
+}
+
+/* Every bucket within its size, sorted and holding its own prefix only */
+static void check_table(struct dht_node *n, const struct routing_table *t)
+{
+    size_t i, j, pos;
+
+    for (i = 0; i < t->bucket_count; i++) {
+        struct bucket *b = t->buckets[i];
+
+        assert_int_equal(b->size, bucket_size(n, i));
+        assert_true(b->cnt <= b->size);
+        for (j = 0; j < b->cnt; j++) {
+            if (j > 0)
+                assert_true(memcmp(b->nodes[j - 1].id, b->nodes[j].id,
+                                   20) < 0);
+            assert_int_equal(bucket_index(n, t, b->nodes[j].id), i);
+            assert_true(bucket_find(b, b->nodes[j].id, &pos));
+            assert_int_equal(pos, j);
+        }
+        for (j = 0; j < b->rcnt; j++)
+            assert_int_equal(bucket_index(n, t, b->replacements[j].id), i);
+    }
+}
+
+static int setup(void **state)
+{
+    struct dht_node *n = malloc(sizeof(struct dht_node));
+
+    assert_non_null(n);
+    assert_int_equal(dht_node_init(n, NULL, output, NULL), 0);
+    *state = n;
+
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    struct dht_node *n = *state;
+
+    dht_node_cleanup(n);
+    free(n);
+
+    return 0;
+}
+
+static void snapshot_shared(void **state)
+{
+    struct dht_node *n = *state;
+    struct dht_snapshot *s1, *s2;
+    size_t i, k;
+
+    fill_table(n, 200);
+    assert_true(n->tables[0].bucket_count > 1);
+
+    s1 = dht_node_snapshot(n);
+    assert_non_null(s1);
+    s2 = dht_node_snapshot(n);
+    assert_non_null(s2);
+
+    /* Held by the bucket and by both snapshots */
+    for (k = 0; k < 2; k++) {
+        assert_int_equal(s1->bucket_count[k], n->tables[k].bucket_count);
+        assert_int_equal(s2->bucket_count[k], n->tables[k].bucket_count);
+        for (i = 0; i < s1->bucket_count[k]; i++) {
+            assert_true(s1->buckets[k][i] == s2->buckets[k][i]);
+            assert_true(n->tables[k].buckets[i]->snap == s1->buckets[k][i]);
+            assert_int_equal(s1->buckets[k][i]->refcnt, 3);
+        }
+    }
+
+    dht_snapshot_unref(s1);
+    dht_snapshot_unref(s2);
+
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < n->tables[k].bucket_count; i++)
+            assert_int_equal(n->tables[k].buckets[i]->snap->refcnt, 1);
+    }
+}
+
+static void snapshot_dirty(void **state)
+{
+    struct dht_node *n = *state;
+    struct routing_table *t = &n->tables[0];
+    struct dht_snapshot *s1, *s2;
+    struct bucket *b = NULL;
+    struct timeval seen;
+    size_t i, j;
+
+    fill_table(n, 200);
+
+    s1 = dht_node_snapshot(n);
+    assert_non_null(s1);
+
+    for (i = 0; i < t->bucket_count; i++) {
+        if (t->buckets[i]->cnt) {
+            b = t->buckets[i];
+            break;
+        }
+    }
+    assert_non_null(b);
+
+    /* Seeing a node again changes its bucket only */
+    seen = n->now;
+    seen.tv_sec += 10;
+    insert_node(n, b->nodes[0].id, &b->nodes[0].addr, &seen);
+    assert_null(b->snap);
+
+    s2 = dht_node_snapshot(n);
+    assert_non_null(s2);
+
+    for (j = 0; j < t->bucket_count; j++) {
+        if (j == i) {
+            assert_true(s1->buckets[0][j] != s2->buckets[0][j]);
+            assert_int_equal(s1->buckets[0][j]->refcnt, 1);
+            assert_int_equal(s2->buckets[0][j]->refcnt, 2);
+        } else {
+            assert_true(s1->buckets[0][j] == s2->buckets[0][j]);
+            assert_int_equal(s1->buckets[0][j]->refcnt, 3);
+        }
+    }
+    assert_int_equal(s2->buckets[0][i]->cnt, b->cnt);
+    assert_memory_equal(s2->buckets[0][i]->nodes[0].id, b->nodes[0].id, 20);
+    assert_int_equal(s2->buckets[0][i]->nodes[0].last_seen.tv_sec,
+                     seen.tv_sec);
+    assert_int_equal(s1->buckets[0][i]->nodes[0].last_seen.tv_sec,
+                     n->now.tv_sec);
+
+    /* Older snapshot released first */
+    dht_snapshot_unref(s1);
+    assert_int_equal(s2->buckets[0][i]->refcnt, 2);
+    dht_snapshot_unref(s2);
+}
+
+static void snapshot_outlives_node(void **state)
+{
+    struct dht_node *n = *state;
+    struct dht_snapshot *s1, *s2;
+    struct dht_snapshot_iter it;
+    size_t count = 0;
+
+    fill_table(n, 200);
+
+    s1 = dht_node_snapshot(n);
+    assert_non_null(s1);
+    assert_true(dht_snapshot_ref(s1) == s1);
+    s2 = dht_node_snapshot(n);
+    assert_non_null(s2);
+
+    /* Newer snapshot released first, the other one after the node */
+    dht_snapshot_unref(s2);
+    dht_node_cleanup(n);
+    assert_int_equal(dht_node_init(n, NULL, output, NULL), 0);
+
+    dht_snapshot_unref(s1);
+    dht_snapshot_iter_init(&it, s1);
+    while (dht_snapshot_next(&it))
+        count++;
+    assert_int_equal(count, dht_snapshot_node_count(s1, AF_INET));
+    assert_true(count > 0);
+    dht_snapshot_unref(s1);
+}
+
+static void contacts_verify_new(void **state)
+{
+    struct dht_node *n = *state;
+    struct dht_contact c[2];
+    struct timeval now, later;
+    size_t i;
+
+    for (i = 0; i < 2; i++) {
+        gen_random_bytes(c[i].id, 20);
+        endpoint_v4(&c[i].addr, i + 1);
+    }
+
+    /* The first contact is already a live node */
+    insert_node(n, c[0].id, &c[0].addr, &n->now);
+
+    assert_int_equal(dht_node_add_contacts(n, c, 2, 1), 1);
+    assert_non_null(n->contacts);
+    assert_int_equal(n->contacts->count, 1);
+    assert_memory_equal(n->contacts->contacts[0].c.id, c[1].id, 20);
+
+    /* Ping sent, no answer before the timeout */
+    gettimeofday(&now, NULL);
+    contacts_expired(n, n->contacts, &now);
+    timeradd(&now, &ping_timeout, &later);
+    later.tv_sec++;
+    contacts_expired(n, n->contacts, &later);
+
+    assert_null(n->contacts);
+    assert_true(contact_known(n, &c[0]));
+    assert_false(contact_known(n, &c[1]));
+}
+
+static void contacts_known_only(void **state)
+{
+    struct dht_node *n = *state;
+    struct dht_contact c;
+
+    gen_random_bytes(c.id, 20);
+    endpoint_v4(&c.addr, 1);
+    insert_node(n, c.id, &c.addr, &n->now);
+
+    /* Nothing to verify, the same contact twice is queued once */
+    assert_int_equal(dht_node_add_contacts(n, &c, 1, 1), 0);
+    assert_int_equal(n->contacts->count, 0);
+
+    gen_random_bytes(c.id, 20);
+    endpoint_v4(&c.addr, 2);
+    assert_int_equal(dht_node_add_contacts(n, (struct dht_contact[]){ c, c },
+                                           2, 1), 1);
+    assert_int_equal(n->contacts->count, 1);
+}
+
+static void contacts_presplit(void **state)
+{
+    struct dht_node *n = *state;
+    struct routing_table *t = &n->tables[0];
+    struct dht_contact c[BUCKET_ENTRY_MAX + 2];
+    size_t i;
+
+    for (i = 0; i < BUCKET_ENTRY_MAX; i++) {
+        gen_random_bytes(c[i].id, 20);
+        endpoint_v4(&c[i].addr, i + 1);
+    }
+    for (i = 0; i < BUCKET_ENTRY_MAX / 2; i++)
+        insert_node(n, c[i].id, &c[i].addr, &n->now);
+
+    /* Known contacts and duplicates fit in the bucket they are already in */
+    c[BUCKET_ENTRY_MAX] = c[BUCKET_ENTRY_MAX - 1];
+    c[BUCKET_ENTRY_MAX + 1] = c[0];
+    assert_int_equal(dht_node_add_contacts(n, c, BUCKET_ENTRY_MAX + 2, 0),
+                     BUCKET_ENTRY_MAX / 2);
+    assert_int_equal(t->bucket_count, 1);
+    assert_int_equal(t->buckets[0]->cnt, BUCKET_ENTRY_MAX);
+}
+
+/* Fill bucket 0, then split it off with a closer node */
+static struct bucket *full_bucket(struct dht_node *n, struct bucket_entry *e)
+{
+    struct routing_table *t = &n->tables[0];
+    struct bucket_entry closer;
+    size_t i;
+
+    for (i = 0; i < BUCKET_ENTRY_MAX; i++)
+        insert_prefix(n, 0, i + 1, &e[i]);
+    insert_prefix(n, 1, 100, &closer);
+
+    assert_int_equal(t->bucket_count, 2);
+    assert_int_equal(t->buckets[0]->cnt, BUCKET_ENTRY_MAX);
+    assert_int_equal(t->buckets[0]->rcnt, 0);
+
+    return t->buckets[0];
+}
+
+static void replacement_full_bucket(void **state)
+{
+    struct dht_node *n = *state;
+    struct bucket_entry e[BUCKET_ENTRY_MAX + REPLACEMENT_MAX + 2];
+    struct bucket *b = full_bucket(n, e);
+    struct timeval seen;
+    size_t i, pos;
+
+    /* Newcomers wait in the cache, least recently seen first */
+    for (i = BUCKET_ENTRY_MAX; i < BUCKET_ENTRY_MAX + 3; i++)
+        insert_prefix(n, 0, i + 1, &e[i]);
+    assert_int_equal(b->cnt, BUCKET_ENTRY_MAX);
+    assert_int_equal(b->rcnt, 3);
+    for (i = 0; i < 3; i++) {
+        assert_false(bucket_find(b, e[BUCKET_ENTRY_MAX + i].id, &pos));
+        assert_memory_equal(b->replacements[i].id,
+                            e[BUCKET_ENTRY_MAX + i].id, 20);
+    }
+
+    /* Seeing a candidate again makes it the most recent one */
+    seen = n->now;
+    seen.tv_sec += 1000;
+    insert_node(n, e[BUCKET_ENTRY_MAX].id, &e[BUCKET_ENTRY_MAX].addr, &seen);
+    assert_int_equal(b->rcnt, 3);
+    assert_memory_equal(b->replacements[0].id, e[BUCKET_ENTRY_MAX + 1].id, 20);
+    assert_memory_equal(b->replacements[2].id, e[BUCKET_ENTRY_MAX].id, 20);
+    assert_int_equal(b->replacements[2].last_seen.tv_sec, seen.tv_sec);
+
+    /* Once full, the least recently seen candidates are dropped */
+    for (i = BUCKET_ENTRY_MAX + 3; i < BUCKET_ENTRY_MAX + REPLACEMENT_MAX + 2;
+         i++)
+        insert_prefix(n, 0, i + 1, &e[i]);
+    assert_int_equal(b->cnt, BUCKET_ENTRY_MAX);
+    assert_int_equal(b->rcnt, REPLACEMENT_MAX);
+    assert_memory_equal(b->replacements[0].id, e[BUCKET_ENTRY_MAX].id, 20);
+    for (i = 1; i < REPLACEMENT_MAX; i++)
+        assert_memory_equal(b->replacements[i].id,
+                            e[BUCKET_ENTRY_MAX + 2 + i].id, 20);
+    check_table(n, &n->tables[0]);
+}
+
+static void replacement_promote_gc(void **state)
+{
+    struct dht_node *n = *state;
+    struct bucket_entry e[BUCKET_ENTRY_MAX], older, newer;
+    struct bucket *b = full_bucket(n, e);
+    struct timeval now;
+    size_t i, pos;
+
+    insert_prefix(n, 0, 20, &older);
+    insert_prefix(n, 0, 21, &newer);
+    assert_int_equal(b->rcnt, 2);
+
+    /* The least recently seen node fails two pings and goes bad */
+    timeradd(&e[BUCKET_ENTRY_MAX - 1].last_seen, &bucket_node_timeout, &now);
+    for (i = 0; i < 2; i++) {
+        bucket_gc(n, b, &now);
+        assert_true(bucket_find(b, e[0].id, &pos));
+        assert_int_equal(b->nodes[pos].pinged, i + 1);
+        now = b->nodes[pos].next_ping;
+    }
+    bucket_gc(n, b, &now);
+
+    /* Replaced by the most recently seen candidate */
+    assert_false(bucket_find(b, e[0].id, &pos));
+    assert_true(bucket_find(b, newer.id, &pos));
+    assert_int_equal(b->cnt, BUCKET_ENTRY_MAX);
+    assert_int_equal(b->rcnt, 1);
+    assert_memory_equal(b->replacements[0].id, older.id, 20);
+    check_table(n, &n->tables[0]);
+}
+
+static void replacement_split(void **state)
+{
+    struct dht_node *n = *state;
+    struct routing_table *t = &n->tables[0];
+    struct bucket_entry e[BUCKET_ENTRY_MAX], c[5];
+    struct bucket *b;
+    size_t i, pos;
+
+    /* The only bucket: 6 nodes stay in bucket 0, 2 move on a split */
+    for (i = 0; i < BUCKET_ENTRY_MAX; i++)
+        insert_prefix(n, i < 6 ? 0 : 1, i + 1, &e[i]);
+    assert_int_equal(t->bucket_count, 1);
+
+    /* Candidates for both halves, c[2] and c[4] most recently seen */
+    b = t->buckets[0];
+    for (i = 0; i < 5; i++) {
+        prefix_entry(n, i < 3 ? 0 : 3, 20 + i, &c[i]);
+        replacement_add(b, &c[i]);
+    }
+
+    assert_int_equal(split_last_bucket(n, t), 0);
+    assert_int_equal(t->bucket_count, 2);
+    check_table(n, t);
+
+    /* Room for two more in bucket 0, c[0] still waits */
+    b = t->buckets[0];
+    assert_int_equal(b->cnt, BUCKET_ENTRY_MAX);
+    assert_true(bucket_find(b, c[1].id, &pos));
+    assert_true(bucket_find(b, c[2].id, &pos));
+    assert_int_equal(b->rcnt, 1);
+    assert_memory_equal(b->replacements[0].id, c[0].id, 20);
+
+    b = t->buckets[1];
+    assert_int_equal(b->cnt, 4);
+    assert_true(bucket_find(b, e[6].id, &pos));
+    assert_true(bucket_find(b, e[7].id, &pos));
+    assert_true(bucket_find(b, c[3].id, &pos));
+    assert_true(bucket_find(b, c[4].id, &pos));
+    assert_int_equal(b->rcnt, 0);
+}
+
+static void wide_split(void **state)
+{
+    struct dht_node *n = *state;
+    struct routing_table *t = &n->tables[0];
+    struct bucket_entry e, c;
+    size_t i, pos;
+
+    assert_int_equal(dht_node_set_routing_mode(n, DHT_ROUTING_WIDE), 0);
+    assert_int_equal(t->buckets[0]->size, 128);
+
+    /* Bucket 0 full of closer nodes, twice what bucket 1 will hold */
+    for (i = 0; i < 128; i++)
+        insert_prefix(n, 1 + i % 4, i + 1, &e);
+    assert_int_equal(t->bucket_count, 1);
+    assert_int_equal(t->buckets[0]->cnt, 128);
+
+    /* The split moves 64 of them, the others become candidates */
+    insert_prefix(n, 0, 200, &c);
+    assert_int_equal(t->bucket_count, 2);
+    assert_int_equal(t->buckets[0]->cnt, 1);
+    assert_true(bucket_find(t->buckets[0], c.id, &pos));
+    assert_int_equal(t->buckets[1]->size, 64);
+    assert_int_equal(t->buckets[1]->cnt, 64);
+    assert_int_equal(t->buckets[1]->rcnt, REPLACEMENT_MAX);
+    check_table(n, t);
+}
+
+static void wide_table(void **state)
+{
+    static const size_t sizes[] = { 128, 64, 32, 16 };
+    struct dht_node *n = *state;
+    struct routing_table *t = &n->tables[0];
+    size_t i;
+
+    assert_int_equal(dht_node_set_routing_mode(n, DHT_ROUTING_WIDE), 0);
+    fill_table(n, 4000);
+    assert_true(t->bucket_count > 4);
+    check_table(n, t);
+
+    for (i = 0; i < t->bucket_count; i++) {
+        struct bucket *b = t->buckets[i];
+
+        if (i < 4) {
+            assert_int_equal(b->size, sizes[i]);
+            assert_int_equal(b->cnt, sizes[i]);
+        } else
+            assert_int_equal(b->size, BUCKET_ENTRY_MAX);
+    }
+}
+
+/* No empty slot between an entry and its home slot, every query found */
+static void check_queries(struct dht_node *n, struct search_node *sn,
+                          size_t count)
+{
+    size_t mask = n->query_cap - 1;
+    size_t i, j, used = 0, pending = 0;
+
+    for (i = 0; i < n->query_cap; i++) {
+        if (!n->queries[i].search)
+            continue;
+        used++;
+        for (j = n->queries[i].tid & mask; j != i; j = (j + 1) & mask)
+            assert_non_null(n->queries[j].search);
+    }
+    assert_int_equal(used, n->query_count);
+
+    for (i = 0; i < count; i++) {
+        struct pending_query *q = query_find(n, sn[i].tid);
+
+        if (!sn[i].pending) {
+            assert_true(!q || q->sn != &sn[i]);
+            continue;
+        }
+        assert_non_null(q);
+        assert_true(q->sn == &sn[i]);
+        pending++;
+    }
+    assert_int_equal(pending, n->query_count);
+}
+
+static void query_table(void **state)
+{
+    static struct search_node sn[24];
+    struct dht_node *n = *state;
+    struct search s;
+    size_t i, k;
+
+    memset(&s, 0, sizeof(s));
+
+    for (i = 0; i < 20000; i++) {
+        struct search_node *p = &sn[rand() % 24];
+
+        if (p->pending) {
+            query_remove(n, query_find(n, p->tid));
+        } else {
+            /* Home slots around the end of the table, chains wrap */
+            n->tid = QUERY_TABLE_MIN - 4 + rand() % 8 +
+                     QUERY_TABLE_MIN * (rand() % 4);
+            assert_int_equal(query_add(n, &s, p, &n->now), 0);
+        }
+        check_queries(n, sn, 24);
+        assert_int_equal(n->query_cap, QUERY_TABLE_MIN);
+    }
+
+    /* Other queries never reuse the ID of a pending one */
+    for (i = 0; i < 24; i++) {
+        if (!sn[i].pending)
+            continue;
+        n->tid = sn[i].tid;
+        assert_int_not_equal(next_tid(n), sn[i].tid);
+    }
+
+    for (i = 0; i < 24; i++)
+        query_forget(n, &sn[i]);
+    assert_int_equal(n->query_count, 0);
+    for (k = 0; k < n->query_cap; k++)
+        assert_null(n->queries[k].search);
+}
+
+static void query_table_grow_rehash(void **state)
+{
+    static struct search_node sn[200];
+    struct dht_node *n = *state;
+    struct search s;
+    size_t i;
+
+    memset(&s, 0, sizeof(s));
+
+    for (i = 0; i < 200; i++) {
+        n->tid = rand() % 16;
+        assert_int_equal(query_add(n, &s, &sn[i], &n->now), 0);
+    }
+    assert_true(n->query_cap >= 2 * 200);
+    check_queries(n, sn, 200);
+
+    for (i = 0; i < 200; i += 2)
+        query_forget(n, &sn[i]);
+    check_queries(n, sn, 200);
+
+    for (i = 1; i < 200; i += 2)
+        query_forget(n, &sn[i]);
+    assert_int_equal(n->query_count, 0);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(snapshot_shared, setup, teardown),
+        cmocka_unit_test_setup_teardown(snapshot_dirty, setup, teardown),
+        cmocka_unit_test_setup_teardown(snapshot_outlives_node, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(contacts_verify_new, setup, teardown),
+        cmocka_unit_test_setup_teardown(contacts_known_only, setup, teardown),
+        cmocka_unit_test_setup_teardown(contacts_presplit, setup, teardown),
+        cmocka_unit_test_setup_teardown(replacement_full_bucket, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(replacement_promote_gc, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(replacement_split, setup, teardown),
+        cmocka_unit_test_setup_teardown(wide_split, setup, teardown),
+        cmocka_unit_test_setup_teardown(wide_table, setup, teardown),
+        cmocka_unit_test_setup_teardown(query_table, setup, teardown),
+        cmocka_unit_test_setup_teardown(query_table_grow_rehash, setup,
+                                        teardown),
+    };
+
+    return cmocka_run_group_tests_name("node", tests, NULL, NULL);
+}
@@ -0,0 +1,794 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cmocka.h>
+
+/* The nodes run on a virtual clock */
+static struct timeval vnow;
+
+static int virtual_gettimeofday(struct timeval *tv)
+{
+    *tv = vnow;
+    return 0;
+}
+
+/* Make the n-th allocation of the node from now fail, 0 for none */
+static int malloc_fail, calloc_fail;
+
+static void *failing_malloc(size_t size)
+{
+    if (malloc_fail && !--malloc_fail)
+        return NULL;
+    return malloc(size);
+}
+
+static void *failing_calloc(size_t nmemb, size_t size)
+{
+    if (calloc_fail && !--calloc_fail)
+        return NULL;
+    return calloc(nmemb, size);
+}
+
+#define gettimeofday(tv, tz) virtual_gettimeofday(tv)
+#define malloc(size) failing_malloc(size)
+#define calloc(nmemb, size) failing_calloc(nmemb, size)
+#include "../lib/node.c"
+#undef calloc
+#undef malloc
+#undef gettimeofday
+
+/*
+ * Small network of nodes exchanging datagrams in memory. Node i listens on
+ * 10.0.0.(i + 1). Datagrams sent to a muted node are lost, the ones sent to
+ * a held node wait for release(). Node 0 runs the searches, the other nodes
+ * know each other.
+ */
+#define NODES 24
+#define QUEUE_MAX 1024
+
+enum { DELIVER, MUTED, HELD };
+
+struct datagram {
+    int from, to;
+    size_t len;
+    unsigned char data[1500];
+};
+
+static struct dht_node nodes[NODES];
+static int muted[NODES];
+static size_t queries[NODES];
+static size_t queried[NODES];
+static struct datagram queue[QUEUE_MAX];
+static size_t qhead, qtail;
+static struct datagram held[QUEUE_MAX];
+static size_t nheld;
+
+static void output(const unsigned char *data, size_t len,
+                   const struct sockaddr *dest, socklen_t addrlen,
+                   void *opaque)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)dest;
+    int from = (int)(intptr_t)opaque;
+    const unsigned char *ip;
+    struct krpc_msg msg;
+    struct datagram *d;
+    unsigned int to;
+
+    assert_int_equal(dest->sa_family, AF_INET);
+    assert_true(len <= sizeof(d->data));
+
+    ip = (const unsigned char *)&sin->sin_addr;
+    to = ip[0] == 10 ? ip[3] - 1 : NODES;
+
+    if (!krpc_parse(data, len, &msg) && krpc_string_eq(&msg.y, "q")) {
+        queries[from]++;
+        if (to < NODES)
+            queried[to]++;
+    }
+
+    if (to >= NODES || muted[to] == MUTED)
+        return;
+
+    if (muted[to] == HELD) {
+        assert_true(nheld < QUEUE_MAX);
+        d = &held[nheld++];
+    } else {
+        assert_true(qtail - qhead < QUEUE_MAX);
+        d = &queue[qtail++ % QUEUE_MAX];
+    }
+    d->from = from;
+    d->to = to;
+    d->len = len;
+    memcpy(d->data, data, len);
+}
+
+static void node_addr(struct sockaddr_in *sin, int i)
+{
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(6881);
+    sin->sin_addr.s_addr = htonl(0x0a000000 | (i + 1));
+}
+
+static void deliver(void)
+{
+    struct datagram d;
+    struct sockaddr_in sin;
+
+    while (qhead != qtail) {
+        d = queue[qhead++ % QUEUE_MAX];
+        node_addr(&sin, d.from);
+        dht_node_input(&nodes[d.to], d.data, d.len,
+                       (struct sockaddr *)&sin, sizeof(sin));
+    }
+}
+
+/* Deliver the held datagrams from now on */
+static void release(void)
+{
+    size_t i;
+
+    for (i = 0; i < NODES; i++) {
+        if (muted[i] == HELD)
+            muted[i] = DELIVER;
+    }
+
+    for (i = 0; i < nheld; i++) {
+        assert_true(qtail - qhead < QUEUE_MAX);
+        queue[qtail++ % QUEUE_MAX] = held[i];
+    }
+    nheld = 0;
+
+    deliver();
+}
+
+/* Let node 'of' know node i */
+static void learn(int of, int i)
+{
+    struct sockaddr_in sin;
+    struct dht_endpoint ep;
+
+    node_addr(&sin, i);
+    assert_int_equal(endpoint_from_sockaddr(&ep, (struct sockaddr *)&sin,
+                                            sizeof(sin)), 0);
+    insert_node(&nodes[of], nodes[i].id, &ep, &vnow);
+}
+
+/* Node ID matching the address, the reported IP never changes it */
+static void node_id(unsigned char id[20], int i)
+{
+    unsigned char ip[4] = { 10, 0, 0, i + 1 };
+    uint32_t prefix;
+
+    gen_random_bytes(id, 20);
+    prefix = compute_id_prefix(AF_INET, ip, id[19] & 0x7);
+    id[0] = prefix >> 24;
+    id[1] = (prefix >> 16) & 0xff;
+    id[2] = ((prefix >> 8) & 0xf8) | (id[2] & 0x7);
+}
+
+static int setup(void **state)
+{
+    unsigned char id[20];
+    int i, j;
+
+    vnow.tv_sec = 1000000;
+    vnow.tv_usec = 0;
+    qhead = qtail = 0;
+    nheld = 0;
+    memset(muted, 0, sizeof(muted));
+    memset(queries, 0, sizeof(queries));
+    memset(queried, 0, sizeof(queried));
+
+    for (i = 0; i < NODES; i++) {
+        node_id(id, i);
+        if (dht_node_init(&nodes[i], id, output, (void *)(intptr_t)i))
+            return -1;
+        /* Large enough buckets to hold the whole network */
+        if (dht_node_set_routing_mode(&nodes[i], DHT_ROUTING_WIDE))
+            return -1;
+    }
+
+    for (i = 1; i < NODES; i++) {
+        for (j = 1; j < NODES; j++)
+            learn(i, j);
+    }
+
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    int i;
+
+    for (i = 0; i < NODES; i++)
+        dht_node_cleanup(&nodes[i]);
+
+    return 0;
+}
+
+static void advance(unsigned int ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    timeradd(&vnow, &tv, &vnow);
+}
+
+/* Copy of the results passed to the completion callback */
+static int done;
+static size_t result_count;
+static unsigned char result_ids[SEARCH_FRONTIER_MAX][20];
+static int result_replied[SEARCH_FRONTIER_MAX];
+
+static void search_done(struct dht_node *n, const struct search_node *sn,
+                        void *opaque)
+{
+    done++;
+    for (result_count = 0; sn; sn = sn->next, result_count++) {
+        memcpy(result_ids[result_count], sn->id, 20);
+        result_replied[result_count] = timerisset(&sn->reply_time);
+    }
+}
+
+static dht_search_t start(const unsigned char target[20])
+{
+    dht_search_t h;
+
+    done = 0;
+    assert_int_equal(dht_node_search(&nodes[0], target, FIND_NODE,
+                                     search_done, NULL, &h), 0);
+
+    return h;
+}
+
+/* Node closest to target after 'rank' closer ones, node 0 aside */
+static int closest(const unsigned char target[20], int rank)
+{
+    unsigned char d[NODES][20];
+    int order[NODES];
+    int i, j, tmp;
+
+    for (i = 1; i < NODES; i++) {
+        distance(nodes[i].id, target, d[i]);
+        order[i] = i;
+    }
+    for (i = 2; i < NODES; i++) {
+        for (j = i; j > 1 && memcmp(d[order[j]], d[order[j - 1]], 20) < 0;
+             j--) {
+            tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+    }
+
+    return order[rank + 1];
+}
+
+static void alpha_limit(void **state)
+{
+    unsigned char target[20];
+    int i;
+
+    for (i = 1; i <= 12; i++) {
+        muted[i] = MUTED;
+        learn(0, i);
+    }
+
+    gen_random_bytes(target, 20);
+    start(target);
+
+    /* No more than SEARCH_ALPHA queries in flight */
+    assert_int_equal(queries[0], SEARCH_ALPHA);
+    assert_int_equal(nodes[0].query_count, SEARCH_ALPHA);
+    advance(SEARCH_STALE_MIN - 1);
+    dht_node_work(&nodes[0]);
+    assert_int_equal(queries[0], SEARCH_ALPHA);
+
+    /* Stale queries no longer count, the next nodes are queried */
+    advance(SEARCH_STALE_MAX);
+    dht_node_work(&nodes[0]);
+    assert_int_equal(queries[0], 2 * SEARCH_ALPHA);
+
+    /* Late responses to the stale queries are still expected */
+    assert_int_equal(nodes[0].query_count, 2 * SEARCH_ALPHA);
+    assert_false(done);
+}
+
+static void stale_late_response(void **state)
+{
+    unsigned char target[20];
+    int i;
+
+    for (i = 1; i <= 8; i++) {
+        muted[i] = HELD;
+        learn(0, i);
+    }
+
+    gen_random_bytes(target, 20);
+    start(target);
+    advance(SEARCH_STALE_MAX + 1);
+    dht_node_work(&nodes[0]);
+    assert_int_equal(queries[0], 8);
+
+    /* The responses to the stale queries still count */
+    release();
+    assert_int_equal(done, 1);
+    for (i = 0; i < SEARCH_RESULT_MAX; i++) {
+        assert_memory_equal(result_ids[i], nodes[closest(target, i)].id, 20);
+        assert_true(result_replied[i]);
+    }
+
+    /* Stale nodes were not queried again */
+    for (i = 1; i <= 8; i++)
+        assert_int_equal(queried[i], 1);
+}
+
+static void completion(void **state)
+{
+    unsigned char target[20];
+    int i;
+
+    for (i = 1; i <= 3; i++)
+        learn(0, i);
+
+    gen_random_bytes(target, 20);
+    start(target);
+    deliver();
+
+    /* The SEARCH_RESULT_MAX closest nodes of the network replied */
+    assert_int_equal(done, 1);
+    assert_true(result_count >= SEARCH_RESULT_MAX);
+    for (i = 0; i < SEARCH_RESULT_MAX; i++) {
+        assert_memory_equal(result_ids[i], nodes[closest(target, i)].id, 20);
+        assert_true(result_replied[i]);
+    }
+    assert_int_equal(nodes[0].query_count, 0);
+}
+
+static void query_add_failure(void **state)
+{
+    unsigned char target[20];
+    int i;
+
+    for (i = 1; i <= 3; i++)
+        learn(0, i);
+
+    /* No room for the query to the closest node, nothing else is sent */
+    gen_random_bytes(target, 20);
+    calloc_fail = 1;
+    start(target);
+    assert_int_equal(calloc_fail, 0);
+    assert_int_equal(queries[0], 0);
+
+    /* Sent at the next iteration, closest node first */
+    advance(search_iteration_timeout.tv_sec * 1000 +
+            search_iteration_timeout.tv_usec / 1000);
+    dht_node_work(&nodes[0]);
+    assert_int_equal(queries[0], 3);
+    deliver();
+    assert_int_equal(done, 1);
+    for (i = 0; i < SEARCH_RESULT_MAX; i++)
+        assert_memory_equal(result_ids[i], nodes[closest(target, i)].id, 20);
+}
+
+static void completion_waits(void **state)
+{
+    unsigned char target[20];
+    int i;
+
+    for (i = 1; i <= 3; i++)
+        learn(0, i);
+
+    /* The closest node never answers */
+    memcpy(target, nodes[NODES - 1].id, 20);
+    target[19] ^= 1;
+    muted[NODES - 1] = MUTED;
+
+    start(target);
+    deliver();
+
+    /* Enough replies, but a closer query is in flight */
+    assert_false(done);
+    assert_int_equal(nodes[0].query_count, 1);
+
+    advance(SEARCH_STALE_MAX + 1);
+    dht_node_work(&nodes[0]);
+
+    /* Once it is stale, the nodes that replied are enough */
+    assert_int_equal(done, 1);
+    assert_memory_equal(result_ids[0], nodes[NODES - 1].id, 20);
+    assert_false(result_replied[0]);
+    for (i = 1; i <= SEARCH_RESULT_MAX; i++) {
+        assert_memory_equal(result_ids[i], nodes[closest(target, i)].id, 20);
+        assert_true(result_replied[i]);
+    }
+}
+
+/* Sorted by distance, chained in the same order */
+static void check_frontier(const struct search *s)
+{
+    const struct search_node *sn = s->queue;
+    unsigned char dist[20];
+    size_t i;
+
+    for (i = 0; i < s->node_count; i++) {
+        if (i > 0)
+            assert_true(memcmp(s->frontier[i - 1].dist,
+                               s->frontier[i].dist, 20) < 0);
+        distance(s->frontier[i].sn->id, s->id, dist);
+        assert_memory_equal(s->frontier[i].dist, dist, 20);
+        assert_true(sn == s->frontier[i].sn);
+        sn = sn->next;
+    }
+    assert_null(sn);
+}
+
+static void frontier_eviction(void **state)
+{
+    unsigned char target[20], id[20], furthest[20];
+    struct dht_endpoint ep;
+    struct search_node *sn;
+    dht_search_t h;
+    struct search *s;
+    int i;
+
+    for (i = 1; i <= 8; i++) {
+        muted[i] = MUTED;
+        learn(0, i);
+    }
+
+    gen_random_bytes(target, 20);
+    h = start(target);
+    s = h->search;
+    assert_int_equal(s->node_count, 8);
+    assert_int_equal(nodes[0].query_count, SEARCH_ALPHA);
+
+    memset(&ep, 0, sizeof(ep));
+    ep.family = AF_INET;
+    ep.addr[0] = 192;
+    ep.addr[1] = 0;
+    ep.addr[2] = 2;
+
+    /* Closer than the seeds, which are evicted */
+    for (i = 0; i < SEARCH_FRONTIER_MAX; i++) {
+        memcpy(id, target, 20);
+        id[18] ^= 1;
+        id[19] = i;
+        ep.addr[3] = i;
+        assert_non_null(add_search_node(&nodes[0], s, id, &ep, 0));
+        check_frontier(s);
+        assert_true(s->node_count <= SEARCH_FRONTIER_MAX);
+    }
+    assert_int_equal(s->node_count, SEARCH_FRONTIER_MAX);
+
+    /* The seeds are gone, with their pending queries */
+    for (i = 1; i <= 8; i++) {
+        for (sn = s->queue; sn; sn = sn->next)
+            assert_true(memcmp(sn->id, nodes[i].id, 20));
+    }
+    assert_int_equal(nodes[0].query_count, 0);
+
+    /* Further than all the nodes, or already known */
+    memcpy(id, target, 20);
+    id[0] ^= 0x80;
+    assert_null(add_search_node(&nodes[0], s, id, &ep, 0));
+    memcpy(id, target, 20);
+    id[18] ^= 1;
+    id[19] = 5;
+    assert_null(add_search_node(&nodes[0], s, id, &ep, 0));
+
+    /* A closer node takes the place of the furthest one */
+    memcpy(furthest, s->frontier[SEARCH_FRONTIER_MAX - 1].sn->id, 20);
+    memcpy(id, target, 20);
+    id[19] ^= 1;
+    assert_non_null(add_search_node(&nodes[0], s, id, &ep, 0));
+    assert_int_equal(s->node_count, SEARCH_FRONTIER_MAX);
+    assert_memory_equal(s->queue->id, id, 20);
+    check_frontier(s);
+    for (sn = s->queue; sn; sn = sn->next)
+        assert_true(memcmp(sn->id, furthest, 20));
+
+    /* The closest nodes are queried next */
+    advance(SEARCH_STALE_MAX + 1);
+    dht_node_work(&nodes[0]);
+    assert_int_equal(nodes[0].query_count, SEARCH_ALPHA);
+    for (i = 0; i < SEARCH_ALPHA; i++)
+        assert_true(s->frontier[i].sn->pending);
+}
+
+static void cache_ttl(void **state)
+{
+    unsigned char target[20];
+    struct cached_result *c;
+    struct search_node *sn;
+    struct timeval expire;
+    int i;
+
+    for (i = 1; i <= 3; i++)
+        learn(0, i);
+
+    /* Tokens would be stale long before */
+    dht_node_set_search_cache(&nodes[0], 3600);
+    assert_int_equal(nodes[0].search_cache_ttl, SEARCH_CACHE_TTL_MAX);
+
+    gen_random_bytes(target, 20);
+    done = 0;
+    assert_int_equal(dht_node_search(&nodes[0], target, GET_PEERS,
+                                     search_done, NULL, NULL), 0);
+    deliver();
+    assert_int_equal(done, 1);
+
+    /* Stamped with the time the search completed */
+    c = cache_find(&nodes[0], target, GET_PEERS, &vnow);
+    assert_non_null(c);
+    expire = vnow;
+    expire.tv_sec += SEARCH_CACHE_TTL_MAX;
+    assert_int_equal(c->timer.expire.tv_sec, expire.tv_sec);
+    assert_int_equal(c->timer.expire.tv_usec, expire.tv_usec);
+    for (i = 0, sn = c->nodes; sn; sn = sn->next)
+        i += sn->token != NULL;
+    assert_true(i >= SEARCH_RESULT_MAX);
+
+    advance(SEARCH_CACHE_TTL_MAX * 1000);
+    dht_node_work(&nodes[0]);
+    assert_null(nodes[0].search_cache);
+}
+
+static size_t cache_count(const struct dht_node *n)
+{
+    const struct cached_result *c;
+    size_t count = 0;
+
+    for (c = n->search_cache; c; c = c->next)
+        count++;
+
+    return count;
+}
+
+static void cache_store_failure(void **state)
+{
+    static struct search_node sn[SEARCH_RESULT_MAX];
+    static struct search s;
+    struct dht_node *n = &nodes[0];
+    unsigned char token[4] = "tok";
+    unsigned char oldest[20];
+    struct dht_endpoint peer;
+    struct cached_result *c;
+    struct search_node *p;
+    int i, k;
+
+    dht_node_set_search_cache(n, 60);
+
+    /* A completed search, every node returned a token and a peer */
+    memset(&peer, 0, sizeof(peer));
+    peer.family = AF_INET;
+    memset(&s, 0, sizeof(s));
+    s.search_type = GET_PEERS;
+    s.node_count = SEARCH_RESULT_MAX;
+    for (i = 0; i < SEARCH_RESULT_MAX; i++) {
+        memset(&sn[i], 0, sizeof(sn[i]));
+        gen_random_bytes(sn[i].id, 20);
+        sn[i].reply_time = vnow;
+        sn[i].token = token;
+        sn[i].token_len = sizeof(token);
+        sn[i].peers = &peer;
+        sn[i].peer_count = 1;
+        s.frontier[i].sn = &sn[i];
+    }
+
+    /* Full cache, the first entry expires first */
+    for (i = 0; i < SEARCH_CACHE_MAX; i++) {
+        s.id[0] = i;
+        cache_store(n, &s, &vnow);
+        advance(1000);
+    }
+    assert_int_equal(cache_count(n), SEARCH_CACHE_MAX);
+    memset(oldest, 0, sizeof(oldest));
+
+    /* Nothing is evicted when the entry cannot be allocated */
+    s.id[0] = 0xff;
+    malloc_fail = 1;
+    cache_store(n, &s, &vnow);
+    assert_null(cache_find(n, s.id, GET_PEERS, NULL));
+    assert_non_null(cache_find(n, oldest, GET_PEERS, NULL));
+    assert_int_equal(cache_count(n), SEARCH_CACHE_MAX);
+
+    /* Any copy failing drops the entry instead of caching part of it */
+    for (k = 2; k <= 1 + 3 * SEARCH_RESULT_MAX; k++) {
+        malloc_fail = k;
+        cache_store(n, &s, &vnow);
+        assert_int_equal(malloc_fail, 0);
+        assert_null(cache_find(n, s.id, GET_PEERS, NULL));
+    }
+    assert_null(cache_find(n, oldest, GET_PEERS, NULL));
+    assert_int_equal(cache_count(n), SEARCH_CACHE_MAX - 1);
+
+    malloc_fail = k;
+    cache_store(n, &s, &vnow);
+    malloc_fail = 0;
+    c = cache_find(n, s.id, GET_PEERS, NULL);
+    assert_non_null(c);
+    for (i = 0, p = c->nodes; p; p = p->next, i++) {
+        assert_non_null(p->token);
+        assert_int_equal(p->peer_count, 1);
+    }
+    assert_int_equal(i, SEARCH_RESULT_MAX);
+
+    /* Refreshing an entry fails the same way */
+    malloc_fail = 2;
+    cache_store(n, &s, &vnow);
+    assert_null(cache_find(n, s.id, GET_PEERS, NULL));
+    assert_int_equal(cache_count(n), SEARCH_CACHE_MAX - 1);
+}
+
+/* Completion callbacks of the requests sharing a search */
+struct request {
+    dht_search_t h;
+    int calls;
+    int order;
+    int cancel_self;
+    int found;
+    unsigned char first[20];
+};
+
+static int calls;
+
+static void request_done(struct dht_node *n, const struct search_node *sn,
+                         void *opaque)
+{
+    struct request *r = opaque;
+
+    r->calls++;
+    r->order = ++calls;
+    r->found = sn != NULL;
+    if (sn)
+        memcpy(r->first, sn->id, 20);
+    if (r->cancel_self)
+        dht_node_cancel(n, r->h);
+}
+
+static void start_request(const unsigned char target[20], struct request *r)
+{
+    assert_int_equal(dht_node_search(&nodes[0], target, FIND_NODE,
+                                     request_done, r, &r->h), 0);
+}
+
+static void join(void **state)
+{
+    unsigned char target[20];
+    struct request r[3];
+    size_t sent;
+    int i;
+
+    memset(r, 0, sizeof(r));
+    calls = 0;
+    for (i = 1; i <= 3; i++)
+        learn(0, i);
+
+    gen_random_bytes(target, 20);
+    start_request(target, &r[0]);
+    sent = queries[0];
+
+    /* Same search, no new query */
+    start_request(target, &r[1]);
+    start_request(target, &r[2]);
+    assert_int_equal(queries[0], sent);
+    assert_true(r[0].h->search == r[1].h->search);
+    assert_true(r[0].h->search == r[2].h->search);
+    assert_true(r[0].h != r[1].h && r[1].h != r[2].h);
+
+    /* A callback may cancel its own handle */
+    r[1].cancel_self = 1;
+    deliver();
+
+    /* Called once each, in order, with the same nodes */
+    for (i = 0; i < 3; i++) {
+        assert_int_equal(r[i].calls, 1);
+        assert_int_equal(r[i].order, i + 1);
+        assert_true(r[i].found);
+        assert_memory_equal(r[i].first, r[0].first, 20);
+    }
+    assert_null(nodes[0].searches.first);
+}
+
+static void cancel_one(void **state)
+{
+    unsigned char target[20];
+    struct request r[2];
+    int i;
+
+    memset(r, 0, sizeof(r));
+    calls = 0;
+    for (i = 1; i <= 3; i++)
+        learn(0, i);
+
+    gen_random_bytes(target, 20);
+    start_request(target, &r[0]);
+    start_request(target, &r[1]);
+
+    /* Cancelled right away, the search goes on for the other caller */
+    dht_node_cancel(&nodes[0], r[0].h);
+    assert_int_equal(r[0].calls, 1);
+    assert_false(r[0].found);
+    assert_non_null(nodes[0].searches.first);
+    assert_true(nodes[0].query_count > 0);
+
+    deliver();
+    assert_int_equal(r[0].calls, 1);
+    assert_int_equal(r[1].calls, 1);
+    assert_true(r[1].found);
+    assert_null(nodes[0].searches.first);
+}
+
+static void cancel_last(void **state)
+{
+    unsigned char target[20];
+    struct request r[2];
+    size_t sent;
+    int i;
+
+    memset(r, 0, sizeof(r));
+    calls = 0;
+    for (i = 1; i <= 3; i++)
+        learn(0, i);
+
+    gen_random_bytes(target, 20);
+    start_request(target, &r[0]);
+    start_request(target, &r[1]);
+    assert_true(nodes[0].query_count > 0);
+
+    /* The network search stops with its last request */
+    dht_node_cancel(&nodes[0], r[1].h);
+    assert_non_null(nodes[0].searches.first);
+    dht_node_cancel(&nodes[0], r[0].h);
+    assert_null(nodes[0].searches.first);
+    assert_int_equal(nodes[0].query_count, 0);
+    for (i = 0; i < 2; i++) {
+        assert_int_equal(r[i].calls, 1);
+        assert_false(r[i].found);
+    }
+
+    /* The responses are ignored, nothing else is sent */
+    sent = queries[0];
+    deliver();
+    advance(SEARCH_STALE_MAX + 1);
+    dht_node_work(&nodes[0]);
+    assert_int_equal(queries[0], sent);
+    assert_int_equal(r[0].calls, 1);
+    assert_int_equal(r[1].calls, 1);
+
+    /* A new search for the same target starts from scratch */
+    start_request(target, &r[0]);
+    assert_true(queries[0] > sent);
+    deliver();
+    assert_int_equal(r[0].calls, 2);
+    assert_true(r[0].found);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(alpha_limit, setup, teardown),
+        cmocka_unit_test_setup_teardown(stale_late_response, setup,
+                                        teardown),
+        cmocka_unit_test_setup_teardown(completion, setup, teardown),
+        cmocka_unit_test_setup_teardown(query_add_failure, setup, teardown),
+        cmocka_unit_test_setup_teardown(completion_waits, setup, teardown),
+        cmocka_unit_test_setup_teardown(frontier_eviction, setup, teardown),
+        cmocka_unit_test_setup_teardown(cache_ttl, setup, teardown),
+        cmocka_unit_test_setup_teardown(cache_store_failure, setup, teardown),
+        cmocka_unit_test_setup_teardown(join, setup, teardown),
+        cmocka_unit_test_setup_teardown(cancel_one, setup, teardown),
+        cmocka_unit_test_setup_teardown(cancel_last, setup, teardown),
+    };
+
+    return cmocka_run_group_tests_name("search", tests, NULL, NULL);
+}
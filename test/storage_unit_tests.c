@@ -7,21 +7,28 @@
 
 #include <cmocka.h>
 
-#define TESTING 1
-struct dht_node;
-struct bvalue;
-static void send_response(struct dht_node *n,
-                          const unsigned char *tid, size_t tid_len,
-                          struct bvalue *ret,
-                          const struct sockaddr *dest, socklen_t addrlen);
-static void send_error(struct dht_node *n,
-                       const unsigned char *tid, size_t tid_len,
-                       int error_code, const char *error_msg,
-                       const struct sockaddr *dest, socklen_t addrlen);
-
 #include "../lib/node.c"
 #include "../lib/put.c"
 
+static const struct krpc_args *query_args(const struct bvalue *args)
+{
+    static unsigned char buf[2048];
+    static struct krpc_msg msg;
+    struct bvalue *query;
+    int rc;
+
+    query = bvalue_new_dict();
+    bvalue_dict_set(query, "a", bvalue_copy(args));
+    bvalue_dict_set(query, "y", bvalue_new_string((unsigned char *)"q", 1));
+    rc = bencode_buf(query, buf, sizeof(buf));
+    bvalue_free(query);
+
+    assert_true(rc > 0);
+    assert_int_equal(krpc_parse(buf, rc, &msg), 0);
+
+    return &msg.args;
+}
+
 static int check_token(const LargestIntegralType value,
                        const LargestIntegralType check_value_data)
 {
@@ -40,22 +47,42 @@ static int check_token(const LargestIntegralType value,
     return 1;
 }
 
-static void send_error(struct dht_node *n,
-                       const unsigned char *tid, size_t tid_len,
-                       int error_code, const char *error_msg,
-                       const struct sockaddr *dest, socklen_t addrlen)
+static void error_sent(int error_code)
 {
     check_expected(error_code);
 }
 
-static void send_response(struct dht_node *n,
-                          const unsigned char *tid, size_t tid_len,
-                          struct bvalue *ret,
-                          const struct sockaddr *dest, socklen_t addrlen)
+static void response_sent(const struct bvalue *ret)
 {
     check_expected_ptr(ret);
 }
 
+static void output(const unsigned char *data, size_t len,
+                   const struct sockaddr *dest, socklen_t addrlen,
+                   void *opaque)
+{
+    struct bvalue *msg;
+    const struct bvalue *y, *e;
+    int code;
+
+    msg = bdecode_buf(data, len);
+    assert_non_null(msg);
+
+    y = bvalue_dict_get(msg, "y");
+    assert_non_null(y);
+
+    if (!strcmp((const char *)bvalue_string(y, NULL), "r")) {
+        response_sent(bvalue_dict_get(msg, "r"));
+    } else {
+        e = bvalue_dict_get(msg, "e");
+        assert_non_null(e);
+        assert_int_equal(bvalue_integer(bvalue_list_get(e, 0), &code), 0);
+        error_sent(code);
+    }
+
+    bvalue_free(msg);
+}
+
 static int check_peers(const LargestIntegralType value,
                        const LargestIntegralType check_value_data)
 {
@@ -102,8 +129,8 @@ static void announce_get_peers(void **state)
     args = bvalue_new_dict();
     bvalue_dict_set(args, "info_hash", bvalue_new_string(info_hash, 20));
     tok = NULL;
-    expect_check(send_response, ret, check_token, &tok);
-    handle_get_peers(node, tid, sizeof(tid), args,
+    expect_check(response_sent, ret, check_token, &tok);
+    handle_get_peers(node, tid, sizeof(tid), query_args(args),
                      (struct sockaddr *)&sin, sizeof(sin));
     assert_non_null(tok);
     bvalue_free(args);
@@ -112,15 +139,15 @@ static void announce_get_peers(void **state)
     bvalue_dict_set(args, "token", tok);
     bvalue_dict_set(args, "info_hash", bvalue_new_string(info_hash, 20));
     bvalue_dict_set(args, "port", bvalue_new_integer(4444));
-    expect_any(send_response, ret);
-    handle_announce_peer(node, tid, sizeof(tid), args,
+    expect_any(response_sent, ret);
+    handle_announce_peer(node, tid, sizeof(tid), query_args(args),
                          (struct sockaddr *)&sin, sizeof(sin));
     bvalue_free(args);
 
     args = bvalue_new_dict();
     bvalue_dict_set(args, "info_hash", bvalue_new_string(info_hash, 20));
-    expect_check(send_response, ret, check_peers, "1.1.1.1:4444");
-    handle_get_peers(node, tid, sizeof(tid), args,
+    expect_check(response_sent, ret, check_peers, "1.1.1.1:4444");
+    handle_get_peers(node, tid, sizeof(tid), query_args(args),
                      (struct sockaddr *)&sin, sizeof(sin));
     bvalue_free(args);
 }
@@ -141,8 +168,8 @@ static void empty_put(void **state)
 
     args = bvalue_new_dict();
 
-    expect_value(send_error, error_code, 203);
-    handle_put(node, tid, sizeof(tid), args,
+    expect_value(error_sent, error_code, 203);
+    handle_put(node, tid, sizeof(tid), query_args(args),
                (struct sockaddr *)&sin, sizeof(sin));
     bvalue_free(args);
 }
@@ -253,8 +280,8 @@ static void immutable_put_get(void **state)
     args = bvalue_new_dict();
     bvalue_dict_set(args, "target", bvalue_new_string(target, 20));
     tok = NULL;
-    expect_check(send_response, ret, check_token, &tok);
-    handle_get(node, tid, sizeof(tid), args,
+    expect_check(response_sent, ret, check_token, &tok);
+    handle_get(node, tid, sizeof(tid), query_args(args),
                (struct sockaddr *)&sin, sizeof(sin));
     assert_non_null(tok);
     bvalue_free(args);
@@ -262,15 +289,15 @@ static void immutable_put_get(void **state)
     args = bvalue_new_dict();
     bvalue_dict_set(args, "token", tok);
     bvalue_dict_set(args, "v", val);
-    expect_any(send_response, ret);
-    handle_put(node, tid, sizeof(tid), args,
+    expect_any(response_sent, ret);
+    handle_put(node, tid, sizeof(tid), query_args(args),
                (struct sockaddr *)&sin, sizeof(sin));
     bvalue_free(args);
 
     args = bvalue_new_dict();
     bvalue_dict_set(args, "target", bvalue_new_string(target, 20));
-    expect_check(send_response, ret, check_val, data);
-    handle_get(node, tid, sizeof(tid), args,
+    expect_check(response_sent, ret, check_val, data);
+    handle_get(node, tid, sizeof(tid), query_args(args),
                (struct sockaddr *)&sin, sizeof(sin));
     bvalue_free(args);
 }
@@ -314,8 +341,8 @@ static void mutable_put_get(void **state)
     get_args = bvalue_new_dict();
     bvalue_dict_set(get_args, "target", bvalue_new_string(target, 20));
     tok = NULL;
-    expect_check(send_response, ret, check_token, &tok);
-    handle_get(node, tid, sizeof(tid), get_args,
+    expect_check(response_sent, ret, check_token, &tok);
+    handle_get(node, tid, sizeof(tid), query_args(get_args),
                (struct sockaddr *)&sin, sizeof(sin));
     assert_non_null(tok);
 
@@ -333,23 +360,51 @@ static void mutable_put_get(void **state)
     bvalue_dict_set(put_args, "k",
                     bvalue_new_string(params.pubkey, sizeof(params.pubkey)));
     bvalue_dict_set(put_args, "token", tok);
-    expect_any(send_response, ret);
-    handle_put(node, tid, sizeof(tid), put_args,
+    expect_any(response_sent, ret);
+    handle_put(node, tid, sizeof(tid), query_args(put_args),
                (struct sockaddr *)&sin, sizeof(sin));
 
-    expect_check(send_response, ret, check_mutable, &params);
-    handle_get(node, tid, sizeof(tid), get_args,
+    expect_check(response_sent, ret, check_mutable, &params);
+    handle_get(node, tid, sizeof(tid), query_args(get_args),
                (struct sockaddr *)&sin, sizeof(sin));
 
     bvalue_free(get_args);
     bvalue_free(put_args);
 }
 
+/* Expired storage is dispatched from the timer heap and freed */
+static void storage_expiry(void **state)
+{
+    struct dht_node *node = *state;
+    struct timeval past = { 1, 0 };
+    struct peer_list *pl;
+    struct put_item *item;
+    struct peer *p;
+
+    assert_non_null(node->peer_storage);
+    assert_non_null(node->put_storage);
+
+    for (pl = node->peer_storage; pl; pl = pl->next) {
+        for (p = pl->peers; p; p = p->next)
+            p->expire_time = past;
+        timer_set(node->timers, &pl->timer, &past);
+    }
+    for (item = node->put_storage; item; item = item->next) {
+        item->expire_time = past;
+        timer_set(node->timers, &item->timer, &past);
+    }
+
+    dht_node_work(node);
+
+    assert_null(node->peer_storage);
+    assert_null(node->put_storage);
+}
+
 static int setup(void **state)
 {
     struct dht_node *node = malloc(sizeof(struct dht_node));
 
-    dht_node_init(node, NULL, NULL, NULL);
+    dht_node_init(node, NULL, output, NULL);
 
     *state = node;
 
@@ -372,6 +427,7 @@ int main(void)
         cmocka_unit_test(empty_put),
         cmocka_unit_test(immutable_put_get),
         cmocka_unit_test(mutable_put_get),
+        cmocka_unit_test(storage_expiry),
     };
 
     return cmocka_run_group_tests_name("storage", tests, setup, teardown);
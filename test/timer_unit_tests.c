@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdarg.h>
+
+#include <cmocka.h>
+
+#include "../lib/timer.c"
+
+#define NTIMERS 200
+
+/* Every timer is at its index and no child expires before its parent */
+static void check_heap(const struct timer_heap *h,
+                       const struct timer *timers, size_t n)
+{
+    size_t i, scheduled = 0;
+
+    for (i = 0; i < h->count; i++) {
+        assert_int_equal(h->timers[i]->index, i);
+        if (i > 0)
+            assert_false(timer_before(h->timers[i], h->timers[(i - 1) / 2]));
+    }
+
+    for (i = 0; i < n; i++) {
+        if (timers[i].index == TIMER_IDLE)
+            continue;
+        assert_true(timers[i].index < h->count);
+        assert_true(h->timers[timers[i].index] == &timers[i]);
+        scheduled++;
+    }
+    assert_int_equal(scheduled, h->count);
+}
+
+static void set_random(struct timer_heap *h, struct timer *t)
+{
+    struct timeval tv;
+
+    tv.tv_sec = rand() % 1000;
+    tv.tv_usec = rand() % 1000000;
+    timer_set(h, t, &tv);
+}
+
+static void set_clear(void **state)
+{
+    static struct timer timers[NTIMERS];
+    struct timer_heap h;
+    size_t i;
+
+    timer_heap_init(&h);
+    for (i = 0; i < NTIMERS; i++)
+        assert_int_equal(timer_add(&h, &timers[i], 0), 0);
+    assert_null(timer_first(&h));
+
+    for (i = 0; i < NTIMERS; i++)
+        set_random(&h, &timers[i]);
+    check_heap(&h, timers, NTIMERS);
+
+    /* Clear, re-set and reschedule timers anywhere in the heap */
+    for (i = 0; i < 20000; i++) {
+        struct timer *t = &timers[rand() % NTIMERS];
+
+        switch (rand() % 3) {
+        case 0:
+            timer_clear(&h, t);
+            assert_int_equal(t->index, TIMER_IDLE);
+            break;
+        default:
+            set_random(&h, t);
+            break;
+        }
+        check_heap(&h, timers, NTIMERS);
+    }
+
+    for (i = 0; i < NTIMERS; i++)
+        timer_del(&h, &timers[i]);
+    assert_int_equal(h.count, 0);
+    assert_int_equal(h.reserved, 0);
+    timer_heap_free(&h);
+}
+
+static void expire_order(void **state)
+{
+    static struct timer timers[NTIMERS];
+    struct timeval last = { 0, 0 };
+    struct timer_heap h;
+    struct timer *t;
+    size_t i, count = 0;
+
+    timer_heap_init(&h);
+    for (i = 0; i < NTIMERS; i++) {
+        assert_int_equal(timer_add(&h, &timers[i], 0), 0);
+        set_random(&h, &timers[i]);
+    }
+
+    /* Clear every other timer from the middle of the heap */
+    for (i = 0; i < NTIMERS; i += 2)
+        timer_clear(&h, &timers[i]);
+    check_heap(&h, timers, NTIMERS);
+
+    while ((t = timer_first(&h))) {
+        assert_false(timercmp(&t->expire, &last, <));
+        last = t->expire;
+        timer_clear(&h, t);
+        count++;
+    }
+    assert_int_equal(count, NTIMERS / 2);
+
+    timer_heap_free(&h);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(set_clear),
+        cmocka_unit_test(expire_order),
+    };
+
+    return cmocka_run_group_tests_name("timer", tests, NULL, NULL);
+}